@@ -0,0 +1,204 @@
+#ifndef BINARY_FRAME_H
+#define BINARY_FRAME_H
+
+// Compact binary protocol for the config port, alongside JSON lines.
+//
+// Each message is one frame: 0x00, the COBS encoding of a packet, 0x00.
+// COBS removes every zero byte from the packet, and JSON lines never contain
+// one, so the handler tells the two protocols apart by the first byte.
+//
+//   request   id u16 | CBOR map {"cmd": text, "params": map} | crc32
+//   response  id u16 | status u8 | CBOR data (ok) or text (error) | crc32
+//
+// Multi-byte fields are little-endian; the CRC is the archive CRC-32
+// (LibraryArchive.h) over everything before it. Responses use indefinite-
+// length CBOR maps and arrays, so they can be encoded while they stream.
+//
+// No Arduino dependencies: host tools include this file directly.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "LibraryArchive.h"
+
+#define FRAME_DELIMITER 0x00
+#define FRAME_STATUS_OK 0
+#define FRAME_STATUS_ERROR 1
+#define FRAME_NO_ID 0xFFFF  // Reply id for frames too damaged to carry one
+#define FRAME_EVENT_ID 0xFFFE  // Pushed events (subscribe)
+
+// CBOR major types and simple values (RFC 8949)
+#define CBOR_UINT 0
+#define CBOR_NEGINT 1
+#define CBOR_BYTES 2
+#define CBOR_TEXT 3
+#define CBOR_ARRAY 4
+#define CBOR_MAP 5
+#define CBOR_TAG 6
+#define CBOR_SIMPLE 7
+
+#define CBOR_FALSE 0xF4
+#define CBOR_TRUE 0xF5
+#define CBOR_NULL 0xF6
+#define CBOR_UNDEFINED 0xF7
+#define CBOR_FLOAT16 0xF9
+#define CBOR_FLOAT32 0xFA
+#define CBOR_FLOAT64 0xFB
+#define CBOR_ARRAY_START 0x9F
+#define CBOR_MAP_START 0xBF
+#define CBOR_BREAK 0xFF
+
+// Item head for a major type and argument; returns its length (1-9 bytes)
+inline size_t cborHead(uint8_t major, uint64_t v, uint8_t* out) {
+    major <<= 5;
+    if (v < 24) {
+        out[0] = major | v;
+        return 1;
+    }
+    size_t n = v <= 0xFF ? 1 : v <= 0xFFFF ? 2 : v <= 0xFFFFFFFFULL ? 4 : 8;
+    out[0] = major | (n == 1 ? 24 : n == 2 ? 25 : n == 4 ? 26 : 27);
+    for (size_t i = 0; i < n; i++) out[n - i] = (uint8_t)(v >> (8 * i));
+    return n + 1;
+}
+
+// Decodes a COBS frame body (no delimiters) in place. Returns the packet
+// length, or 0 if the encoding is invalid.
+inline size_t cobsDecode(uint8_t* buf, size_t len) {
+    size_t r = 0, w = 0;
+    while (r < len) {
+        uint8_t code = buf[r++];
+        if (code == 0 || r + code - 1 > len) return 0;
+        for (uint8_t i = 1; i < code; i++) buf[w++] = buf[r++];
+        if (code < 0xFF && r < len) buf[w++] = 0;
+    }
+    return w;
+}
+
+// Streaming frame encoder. Bytes are COBS-encoded in blocks of at most 254
+// as they arrive, so memory use is independent of the packet size. Out needs
+// write(uint8_t) and write(const uint8_t*, size_t) (Arduino Print, or a host
+// buffer).
+template <typename Out>
+class FrameEncoder {
+private:
+    Out& out;
+    uint8_t block[254];
+    uint8_t n;
+    uint32_t crc;
+    bool started;
+
+    void emitBlock(uint8_t code) {
+        out.write(code);
+        if (n) out.write(block, n);
+        n = 0;
+    }
+
+    void encode(uint8_t b) {
+        if (b == 0) {
+            emitBlock(n + 1);
+        } else {
+            block[n++] = b;
+            if (n == sizeof(block)) emitBlock(0xFF);
+        }
+    }
+
+public:
+    explicit FrameEncoder(Out& out) : out(out), n(0), crc(0), started(false) {}
+
+    void write(const uint8_t* data, size_t len) {
+        if (!started) {
+            out.write((uint8_t)FRAME_DELIMITER);
+            started = true;
+        }
+        crc = crc32Update(crc, data, len);
+        for (size_t i = 0; i < len; i++) encode(data[i]);
+    }
+
+    void write(uint8_t b) { write(&b, 1); }
+
+    // Appends the CRC and closes the frame
+    void finish() {
+        uint8_t tail[4];
+        putLe32(tail, crc);
+        write(tail, sizeof(tail));
+        emitBlock(n + 1);
+        out.write((uint8_t)FRAME_DELIMITER);
+        crc = 0;
+        started = false;
+    }
+};
+
+// Checks and strips the trailing CRC of a decoded packet; returns the
+// payload length, or -1 if the CRC does not match
+inline int framePayload(const uint8_t* packet, size_t len) {
+    if (len < 4) return -1;
+    if (crc32(packet, len - 4) != getLe32(packet + len - 4)) return -1;
+    return (int)(len - 4);
+}
+
+// Sequential CBOR item reader over a decoded packet
+struct CborReader {
+    uint8_t* p;
+    uint8_t* end;
+
+    CborReader(uint8_t* data, size_t len) : p(data), end(data + len) {}
+
+    bool atEnd() const { return p >= end; }
+
+    bool atBreak() const { return p < end && *p == CBOR_BREAK; }
+
+    // Reads an item head. *indefinite is set for 0x9F/0xBF/0x5F/0x7F;
+    // simple values and floats leave their argument in *v.
+    bool head(uint8_t* major, uint64_t* v, bool* indefinite) {
+        if (p >= end) return false;
+        uint8_t b = *p++;
+        *major = b >> 5;
+        uint8_t info = b & 0x1F;
+        *indefinite = false;
+        *v = 0;
+        if (info < 24) {
+            *v = info;
+            return true;
+        }
+        if (info == 31) {
+            *indefinite = true;
+            return *major >= CBOR_BYTES && *major <= CBOR_MAP;
+        }
+        if (info > 27) return false;
+        size_t n = (size_t)1 << (info - 24);
+        if ((size_t)(end - p) < n) return false;
+        for (size_t i = 0; i < n; i++) *v = (*v << 8) | *p++;
+        return true;
+    }
+
+    // Reads a definite-length text string of len bytes (head already read)
+    // and returns it NUL-terminated in place. The text is moved one byte
+    // back over its head, which has been consumed, so no copy is needed.
+    char* text(size_t len) {
+        if ((size_t)(end - p) < len) return nullptr;
+        char* s = (char*)p - 1;
+        memmove(s, p, len);
+        s[len] = '\0';
+        p += len;
+        return s;
+    }
+};
+
+// Half-precision to float (CBOR encoders use it for small values)
+inline float cborHalf(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    int exp = (h >> 10) & 0x1F;
+    uint32_t mant = h & 0x3FF;
+    float f;
+    if (exp == 0) {
+        f = mant / 16777216.0f;  // 2^-24
+    } else if (exp == 31) {
+        f = mant ? __builtin_nanf("") : __builtin_inff();
+    } else {
+        uint32_t bits = ((uint32_t)(exp + 112) << 23) | (mant << 13);
+        memcpy(&f, &bits, 4);
+    }
+    return sign ? -f : f;
+}
+
+#endif // BINARY_FRAME_H
@@ -0,0 +1,420 @@
+#ifndef BLE_LINK_H
+#define BLE_LINK_H
+
+// Tracks the BLE keyboard link: notification completion and connection
+// parameters.
+//
+// Bluedroid raises ESP_GATTS_CONF_EVT once a notification has been handed to
+// the controller, which is the BLE counterpart of the USB IN-endpoint
+// complete callback. The typing engine waits on that instead of sleeping a
+// fixed interval per character. Writes to the keyboard's output report
+// (host LED state) feed the typing sync barrier; its handle is picked out
+// while the HID service registers, by the Report Reference descriptor that
+// marks it as an output report. Confirmations and writes
+// for the config UART service (BleUart.h) are told apart by handle, so
+// config traffic does not disturb typing pacing.
+//
+// The stack's default connection interval (often 30-50 ms) bounds both the
+// first keystroke and keys per second. While typing the link asks for a
+// 7.5-15 ms interval with no slave latency, and relaxes to a slower interval
+// with latency once idle to save power. Centrals may refuse or adjust a
+// request; the outcome is recorded for get_ble_status.
+//
+// Reconnects: when the link drops (or at boot) and a bonded host is known,
+// the device first sends high-duty directed advertising to that host, then
+// fast undirected advertising for a short window, then slow advertising.
+// Hosts that connect with a rotating private address may ignore the directed
+// phase; the fast window still covers them.
+
+#include <Arduino.h>
+#include <BLEDevice.h>
+#include "TypingSync.h"
+
+#define BLE_LOCAL_MTU 247
+#define BLE_IDLE_AFTER_MS 5000
+#define BLE_DIRECTED_ADV_MS 1280   // Spec limit for high-duty directed advertising
+#define BLE_FAST_ADV_MS 30000
+
+#define BLE_UUID_HID_REPORT 0x2A4D
+#define BLE_UUID_REPORT_REFERENCE 0x2908
+#define BLE_REPORT_TYPE_OUTPUT 0x02
+
+enum BleAdvPhase : uint8_t {
+    BLE_ADV_NONE = 0,
+    BLE_ADV_DIRECTED,
+    BLE_ADV_FAST,
+    BLE_ADV_SLOW
+};
+
+inline const char* bleAdvPhaseName(uint8_t phase) {
+    switch (phase) {
+        case BLE_ADV_DIRECTED: return "directed";
+        case BLE_ADV_FAST: return "fast";
+        case BLE_ADV_SLOW: return "slow";
+        default: return "none";
+    }
+}
+
+// Connection parameters in controller units (interval 1.25 ms, timeout 10 ms)
+struct BleConnParams {
+    uint16_t minInterval;
+    uint16_t maxInterval;
+    uint16_t latency;
+    uint16_t timeout;
+};
+
+const BleConnParams BLE_PARAMS_FAST = {6, 12, 0, 400};   // 7.5-15 ms, 4 s supervision
+const BleConnParams BLE_PARAMS_IDLE = {36, 60, 6, 600};  // 45-75 ms, 6 s supervision
+
+class BleLinkMonitor {
+private:
+    volatile uint32_t queued;
+    volatile uint32_t completed;
+    volatile uint32_t uartQueued;
+    volatile uint32_t uartConfirmed;
+    uint16_t uartRx;  // Config UART characteristic handles, 0 until it is added
+    uint16_t uartTx;
+    uint16_t reportChar;  // Last HID report characteristic added
+    uint16_t ledReport;   // HID output report (host LEDs), 0 until it is added
+    uint32_t timeouts;
+    HostLeds* leds;
+
+    bool enabled;
+    volatile bool connected;
+    esp_bd_addr_t peer;
+    volatile uint16_t interval;   // 1.25 ms units
+    volatile uint16_t latency;
+    volatile uint16_t supervision;  // 10 ms units
+    volatile uint16_t mtu;
+    bool fast;
+    unsigned long lastActivity;
+    uint32_t updates;
+    uint32_t failures;
+    volatile uint8_t lastFailure;
+
+    // Bonded host and advertising state
+    esp_bd_addr_t host;
+    uint8_t hostType;
+    bool hostKnown;
+    volatile bool hostChanged;
+    volatile bool secured;
+    volatile bool restartAdv;
+    uint8_t advPhase;
+    unsigned long phaseStart;
+    volatile unsigned long connectedAt;
+    volatile unsigned long lostAt;
+    volatile uint32_t reconnectMs;
+    volatile uint8_t reconnectPhase;
+    volatile uint32_t reconnects;
+
+    bool hostIsBonded() {
+        int count = esp_ble_get_bond_device_num();
+        if (count <= 0) return false;
+        esp_ble_bond_dev_t* list = (esp_ble_bond_dev_t*)malloc(sizeof(esp_ble_bond_dev_t) * count);
+        if (!list) return false;
+        bool found = false;
+        if (esp_ble_get_bond_device_list(&count, list) == ESP_OK) {
+            for (int i = 0; i < count && !found; i++) {
+                found = memcmp(list[i].bd_addr, host, sizeof(esp_bd_addr_t)) == 0;
+            }
+        }
+        free(list);
+        return found;
+    }
+
+    void startAdvertising(uint8_t phase) {
+        esp_ble_gap_stop_advertising();
+        if (phase == BLE_ADV_DIRECTED) {
+            esp_ble_adv_params_t params;
+            memset(&params, 0, sizeof(params));
+            params.adv_int_min = 0x20;
+            params.adv_int_max = 0x20;
+            params.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+            params.own_addr_type = BLE_ADDR_TYPE_PUBLIC;
+            memcpy(params.peer_addr, host, sizeof(esp_bd_addr_t));
+            params.peer_addr_type = (esp_ble_addr_type_t)hostType;
+            params.channel_map = ADV_CHNL_ALL;
+            params.adv_filter_policy = ADV_FILTER_ALLOW_SCAN_ANY_CON_ANY;
+            esp_ble_gap_start_advertising(&params);
+        } else {
+            // Units of 0.625 ms: 20-30 ms fast, ~1 s slow
+            BLEAdvertising* adv = BLEDevice::getAdvertising();
+            adv->setMinInterval(phase == BLE_ADV_FAST ? 0x20 : 0x640);
+            adv->setMaxInterval(phase == BLE_ADV_FAST ? 0x30 : 0x690);
+            adv->start();
+        }
+        advPhase = phase;
+        phaseStart = millis();
+    }
+
+    // False if the stack refused to send the request
+    bool request(const BleConnParams& p) {
+        esp_ble_conn_update_params_t update;
+        memcpy(update.bda, peer, sizeof(esp_bd_addr_t));
+        update.min_int = p.minInterval;
+        update.max_int = p.maxInterval;
+        update.latency = p.latency;
+        update.timeout = p.timeout;
+        esp_err_t err = esp_ble_gap_update_conn_params(&update);
+        if (err != ESP_OK) {
+            failures++;
+            lastFailure = err & 0xFF;
+            return false;
+        }
+        return true;
+    }
+
+    static bool isUuid16(const esp_bt_uuid_t& uuid, uint16_t value) {
+        return uuid.len == ESP_UUID_LEN_16 && uuid.uuid.uuid16 == value;
+    }
+
+    static BleLinkMonitor*& active() {
+        static BleLinkMonitor* monitor = nullptr;
+        return monitor;
+    }
+
+    static void gattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gattsIf, esp_ble_gatts_cb_param_t* param) {
+        BleLinkMonitor* self = active();
+        if (!self) return;
+        switch (event) {
+            case ESP_GATTS_CONF_EVT:
+                if (self->uartTx && param->conf.handle == self->uartTx) self->uartConfirmed++;
+                else self->completed++;
+                break;
+            case ESP_GATTS_ADD_CHAR_EVT:
+                if (isUuid16(param->add_char.char_uuid, BLE_UUID_HID_REPORT)) {
+                    self->reportChar = param->add_char.attr_handle;
+                }
+                break;
+            case ESP_GATTS_ADD_CHAR_DESCR_EVT:
+                // Report Reference: {report ID, type}, type 2 for an output report
+                if (self->reportChar && isUuid16(param->add_char_descr.descr_uuid, BLE_UUID_REPORT_REFERENCE)) {
+                    uint16_t len = 0;
+                    const uint8_t* ref = nullptr;
+                    if (esp_ble_gatts_get_attr_value(param->add_char_descr.attr_handle, &len, &ref) == ESP_GATT_OK &&
+                        len == 2 && ref[1] == BLE_REPORT_TYPE_OUTPUT) {
+                        self->ledReport = self->reportChar;
+                    }
+                    self->reportChar = 0;
+                }
+                break;
+            case ESP_GATTS_WRITE_EVT:
+                if (self->leds && self->ledReport && param->write.handle == self->ledReport &&
+                    param->write.len == 1 && !param->write.is_prep) {
+                    noteHostLeds(*self->leds, param->write.value[0]);
+                }
+                break;
+            case ESP_GATTS_CONNECT_EVT:
+                if (self->leds) self->leds->echoes = true;
+                memcpy(self->peer, param->connect.remote_bda, sizeof(esp_bd_addr_t));
+                self->interval = param->connect.conn_params.interval;
+                self->latency = param->connect.conn_params.latency;
+                self->supervision = param->connect.conn_params.timeout;
+                self->mtu = 23;
+                self->fast = false;
+                self->secured = false;
+                self->connectedAt = millis();
+                self->reconnectMs = self->connectedAt - self->lostAt;
+                self->reconnectPhase = self->advPhase;
+                self->reconnects++;
+                self->advPhase = BLE_ADV_NONE;
+                self->connected = true;
+                break;
+            case ESP_GATTS_DISCONNECT_EVT:
+                // Nothing still in flight will be confirmed now
+                self->completed = self->queued;
+                self->uartConfirmed = self->uartQueued;
+                self->connected = false;
+                self->secured = false;
+                self->lostAt = millis();
+                self->restartAdv = true;
+                break;
+            case ESP_GATTS_MTU_EVT:
+                self->mtu = param->mtu.mtu;
+                break;
+            default:
+                break;
+        }
+    }
+
+    static void gapEvent(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param_t* param) {
+        BleLinkMonitor* self = active();
+        if (!self) return;
+        if (event == ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT) {
+            if (param->update_conn_params.status == ESP_BT_STATUS_SUCCESS) {
+                self->interval = param->update_conn_params.conn_int;
+                self->latency = param->update_conn_params.latency;
+                self->supervision = param->update_conn_params.timeout;
+                self->updates++;
+            } else {
+                // Refused: not fast, so the next finger asks again
+                self->fast = false;
+                self->failures++;
+                self->lastFailure = param->update_conn_params.status;
+            }
+        } else if (event == ESP_GAP_BLE_AUTH_CMPL_EVT && param->ble_security.auth_cmpl.success &&
+                   (param->ble_security.auth_cmpl.auth_mode & ESP_LE_AUTH_BOND)) {
+            const uint8_t* addr = param->ble_security.auth_cmpl.bd_addr;
+            if (!self->hostKnown || memcmp(self->host, addr, sizeof(esp_bd_addr_t)) != 0 ||
+                self->hostType != param->ble_security.auth_cmpl.addr_type) {
+                memcpy(self->host, addr, sizeof(esp_bd_addr_t));
+                self->hostType = param->ble_security.auth_cmpl.addr_type;
+                self->hostKnown = true;
+                self->hostChanged = true;
+            }
+            self->secured = true;
+        }
+    }
+
+public:
+    BleLinkMonitor()
+        : queued(0), completed(0), uartQueued(0), uartConfirmed(0), uartRx(0), uartTx(0), reportChar(0), ledReport(0), timeouts(0), leds(nullptr), enabled(false), connected(false),
+          interval(0), latency(0), supervision(0), mtu(23), fast(false), lastActivity(0),
+          updates(0), failures(0), lastFailure(0), hostType(0), hostKnown(false),
+          hostChanged(false), secured(false), restartAdv(false), advPhase(BLE_ADV_NONE),
+          phaseStart(0), connectedAt(0), lostAt(0), reconnectMs(0), reconnectPhase(BLE_ADV_NONE),
+          reconnects(0) {}
+
+    // Last bonded host, restored from NVS before begin()
+    void setHost(const uint8_t addr[6], uint8_t addrType) {
+        memcpy(host, addr, sizeof(esp_bd_addr_t));
+        hostType = addrType;
+        hostKnown = true;
+    }
+
+    // True once after the host changed, so the caller can persist it
+    bool takeHostChange(uint8_t addr[6], uint8_t* addrType) {
+        if (!hostChanged) return false;
+        hostChanged = false;
+        memcpy(addr, host, sizeof(esp_bd_addr_t));
+        *addrType = hostType;
+        return true;
+    }
+
+    // Call before BleKeyboard::begin(), so the HID service's registration
+    // is seen and the LED output report found
+    void watch() {
+        active() = this;
+        BLEDevice::setCustomGattsHandler(gattsEvent);
+    }
+
+    // Call after BLEDevice::init() (BleKeyboard::begin())
+    void begin(HostLeds* hostLeds = nullptr) {
+        leds = hostLeds;
+        watch();
+        BLEDevice::setCustomGapHandler(gapEvent);
+        BLEDevice::setMTU(BLE_LOCAL_MTU);
+
+        // Forget a host whose bond was removed
+        if (hostKnown && !hostIsBonded()) hostKnown = false;
+    }
+
+    // Disabled, the link is dropped and the device stops advertising until
+    // enabled again. Enabling counts as the start of a reconnect.
+    void setEnabled(bool on) {
+        if (on == enabled) return;
+        enabled = on;
+        if (on) {
+            lostAt = millis();
+            restartAdv = true;
+            return;
+        }
+        advPhase = BLE_ADV_NONE;
+        esp_ble_gap_stop_advertising();
+        if (connected) esp_ble_gap_disconnect(peer);
+    }
+
+    bool isEnabled() const { return enabled; }
+
+    // Called when a finger is seen, so the faster interval is usually in
+    // place by the time the match has finished and typing starts
+    void requestFast() {
+        lastActivity = millis();
+        if (connected && !fast) {
+            fast = true;  // Set first: a refusal can arrive before request() returns
+            if (!request(BLE_PARAMS_FAST)) fast = false;
+        }
+    }
+
+    // Called from the command task; relaxes the link after BLE_IDLE_AFTER_MS without typing
+    // and steps the advertising phases while disconnected
+    void poll() {
+        unsigned long now = millis();
+        if (!enabled) {
+            // BleKeyboard restarts advertising itself after a disconnect
+            if (restartAdv) {
+                restartAdv = false;
+                esp_ble_gap_stop_advertising();
+            }
+            return;
+        }
+        if (connected) {
+            if (fast && now - lastActivity >= BLE_IDLE_AFTER_MS) {
+                fast = false;
+                request(BLE_PARAMS_IDLE);
+            }
+            return;
+        }
+
+        if (restartAdv) {
+            restartAdv = false;
+            startAdvertising(hostKnown ? BLE_ADV_DIRECTED : BLE_ADV_FAST);
+        } else if (advPhase == BLE_ADV_DIRECTED && now - phaseStart >= BLE_DIRECTED_ADV_MS) {
+            startAdvertising(BLE_ADV_FAST);
+        } else if (advPhase == BLE_ADV_FAST && now - phaseStart >= BLE_FAST_ADV_MS) {
+            startAdvertising(BLE_ADV_SLOW);
+        }
+    }
+
+    bool isConnected() const { return connected; }
+
+    // Connected to a bonded host over an encrypted link. Nothing is typed
+    // before that: keystrokes on an open link could be read by anyone nearby.
+    bool isReady() const {
+        return enabled && connected && secured;
+    }
+
+    bool hasHost() const { return hostKnown; }
+    const char* advertising() const { return bleAdvPhaseName(advPhase); }
+    uint32_t lastReconnectMs() const { return reconnectMs; }
+    const char* lastReconnectVia() const { return bleAdvPhaseName(reconnectPhase); }
+    uint32_t reconnectCount() const { return reconnects; }
+
+    bool isFast() const { return fast; }
+    float intervalMs() const { return interval * 1.25f; }
+    uint16_t slaveLatency() const { return latency; }
+    uint32_t supervisionMs() const { return supervision * 10UL; }
+    uint16_t negotiatedMtu() const { return mtu; }
+    uint32_t paramUpdates() const { return updates; }
+    uint32_t paramFailures() const { return failures; }
+    uint8_t lastFailureCode() const { return lastFailure; }
+
+    void noteQueued() { queued++; }
+
+    bool waitComplete(uint32_t timeoutMs) {
+        unsigned long start = millis();
+        while ((int32_t)(queued - completed) > 0) {
+            if (millis() - start >= timeoutMs) {
+                completed = queued;
+                timeouts++;
+                return false;
+            }
+            delay(1);
+        }
+        return true;
+    }
+
+    uint32_t notifyTimeouts() const { return timeouts; }
+
+    // Config UART service (BleUart.h)
+    void setUartHandles(uint16_t rx, uint16_t tx) {
+        uartRx = rx;
+        uartTx = tx;
+    }
+
+    void noteUartQueued() { uartQueued++; }
+
+    uint32_t uartInFlight() const { return uartQueued - uartConfirmed; }
+};
+
+#endif // BLE_LINK_H
@@ -0,0 +1,155 @@
+#ifndef BLE_UART_H
+#define BLE_UART_H
+
+// Config port over BLE, next to the HID service.
+//
+// A GATT service with the Nordic UART UUIDs, which most BLE terminal apps
+// and Web Bluetooth tools know: the client writes command lines to RX and
+// receives replies and events as notifications on TX. It is a Stream, so
+// SerialCommandHandler serves it like the USB port, with its own line
+// assembler and transmit ring.
+//
+// Writes arrive on the Bluetooth task and are copied into a ring that the
+// command task reads, so the only state shared between the two is the
+// ring's head and tail. Output goes out one notification (MTU - 3 bytes) at
+// a time, with at most BLE_UART_WINDOW not yet confirmed by the stack;
+// availableForWrite() reports 0 otherwise, so the transmit ring waits
+// instead of the command task. Both characteristics require an encrypted
+// link: only a bonded host can read or change the configuration.
+
+#include <Arduino.h>
+#include <BLEDevice.h>
+#include <BLE2902.h>
+#include "BleLink.h"
+
+#define BLE_UART_SERVICE_UUID "6E400001-B5A3-F393-E0A9-E50E24DCCA9E"
+#define BLE_UART_RX_UUID      "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
+#define BLE_UART_TX_UUID      "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
+#define BLE_UART_RX_SIZE 2048
+#define BLE_UART_WINDOW 4  // Notifications in flight
+
+class BleUartStream : public Stream, public BLECharacteristicCallbacks {
+private:
+    BleLinkMonitor* link;
+    BLECharacteristic* rxChar;
+    BLECharacteristic* txChar;
+    BLE2902* cccd;
+
+    uint8_t rx[BLE_UART_RX_SIZE];
+    volatile size_t rxHead;  // Advanced by the command task
+    volatile size_t rxTail;  // Advanced by the Bluetooth task
+    volatile uint32_t rxDropped;
+
+    size_t rxCount() const { return (rxTail - rxHead + BLE_UART_RX_SIZE) % BLE_UART_RX_SIZE; }
+
+public:
+    BleUartStream()
+        : link(nullptr), rxChar(nullptr), txChar(nullptr), cccd(nullptr),
+          rxHead(0), rxTail(0), rxDropped(0) {}
+
+    // Adds the service to the running GATT server; call once BLE is up
+    // (after BleLinkMonitor::begin())
+    bool begin(BleLinkMonitor& monitor) {
+        if (txChar) return true;
+        BLEServer* server = BLEDevice::getServer();
+        if (!server) return false;
+        link = &monitor;
+
+        BLEService* service = server->createService(BLE_UART_SERVICE_UUID);
+        rxChar = service->createCharacteristic(BLE_UART_RX_UUID,
+            BLECharacteristic::PROPERTY_WRITE | BLECharacteristic::PROPERTY_WRITE_NR);
+        rxChar->setAccessPermissions(ESP_GATT_PERM_WRITE_ENCRYPTED);
+        rxChar->setCallbacks(this);
+
+        txChar = service->createCharacteristic(BLE_UART_TX_UUID, BLECharacteristic::PROPERTY_NOTIFY);
+        cccd = new BLE2902();
+        cccd->setAccessPermissions(ESP_GATT_PERM_READ_ENCRYPTED | ESP_GATT_PERM_WRITE_ENCRYPTED);
+        txChar->addDescriptor(cccd);
+        service->start();
+
+        monitor.setUartHandles(rxChar->getHandle(), txChar->getHandle());
+        return true;
+    }
+
+    bool isStarted() const { return txChar != nullptr; }
+
+    // A client is connected and listening for replies
+    bool isOpen() const {
+        return txChar && link->isConnected() && cccd->getNotifications();
+    }
+
+    uint32_t droppedBytes() const { return rxDropped; }
+
+    // Bluetooth task
+    void onWrite(BLECharacteristic* characteristic) override {
+        const uint8_t* data = characteristic->getData();
+        size_t len = characteristic->getLength();
+        size_t tail = rxTail;
+        for (size_t i = 0; i < len; i++) {
+            size_t next = (tail + 1) % BLE_UART_RX_SIZE;
+            if (next == rxHead) {
+                rxDropped += len - i;
+                break;
+            }
+            rx[tail] = data[i];
+            tail = next;
+        }
+        rxTail = tail;
+    }
+
+    int available() override { return rxCount(); }
+
+    int peek() override { return rxHead == rxTail ? -1 : rx[rxHead]; }
+
+    int read() override {
+        if (rxHead == rxTail) return -1;
+        uint8_t b = rx[rxHead];
+        rxHead = (rxHead + 1) % BLE_UART_RX_SIZE;
+        return b;
+    }
+
+    size_t readBytes(char* buffer, size_t length) {
+        size_t n = 0;
+        unsigned long start = millis();
+        while (n < length) {
+            if (rxHead == rxTail) {
+                if (millis() - start >= _timeout) break;
+                delay(1);
+                continue;
+            }
+            size_t chunk = rxCount();
+            if (chunk > BLE_UART_RX_SIZE - rxHead) chunk = BLE_UART_RX_SIZE - rxHead;
+            if (chunk > length - n) chunk = length - n;
+            memcpy(buffer + n, rx + rxHead, chunk);
+            rxHead = (rxHead + chunk) % BLE_UART_RX_SIZE;
+            n += chunk;
+        }
+        return n;
+    }
+
+    // One notification's worth while the window has room
+    int availableForWrite() override {
+        if (!isOpen() || link->uartInFlight() >= BLE_UART_WINDOW) return 0;
+        return link->negotiatedMtu() - 3;
+    }
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        if (!isOpen()) return len;  // Nobody listening: dropped like on a closed port
+        size_t chunkMax = link->negotiatedMtu() - 3;
+        size_t sent = 0;
+        while (sent < len) {
+            size_t chunk = len - sent < chunkMax ? len - sent : chunkMax;
+            txChar->setValue((uint8_t*)data + sent, chunk);
+            txChar->notify();
+            link->noteUartQueued();
+            sent += chunk;
+        }
+        return len;
+    }
+
+    void flush() override {}
+};
+
+#endif // BLE_UART_H
@@ -0,0 +1,56 @@
+#ifndef BOOT_SNAPSHOT_H
+#define BOOT_SNAPSHOT_H
+
+// Boot-critical state carried across a software reset in RTC_NOINIT memory.
+// The region survives ESP.restart() but holds garbage after power-on, so the
+// snapshot is only trusted when magic, version and CRC all check out, and it
+// is consumed (invalidated) on read so a crash loop falls back to a full init.
+
+#include <stdint.h>
+#include <stddef.h>
+#include "LibraryArchive.h"
+
+#define BOOT_SNAPSHOT_MAGIC 0x54504253  // "TPBS"
+#define BOOT_SNAPSHOT_VERSION 2
+
+struct BootSnapshot {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t keyboardMode;  // KeyboardMode
+    uint8_t reserved;
+    uint16_t librarySize;
+    uint16_t templateCount;
+    uint16_t packetSize;
+    uint16_t reserved2;
+    uint32_t fpBaud;
+    uint8_t occupancy[32];
+    uint32_t crc;
+};
+
+inline uint32_t bootSnapshotCrc(const BootSnapshot& snap) {
+    return crc32((const uint8_t*)&snap, offsetof(BootSnapshot, crc));
+}
+
+inline void sealBootSnapshot(BootSnapshot& snap) {
+    snap.magic = BOOT_SNAPSHOT_MAGIC;
+    snap.version = BOOT_SNAPSHOT_VERSION;
+    snap.reserved = 0;
+    snap.reserved2 = 0;
+    snap.crc = bootSnapshotCrc(snap);
+}
+
+inline bool validBootSnapshot(const BootSnapshot& snap) {
+    if (snap.magic != BOOT_SNAPSHOT_MAGIC || snap.version != BOOT_SNAPSHOT_VERSION) return false;
+    if (snap.crc != bootSnapshotCrc(snap)) return false;
+    if (snap.librarySize == 0 || snap.librarySize > 1000) return false;
+    if (snap.templateCount > snap.librarySize) return false;
+    if (snap.keyboardMode > 2) return false;
+    return snap.fpBaud >= 9600 && snap.fpBaud <= 115200 && snap.fpBaud % 9600 == 0;
+}
+
+inline void invalidateBootSnapshot(BootSnapshot& snap) {
+    snap.magic = 0;
+    snap.crc = 0;
+}
+
+#endif // BOOT_SNAPSHOT_H
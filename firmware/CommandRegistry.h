@@ -0,0 +1,149 @@
+#ifndef COMMAND_REGISTRY_H
+#define COMMAND_REGISTRY_H
+
+// Serial command table.
+//
+// A command is one line of TOUCHPASS_COMMANDS:
+//   name       wire name
+//   handler    implemented in firmware.ino
+//   args       PARAMS if the handler takes the params object, else NONE
+//   flags      COMMAND_* metadata below
+//   maxParams  largest params object accepted, in serialized JSON bytes
+//   required   space-separated params that must be present
+//
+// The handler declarations, the dispatch table and a collision-free hash of
+// the names are generated from this list at compile time, so dispatch is one
+// hash, one table read and one strcmp, and the handler checks for required
+// params and oversized params in one place (SerialCommandHandler).
+//
+// Sensor and blocking commands sent with an id run as queued jobs, so the
+// port keeps answering quick commands while they wait (see
+// SerialCommandHandler::queueJob). A batch is marked STREAMS only so it runs
+// at once: its params do not fit a job. It is marked SENSOR because its
+// commands may be, so it holds the sensor lock throughout (Tasks.h).
+// get_status and get_fingers are not SENSOR: they read it only when their
+// answer is not cached, and take the lock themselves on that path.
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include "JsonWriter.h"
+
+#define COMMAND_SENSOR 0x01  // Talks to the fingerprint sensor
+#define COMMAND_BLOCKS 0x02  // Can take longer than ~100 ms
+#define COMMAND_WRITES 0x04  // Changes stored settings or the template library
+#define COMMAND_STREAMS 0x08 // Never queued or batched: uses the port directly, or is a batch
+#define COMMAND_METADATA 0x10 // Only writes NVS settings and can safely run twice; allowed in an atomic batch
+
+#define TOUCHPASS_COMMANDS(X) \
+    X(get_status,        getStatusJson,        PARAMS, 0,                                                64,   "") \
+    X(get_detect,        getDetectJson,        NONE,   0,                                                0,    "") \
+    X(get_fingers,       getFingersJson,       PARAMS, 0,                                                64,   "") \
+    X(enroll_start,      enrollStartJson,      PARAMS, COMMAND_SENSOR | COMMAND_WRITES,                  512,  "name") \
+    X(enroll_status,     getEnrollStatusJson,  NONE,   COMMAND_SENSOR,                                   0,    "") \
+    X(enroll_cancel,     enrollCancelJson,     NONE,   COMMAND_SENSOR,                                   0,    "") \
+    X(delete_finger,     deleteFingerJson,     PARAMS, COMMAND_SENSOR | COMMAND_BLOCKS | COMMAND_WRITES, 32,   "id") \
+    X(empty_library,     emptyLibraryJson,     NONE,   COMMAND_SENSOR | COMMAND_BLOCKS | COMMAND_WRITES, 0,    "") \
+    X(get_ble_status,    getBLEStatusJson,     NONE,   0,                                                0,    "") \
+    X(get_finger,        getFingerJson,        PARAMS, 0,                                                32,   "id") \
+    X(update_finger,     updateFingerJson,     PARAMS, COMMAND_WRITES | COMMAND_METADATA,                1024, "id") \
+    X(get_system_info,   getSystemInfoJson,    NONE,   0,                                                0,    "") \
+    X(get_keyboard_mode, getKeyboardModeJson,  NONE,   0,                                                0,    "") \
+    X(set_keyboard_mode, setKeyboardModeJson,  PARAMS, COMMAND_BLOCKS | COMMAND_WRITES,                  32,   "") \
+    X(reboot,            rebootJson,           NONE,   0,                                                0,    "") \
+    X(diagnostics,       getDiagnosticsJson,   NONE,   0,                                                0,    "") \
+    X(crypto_bench,      cryptoBenchJson,      NONE,   COMMAND_BLOCKS,                                   0,    "") \
+    X(export_library,    exportLibraryJson,    NONE,   COMMAND_SENSOR | COMMAND_BLOCKS | COMMAND_STREAMS, 0, "") \
+    X(import_library,    importLibraryJson,    PARAMS, COMMAND_SENSOR | COMMAND_BLOCKS | COMMAND_WRITES | COMMAND_STREAMS, 32, "") \
+    X(set_time,          setTimeJson,          PARAMS, COMMAND_WRITES,                                   32,   "epoch") \
+    X(totp_selftest,     totpSelfTestJson,     NONE,   0,                                                0,    "") \
+    X(get_typing,        getTypingJson,        NONE,   0,                                                0,    "") \
+    X(set_typing,        setTypingJson,        PARAMS, COMMAND_WRITES | COMMAND_METADATA,                128,  "") \
+    X(command_stats,     commandStatsJson,     NONE,   0,                                                0,    "") \
+    X(subscribe,         subscribeJson,        PARAMS, 0,                                                32,   "") \
+    X(unsubscribe,       unsubscribeJson,      NONE,   0,                                                0,    "") \
+    X(batch,             batchJson,            PARAMS, COMMAND_SENSOR | COMMAND_BLOCKS | COMMAND_STREAMS, 1900, "commands")
+
+// Handler declarations
+#define COMMAND_DECLARE_NONE(fn) void fn(JsonWriter& out);
+#define COMMAND_DECLARE_PARAMS(fn) void fn(JsonObject params, JsonWriter& out);
+#define COMMAND_DECLARE(name, fn, args, flags, maxParams, required) COMMAND_DECLARE_##args(fn)
+TOUCHPASS_COMMANDS(COMMAND_DECLARE)
+
+typedef void (*CommandHandler)(JsonObject params, JsonWriter& out);
+
+struct CommandInfo {
+    const char* name;
+    CommandHandler handler;
+    uint8_t flags;
+    uint16_t maxParams;
+    const char* required;
+};
+
+#define COMMAND_CALL_NONE(fn) [](JsonObject, JsonWriter& out) { fn(out); }
+#define COMMAND_CALL_PARAMS(fn) [](JsonObject params, JsonWriter& out) { fn(params, out); }
+#define COMMAND_ENTRY(name, fn, args, flags, maxParams, required) \
+    {#name, COMMAND_CALL_##args(fn), flags, maxParams, required},
+
+constexpr CommandInfo COMMANDS[] = {
+    TOUCHPASS_COMMANDS(COMMAND_ENTRY)
+};
+
+constexpr size_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+constexpr unsigned COMMAND_SLOT_BITS = 6;
+constexpr size_t COMMAND_SLOTS = 1 << COMMAND_SLOT_BITS;
+static_assert(COMMAND_COUNT * 2 <= COMMAND_SLOTS, "Command table too small for the hash");
+
+// FNV-1a with a seed mixed into the offset basis. The slot comes from the
+// top bits: the low bits of an FNV product only depend on the low bits of
+// its inputs.
+constexpr size_t commandSlot(const char* s, uint32_t seed) {
+    uint32_t h = 2166136261UL ^ seed;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619UL;
+    }
+    return h >> (32 - COMMAND_SLOT_BITS);
+}
+
+constexpr bool commandSeedWorks(uint32_t seed) {
+    bool used[COMMAND_SLOTS] = {};
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        size_t slot = commandSlot(COMMANDS[i].name, seed);
+        if (used[slot]) return false;
+        used[slot] = true;
+    }
+    return true;
+}
+
+// First seed that puts every command name in its own slot
+constexpr uint32_t commandSeed() {
+    for (uint32_t seed = 0; seed < 20000; seed++) {
+        if (commandSeedWorks(seed)) return seed;
+    }
+    return UINT32_MAX;
+}
+
+constexpr uint32_t COMMAND_SEED = commandSeed();
+static_assert(COMMAND_SEED != UINT32_MAX, "No perfect hash seed for the command names");
+
+struct CommandSlots {
+    uint8_t index[COMMAND_SLOTS];  // Command index + 1, 0 = empty
+};
+
+constexpr CommandSlots commandSlots() {
+    CommandSlots t = {};
+    for (size_t i = 0; i < COMMAND_COUNT; i++) {
+        t.index[commandSlot(COMMANDS[i].name, COMMAND_SEED)] = i + 1;
+    }
+    return t;
+}
+
+constexpr CommandSlots COMMAND_TABLE = commandSlots();
+
+// Index into COMMANDS, or -1 for an unknown name
+inline int findCommand(const char* name) {
+    uint8_t i = COMMAND_TABLE.index[commandSlot(name, COMMAND_SEED)];
+    return i && strcmp(COMMANDS[i - 1].name, name) == 0 ? i - 1 : -1;
+}
+
+#endif // COMMAND_REGISTRY_H
@@ -0,0 +1,161 @@
+#ifndef CREDENTIAL_CRYPTO_H
+#define CREDENTIAL_CRYPTO_H
+
+// At-rest encryption for stored credentials.
+//
+// Blob layout (v1):
+//   [0]                version (CRED_BLOB_VERSION)
+//   [1 .. 12]          GCM nonce
+//   [13 .. 13+n)       ciphertext
+//   [13+n .. 29+n)     GCM tag
+//
+// The slot number (and for non-password blobs a kind byte) is bound in as
+// additional data, so a blob copied to another slot or key fails
+// authentication. On the ESP32 the mbedtls AES and SHA primitives are backed
+// by the hardware accelerators (CONFIG_MBEDTLS_HARDWARE_AES/SHA); on a host
+// the same code runs against software mbedtls, which keeps the format
+// testable off-device.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+
+#define CRED_BLOB_VERSION 0x01
+#define CRED_NONCE_LEN 12
+#define CRED_TAG_LEN 16
+#define CRED_KEY_LEN 32
+#define CRED_OVERHEAD (1 + CRED_NONCE_LEN + CRED_TAG_LEN)
+#define CRED_MAX_PLAINTEXT 256
+#define CRED_MAX_BLOB (CRED_MAX_PLAINTEXT + CRED_OVERHEAD)
+#define CRED_MAX_SEALED 2048  // Largest plaintext of any kind (batch journal)
+
+#define CRED_KIND_PASSWORD 0
+#define CRED_KIND_TOTP 1
+#define CRED_KIND_STREAM 2
+#define CRED_KIND_JOURNAL 3
+#define CRED_KIND_DEVICE_KEY 4
+
+// Fixed-size plaintext buffer that is wiped when it goes out of scope
+template <size_t N>
+class SecureArray {
+private:
+    char buf[N + 1];
+    size_t len;
+
+public:
+    SecureArray() : len(0) { buf[0] = '\0'; }
+    ~SecureArray() { wipe(); }
+
+    SecureArray(const SecureArray&) = delete;
+    SecureArray& operator=(const SecureArray&) = delete;
+
+    char* data() { return buf; }
+    const char* c_str() const { return buf; }
+    const uint8_t* bytes() const { return (const uint8_t*)buf; }
+    size_t length() const { return len; }
+    size_t capacity() const { return N; }
+    char operator[](size_t i) const { return buf[i]; }
+
+    void setLength(size_t n) {
+        len = n < N ? n : N;
+        buf[len] = '\0';
+    }
+
+    void wipe() {
+        mbedtls_platform_zeroize(buf, sizeof(buf));
+        len = 0;
+    }
+};
+
+typedef SecureArray<CRED_MAX_PLAINTEXT> SecureBuffer;
+
+class CredentialCrypto {
+private:
+    mbedtls_gcm_context gcm;
+    bool ready;
+
+    static size_t slotAad(uint16_t slot, uint8_t kind, uint8_t aad[3]) {
+        aad[0] = slot >> 8;
+        aad[1] = slot & 0xFF;
+        if (kind == CRED_KIND_PASSWORD) return 2;
+        aad[2] = kind;
+        return 3;
+    }
+
+public:
+    CredentialCrypto() : ready(false) { mbedtls_gcm_init(&gcm); }
+    ~CredentialCrypto() { mbedtls_gcm_free(&gcm); }
+
+    // Derive the credential key from the device secret (HMAC-SHA256) and
+    // expand the AES key schedule once, so the touch path only pays for the
+    // per-blob GCM pass.
+    bool begin(const uint8_t deviceSecret[CRED_KEY_LEN]) {
+        static const char label[] = "touchpass-cred-v1";
+        uint8_t key[CRED_KEY_LEN];
+        const mbedtls_md_info_t* sha = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+        if (!sha || mbedtls_md_hmac(sha, deviceSecret, CRED_KEY_LEN,
+                                    (const uint8_t*)label, sizeof(label) - 1, key) != 0) {
+            return false;
+        }
+        ready = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, CRED_KEY_LEN * 8) == 0;
+        mbedtls_platform_zeroize(key, sizeof(key));
+        return ready;
+    }
+
+    bool isReady() const { return ready; }
+
+    static size_t blobSize(size_t plainLen) { return plainLen + CRED_OVERHEAD; }
+
+    // Returns the blob length written to out, or 0 on failure
+    size_t seal(uint16_t slot, const char* plain, size_t plainLen,
+                const uint8_t nonce[CRED_NONCE_LEN], uint8_t* out, size_t outCap,
+                uint8_t kind = CRED_KIND_PASSWORD) {
+        if (!ready || plainLen > CRED_MAX_SEALED || outCap < blobSize(plainLen)) return 0;
+
+        uint8_t aad[3];
+        size_t aadLen = slotAad(slot, kind, aad);
+        out[0] = CRED_BLOB_VERSION;
+        memcpy(out + 1, nonce, CRED_NONCE_LEN);
+        uint8_t* cipher = out + 1 + CRED_NONCE_LEN;
+        uint8_t* tag = cipher + plainLen;
+
+        if (mbedtls_gcm_crypt_and_tag(&gcm, MBEDTLS_GCM_ENCRYPT, plainLen,
+                                      nonce, CRED_NONCE_LEN, aad, aadLen,
+                                      (const uint8_t*)plain, cipher,
+                                      CRED_TAG_LEN, tag) != 0) {
+            mbedtls_platform_zeroize(out, outCap);
+            return 0;
+        }
+        return blobSize(plainLen);
+    }
+
+    template <size_t N>
+    bool open(uint16_t slot, const uint8_t* blob, size_t blobLen, SecureArray<N>& out,
+              uint8_t kind = CRED_KIND_PASSWORD) {
+        out.wipe();
+        if (!ready || blobLen < CRED_OVERHEAD || blob[0] != CRED_BLOB_VERSION) return false;
+
+        size_t plainLen = blobLen - CRED_OVERHEAD;
+        if (plainLen > out.capacity()) return false;
+
+        uint8_t aad[3];
+        size_t aadLen = slotAad(slot, kind, aad);
+        const uint8_t* nonce = blob + 1;
+        const uint8_t* cipher = nonce + CRED_NONCE_LEN;
+        const uint8_t* tag = cipher + plainLen;
+
+        if (mbedtls_gcm_auth_decrypt(&gcm, plainLen, nonce, CRED_NONCE_LEN,
+                                     aad, aadLen, tag, CRED_TAG_LEN,
+                                     cipher, (uint8_t*)out.data()) != 0) {
+            out.wipe();
+            return false;
+        }
+        out.setLength(plainLen);
+        return true;
+    }
+};
+
+#endif // CREDENTIAL_CRYPTO_H
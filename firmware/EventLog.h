@@ -0,0 +1,71 @@
+#ifndef EVENT_LOG_H
+#define EVENT_LOG_H
+
+// Recent device events for pushed notifications.
+//
+// Events are small fixed records numbered from 1; the ring keeps the last
+// EVENT_LOG_SIZE, so a client that reconnects can ask for everything after
+// the last sequence number it saw. Names and other strings are looked up
+// when an event is sent, not stored.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define EVENT_LOG_SIZE 32
+
+enum EventType : uint8_t {
+    EVENT_DETECT,    // a: slot (-1 = no match), b: score, c: sensor result code
+    EVENT_ENROLL,    // a: enrollment state, b: success (when done), c: slot
+    EVENT_KEYBOARD,  // a: connected, b: keyboard mode
+    EVENT_LIBRARY    // a: template count, b: slot (-1 = all), c: LibraryChange
+};
+
+enum LibraryChange : uint8_t {
+    LIBRARY_ADDED,
+    LIBRARY_UPDATED,
+    LIBRARY_REMOVED,
+    LIBRARY_CLEARED,
+    LIBRARY_IMPORTED
+};
+
+struct Event {
+    uint32_t seq;
+    uint32_t ms;
+    EventType type;
+    int16_t a;
+    int16_t b;
+    int16_t c;
+};
+
+class EventLog {
+private:
+    Event ring[EVENT_LOG_SIZE];
+    uint32_t nextSeq;
+
+public:
+    EventLog() : nextSeq(1) {}
+
+    uint32_t push(EventType type, uint32_t ms, int16_t a = 0, int16_t b = 0, int16_t c = 0) {
+        Event& e = ring[nextSeq % EVENT_LOG_SIZE];
+        e.seq = nextSeq;
+        e.ms = ms;
+        e.type = type;
+        e.a = a;
+        e.b = b;
+        e.c = c;
+        return nextSeq++;
+    }
+
+    // Newest sequence number, 0 if nothing has happened yet
+    uint32_t latest() const { return nextSeq - 1; }
+
+    // Oldest sequence number still held
+    uint32_t oldest() const { return nextSeq > EVENT_LOG_SIZE ? nextSeq - EVENT_LOG_SIZE : 1; }
+
+    const Event* find(uint32_t seq) const {
+        if (seq < oldest() || seq >= nextSeq) return nullptr;
+        return &ring[seq % EVENT_LOG_SIZE];
+    }
+};
+
+#endif // EVENT_LOG_H
@@ -0,0 +1,236 @@
+#ifndef HID_STREAM_H
+#define HID_STREAM_H
+
+// Pre-rendered keyboard report streams.
+//
+// A credential's whole key sequence is rendered once, when it changes, by
+// running HidTypist against a recording sink. The touch path then only
+// replays ready-made reports.
+//
+//   Header (4 bytes): version, layout id, rollover limit, flags
+//   Ops:
+//     HS_PRESS   mod key   new report holding one key
+//     HS_ADD     key       add a key to the current report
+//     HS_RELEASE           all keys up
+//     HS_REPORT  mod n k.. arbitrary report (n <= 6)
+//     HS_DELAY   ms u16    pause (little-endian)
+//     HS_TOTP              type the current one-time code here
+//
+// A stream whose header does not match the current version, layout or
+// rollover limit is stale and must be rendered again.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "HidTypist.h"
+
+#define HID_STREAM_VERSION 1
+#define HID_STREAM_HEADER 4
+#define HID_STREAM_MAX 1024
+
+#define HID_STREAM_FLAG_TOTP 0x01
+
+#define HID_SETTLE_MS 50  // Before typing, after Tab and before Enter
+
+enum HidStreamOp : uint8_t {
+    HS_PRESS = 1,
+    HS_ADD = 2,
+    HS_RELEASE = 3,
+    HS_REPORT = 4,
+    HS_DELAY = 5,
+    HS_TOTP = 6
+};
+
+struct CredentialSpec {
+    const char* username;
+    size_t usernameLen;
+    const char* password;
+    size_t passwordLen;
+    bool totp;
+    bool totpOnly;    // Code replaces the password
+    bool pressEnter;
+};
+
+class HidStreamRecorder : public ReportSink {
+private:
+    uint8_t* out;
+    size_t cap;
+    size_t pos;
+    bool overflow;
+    HidReport prev;
+
+    void put(uint8_t b) {
+        if (pos < cap) out[pos++] = b;
+        else overflow = true;
+    }
+
+    static uint8_t keyCount(const HidReport& r) {
+        uint8_t n = 0;
+        while (n < HID_ROLLOVER_KEYS && r.keys[n]) n++;
+        return n;
+    }
+
+public:
+    HidStreamRecorder(uint8_t* out, size_t cap) : out(out), cap(cap), pos(0), overflow(false) {
+        memset(&prev, 0, sizeof(prev));
+    }
+
+    void header(uint8_t layout, uint8_t maxHeld, uint8_t flags) {
+        put(HID_STREAM_VERSION);
+        put(layout);
+        put(maxHeld);
+        put(flags);
+    }
+
+    bool sendReport(const HidReport& r) override {
+        uint8_t n = keyCount(r);
+        uint8_t p = keyCount(prev);
+        if (n == 0 && r.modifiers == 0) {
+            put(HS_RELEASE);
+        } else if (n == 1 && p == 0) {
+            put(HS_PRESS);
+            put(r.modifiers);
+            put(r.keys[0]);
+        } else if (n == p + 1 && r.modifiers == prev.modifiers &&
+                   memcmp(r.keys, prev.keys, p) == 0) {
+            put(HS_ADD);
+            put(r.keys[p]);
+        } else {
+            put(HS_REPORT);
+            put(r.modifiers);
+            put(n);
+            for (uint8_t i = 0; i < n; i++) put(r.keys[i]);
+        }
+        prev = r;
+        return true;
+    }
+
+    bool waitSent(uint32_t timeoutMs) override { return true; }
+
+    void pause(uint16_t ms) {
+        put(HS_DELAY);
+        put(ms & 0xFF);
+        put(ms >> 8);
+    }
+
+    void totp() { put(HS_TOTP); }
+
+    size_t length() const { return overflow ? 0 : pos; }
+};
+
+// Renders username, Tab, password, one-time code and Enter (each optional).
+// Returns the stream length, or 0 if it does not fit.
+inline size_t renderCredential(const CredentialSpec& c, uint8_t layout, const TypingPace& pace,
+                               uint8_t* out, size_t cap) {
+    HidStreamRecorder rec(out, cap);
+    HidTypist typist(rec, pace, hidLayout(layout));
+    rec.header(layout, typist.maxHeldKeys(), c.totp ? HID_STREAM_FLAG_TOTP : 0);
+
+    typist.releaseAll();
+    rec.pause(HID_SETTLE_MS);
+    if (c.usernameLen > 0) {
+        typist.type(c.username, c.usernameLen);
+        typist.tap(0, HID_KEY_TAB);
+        rec.pause(HID_SETTLE_MS);
+    }
+    if (!(c.totp && c.totpOnly)) typist.type(c.password, c.passwordLen);
+    if (c.totp) rec.totp();
+    if (c.pressEnter) {
+        rec.pause(HID_SETTLE_MS);
+        typist.tap(0, HID_KEY_ENTER);
+    }
+    return rec.length();
+}
+
+inline bool hidStreamCurrent(const uint8_t* stream, size_t len, uint8_t layout, uint8_t maxHeld) {
+    return len >= HID_STREAM_HEADER && stream[0] == HID_STREAM_VERSION &&
+           stream[1] == layout && stream[2] == maxHeld;
+}
+
+inline bool hidStreamHasTotp(const uint8_t* stream) {
+    return stream[3] & HID_STREAM_FLAG_TOTP;
+}
+
+// Templated on the sink so playback into a concrete (final) transport is
+// inlined; HidStreamPlayer plays into any ReportSink through the vtable.
+template <typename Sink>
+class BasicHidStreamPlayer {
+private:
+    Sink& sink;
+    uint16_t ackTimeoutMs;
+    HidReport report;
+    uint8_t held;
+    uint32_t sent;
+    uint32_t timeouts;
+
+    bool emit() {
+        if (!sink.sendReport(report)) return false;
+        sent++;
+        if (!sink.waitSent(ackTimeoutMs)) timeouts++;
+        return true;
+    }
+
+public:
+    BasicHidStreamPlayer(Sink& sink, uint16_t ackTimeoutMs)
+        : sink(sink), ackTimeoutMs(ackTimeoutMs), held(0), sent(0), timeouts(0) {
+        memset(&report, 0, sizeof(report));
+    }
+
+    // pause(ms) sleeps; totp(sink) types the current code and returns false
+    // if it cannot. Stops at the first malformed op or failed send.
+    template <typename Pause, typename Totp>
+    bool play(const uint8_t* stream, size_t len, Pause pause, Totp totp) {
+        size_t pos = HID_STREAM_HEADER;
+        while (pos < len) {
+            uint8_t op = stream[pos++];
+            switch (op) {
+                case HS_PRESS:
+                    if (pos + 2 > len) return false;
+                    memset(&report, 0, sizeof(report));
+                    report.modifiers = stream[pos];
+                    report.keys[0] = stream[pos + 1];
+                    held = 1;
+                    pos += 2;
+                    break;
+                case HS_ADD:
+                    if (pos + 1 > len || held >= HID_ROLLOVER_KEYS) return false;
+                    report.keys[held++] = stream[pos++];
+                    break;
+                case HS_RELEASE:
+                    memset(&report, 0, sizeof(report));
+                    held = 0;
+                    break;
+                case HS_REPORT: {
+                    if (pos + 2 > len) return false;
+                    uint8_t n = stream[pos + 1];
+                    if (n > HID_ROLLOVER_KEYS || pos + 2 + n > len) return false;
+                    memset(&report, 0, sizeof(report));
+                    report.modifiers = stream[pos];
+                    memcpy(report.keys, stream + pos + 2, n);
+                    held = n;
+                    pos += 2 + n;
+                    break;
+                }
+                case HS_DELAY:
+                    if (pos + 2 > len) return false;
+                    pause(stream[pos] | (stream[pos + 1] << 8));
+                    pos += 2;
+                    continue;
+                case HS_TOTP:
+                    if (!totp(sink)) return false;
+                    continue;
+                default:
+                    return false;
+            }
+            if (!emit()) return false;
+        }
+        return true;
+    }
+
+    uint32_t reportsSent() const { return sent; }
+    uint32_t ackTimeouts() const { return timeouts; }
+};
+
+typedef BasicHidStreamPlayer<ReportSink> HidStreamPlayer;
+
+#endif // HID_STREAM_H
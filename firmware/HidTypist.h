@@ -0,0 +1,193 @@
+#ifndef HID_TYPIST_H
+#define HID_TYPIST_H
+
+// Report-level typing engine.
+//
+// Text is translated to boot-protocol keyboard reports in one pass. Distinct
+// keys that share a modifier state are pressed cumulatively in one rollover
+// report (up to 6 keys) and released together, so "abc" costs four reports
+// instead of six. Each report waits for the transport's completion signal
+// (ReportSink::waitSent) rather than a fixed per-character sleep.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define HID_MOD_LEFT_SHIFT 0x02
+#define HID_MOD_RIGHT_ALT 0x40   // AltGr
+// Right GUI never takes part in a printable character, so layout tables use
+// its bit to mark dead keys, which are followed by Space to type them alone.
+#define HID_MOD_DEAD 0x80
+#define HID_KEY_ENTER 0x28
+#define HID_KEY_TAB 0x2b
+#define HID_KEY_SPACE 0x2c
+#define HID_ROLLOVER_KEYS 6
+
+// Keys stay held for at most this long while a rollover group builds up, so
+// slow safety pacing never reaches the host's typematic repeat delay.
+#define HID_MAX_HOLD_MS 150
+
+// Same layout as the KeyReport both keyboard libraries send
+struct HidReport {
+    uint8_t modifiers;
+    uint8_t reserved;
+    uint8_t keys[HID_ROLLOVER_KEYS];
+};
+
+struct HidKey {
+    uint8_t modifiers;
+    uint8_t key;  // 0 = not typeable
+};
+
+enum HidLayoutId : uint8_t {
+    HID_LAYOUT_US = 0,
+    HID_LAYOUT_DE = 1
+};
+
+// Layout tables are indexed by 7-bit ASCII. Changing an entry changes the
+// rendered form of stored credentials, so bump HID_STREAM_VERSION with it.
+
+// US
+constexpr HidKey HID_ASCII_US[128] = {
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x00
+    {0x00, 0x2a}, {0x00, 0x2b}, {0x00, 0x28}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x08
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x10
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x18
+    {0x00, 0x2c}, {0x02, 0x1e}, {0x02, 0x34}, {0x02, 0x20}, {0x02, 0x21}, {0x02, 0x22}, {0x02, 0x24}, {0x00, 0x34},  // 0x20
+    {0x02, 0x26}, {0x02, 0x27}, {0x02, 0x25}, {0x02, 0x2e}, {0x00, 0x36}, {0x00, 0x2d}, {0x00, 0x37}, {0x00, 0x38},  // 0x28
+    {0x00, 0x27}, {0x00, 0x1e}, {0x00, 0x1f}, {0x00, 0x20}, {0x00, 0x21}, {0x00, 0x22}, {0x00, 0x23}, {0x00, 0x24},  // 0x30
+    {0x00, 0x25}, {0x00, 0x26}, {0x02, 0x33}, {0x00, 0x33}, {0x02, 0x36}, {0x00, 0x2e}, {0x02, 0x37}, {0x02, 0x38},  // 0x38
+    {0x02, 0x1f}, {0x02, 0x04}, {0x02, 0x05}, {0x02, 0x06}, {0x02, 0x07}, {0x02, 0x08}, {0x02, 0x09}, {0x02, 0x0a},  // 0x40
+    {0x02, 0x0b}, {0x02, 0x0c}, {0x02, 0x0d}, {0x02, 0x0e}, {0x02, 0x0f}, {0x02, 0x10}, {0x02, 0x11}, {0x02, 0x12},  // 0x48
+    {0x02, 0x13}, {0x02, 0x14}, {0x02, 0x15}, {0x02, 0x16}, {0x02, 0x17}, {0x02, 0x18}, {0x02, 0x19}, {0x02, 0x1a},  // 0x50
+    {0x02, 0x1b}, {0x02, 0x1c}, {0x02, 0x1d}, {0x00, 0x2f}, {0x00, 0x31}, {0x00, 0x30}, {0x02, 0x23}, {0x02, 0x2d},  // 0x58
+    {0x00, 0x35}, {0x00, 0x04}, {0x00, 0x05}, {0x00, 0x06}, {0x00, 0x07}, {0x00, 0x08}, {0x00, 0x09}, {0x00, 0x0a},  // 0x60
+    {0x00, 0x0b}, {0x00, 0x0c}, {0x00, 0x0d}, {0x00, 0x0e}, {0x00, 0x0f}, {0x00, 0x10}, {0x00, 0x11}, {0x00, 0x12},  // 0x68
+    {0x00, 0x13}, {0x00, 0x14}, {0x00, 0x15}, {0x00, 0x16}, {0x00, 0x17}, {0x00, 0x18}, {0x00, 0x19}, {0x00, 0x1a},  // 0x70
+    {0x00, 0x1b}, {0x00, 0x1c}, {0x00, 0x1d}, {0x02, 0x2f}, {0x02, 0x31}, {0x02, 0x30}, {0x02, 0x35}, {0x00, 0x00},  // 0x78
+};
+
+// German QWERTZ (ISO)
+constexpr HidKey HID_ASCII_DE[128] = {
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x00
+    {0x00, 0x2a}, {0x00, 0x2b}, {0x00, 0x28}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x08
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x10
+    {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00}, {0x00, 0x00},  // 0x18
+    {0x00, 0x2c}, {0x02, 0x1e}, {0x02, 0x1f}, {0x00, 0x32}, {0x02, 0x21}, {0x02, 0x22}, {0x02, 0x23}, {0x02, 0x32},  // 0x20
+    {0x02, 0x25}, {0x02, 0x26}, {0x02, 0x30}, {0x00, 0x30}, {0x00, 0x36}, {0x00, 0x38}, {0x00, 0x37}, {0x02, 0x24},  // 0x28
+    {0x00, 0x27}, {0x00, 0x1e}, {0x00, 0x1f}, {0x00, 0x20}, {0x00, 0x21}, {0x00, 0x22}, {0x00, 0x23}, {0x00, 0x24},  // 0x30
+    {0x00, 0x25}, {0x00, 0x26}, {0x02, 0x37}, {0x02, 0x36}, {0x00, 0x64}, {0x02, 0x27}, {0x02, 0x64}, {0x02, 0x2d},  // 0x38
+    {0x40, 0x14}, {0x02, 0x04}, {0x02, 0x05}, {0x02, 0x06}, {0x02, 0x07}, {0x02, 0x08}, {0x02, 0x09}, {0x02, 0x0a},  // 0x40
+    {0x02, 0x0b}, {0x02, 0x0c}, {0x02, 0x0d}, {0x02, 0x0e}, {0x02, 0x0f}, {0x02, 0x10}, {0x02, 0x11}, {0x02, 0x12},  // 0x48
+    {0x02, 0x13}, {0x02, 0x14}, {0x02, 0x15}, {0x02, 0x16}, {0x02, 0x17}, {0x02, 0x18}, {0x02, 0x19}, {0x02, 0x1a},  // 0x50
+    {0x02, 0x1b}, {0x02, 0x1d}, {0x02, 0x1c}, {0x40, 0x25}, {0x40, 0x2d}, {0x40, 0x26}, {0x80, 0x35}, {0x02, 0x38},  // 0x58
+    {0x82, 0x2e}, {0x00, 0x04}, {0x00, 0x05}, {0x00, 0x06}, {0x00, 0x07}, {0x00, 0x08}, {0x00, 0x09}, {0x00, 0x0a},  // 0x60
+    {0x00, 0x0b}, {0x00, 0x0c}, {0x00, 0x0d}, {0x00, 0x0e}, {0x00, 0x0f}, {0x00, 0x10}, {0x00, 0x11}, {0x00, 0x12},  // 0x68
+    {0x00, 0x13}, {0x00, 0x14}, {0x00, 0x15}, {0x00, 0x16}, {0x00, 0x17}, {0x00, 0x18}, {0x00, 0x19}, {0x00, 0x1a},  // 0x70
+    {0x00, 0x1b}, {0x00, 0x1d}, {0x00, 0x1c}, {0x40, 0x24}, {0x40, 0x64}, {0x40, 0x27}, {0x40, 0x30}, {0x00, 0x00},  // 0x78
+};
+
+inline const HidKey* hidLayout(uint8_t id) {
+    return id == HID_LAYOUT_DE ? HID_ASCII_DE : HID_ASCII_US;
+}
+
+inline const char* hidLayoutName(uint8_t id) {
+    return id == HID_LAYOUT_DE ? "de" : "us";
+}
+
+class ReportSink {
+public:
+    virtual ~ReportSink() {}
+    virtual bool sendReport(const HidReport& report) = 0;
+    // Blocks until the transport has taken the last report, or timeoutMs passes.
+    // Returns false on timeout.
+    virtual bool waitSent(uint32_t timeoutMs) = 0;
+};
+
+struct TypingPace {
+    uint16_t gapMs;         // Extra settle time after every report (0 = completion only)
+    uint16_t ackTimeoutMs;  // Longest wait for a completion signal
+};
+
+// Rollover group size that keeps keys held for at most HID_MAX_HOLD_MS
+inline uint8_t hidMaxHeld(const TypingPace& pace) {
+    uint32_t perReport = pace.gapMs ? pace.gapMs : 1;
+    uint32_t n = HID_MAX_HOLD_MS / perReport;
+    if (n < 1) return 1;
+    return n > HID_ROLLOVER_KEYS ? HID_ROLLOVER_KEYS : n;
+}
+
+class HidTypist {
+private:
+    ReportSink& sink;
+    const HidKey* layout;
+    TypingPace pace;
+    HidReport report;
+    uint8_t held;
+    uint8_t maxHeld;
+    uint32_t sent;
+    uint32_t timeouts;
+
+    bool emit() {
+        if (!sink.sendReport(report)) return false;
+        sent++;
+        if (!sink.waitSent(pace.ackTimeoutMs)) timeouts++;
+        return true;
+    }
+
+    bool holds(uint8_t key) const {
+        for (uint8_t i = 0; i < held; i++) {
+            if (report.keys[i] == key) return true;
+        }
+        return false;
+    }
+
+public:
+    HidTypist(ReportSink& sink, const TypingPace& pace, const HidKey* layout = HID_ASCII_US)
+        : sink(sink), layout(layout), pace(pace), held(0), sent(0), timeouts(0) {
+        memset(&report, 0, sizeof(report));
+        maxHeld = hidMaxHeld(pace);
+    }
+
+    bool press(uint8_t modifiers, uint8_t key) {
+        if (held > 0 && (modifiers != report.modifiers || held >= maxHeld || holds(key))) {
+            if (!releaseAll()) return false;
+        }
+        report.modifiers = modifiers;
+        report.keys[held++] = key;
+        return emit();
+    }
+
+    bool releaseAll() {
+        memset(&report, 0, sizeof(report));
+        held = 0;
+        return emit();
+    }
+
+    // Characters outside the layout are skipped. Keys are left released.
+    bool type(const char* text, size_t len) {
+        for (size_t i = 0; i < len; i++) {
+            uint8_t c = (uint8_t)text[i];
+            if (c >= 128 || layout[c].key == 0) continue;
+            const HidKey& k = layout[c];
+            if (k.modifiers & HID_MOD_DEAD) {
+                // Typed on its own so it cannot combine with a held key
+                if (held > 0 && !releaseAll()) return false;
+                if (!tap(k.modifiers & ~HID_MOD_DEAD, k.key) || !tap(0, HID_KEY_SPACE)) return false;
+            } else if (!press(k.modifiers, k.key)) {
+                return false;
+            }
+        }
+        return held == 0 || releaseAll();
+    }
+
+    bool tap(uint8_t modifiers, uint8_t key) {
+        return press(modifiers, key) && releaseAll();
+    }
+
+    uint8_t maxHeldKeys() const { return maxHeld; }
+    uint32_t reportsSent() const { return sent; }
+    uint32_t ackTimeouts() const { return timeouts; }
+};
+
+#endif // HID_TYPIST_H
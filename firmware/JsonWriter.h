@@ -0,0 +1,301 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+// Streaming JSON output with a small fixed buffer.
+//
+// Handlers write their response straight into the transport instead of
+// concatenating Strings: tokens go into a 128-byte buffer that is flushed to
+// the Print whenever it fills, so a response of any length needs no heap.
+// Commas are inserted automatically and string values are escaped, so names
+// containing quotes or control characters still produce valid JSON.
+//
+//   out.beginObject();
+//   out.field("ok", true);
+//   out.key("fingers").beginArray();
+//   ...
+//   out.endArray().endObject();
+//
+// An optional prefix (the response envelope) is written in front of the
+// first token, so a handler can still send raw bytes to the port before it
+// starts its JSON (export_library).
+//
+// With JSON_CBOR the same calls produce CBOR for the binary protocol
+// (BinaryFrame.h): objects and arrays become indefinite-length maps and
+// arrays, numbers are encoded natively and floats as float32.
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <stdarg.h>
+#include "BinaryFrame.h"
+
+#define JSON_WRITER_BUF 128
+#define JSON_WRITER_DEPTH 16
+
+enum JsonEncoding {
+    JSON_TEXT,
+    JSON_CBOR
+};
+
+class JsonWriter {
+private:
+    Print& out;
+    const uint8_t* prefix;
+    size_t prefixLen;
+    bool cbor;
+    char buf[JSON_WRITER_BUF];
+    size_t len;
+    size_t total;
+    uint8_t depth;
+    uint16_t hasItems;  // Bit per nesting level: a value has been written
+    bool afterKey;
+
+    void put(char c) {
+        if (prefix) startOutput();
+        if (len == sizeof(buf)) flush();
+        buf[len++] = c;
+    }
+
+    void put(const char* s, size_t n) {
+        if (prefix) startOutput();
+        while (n > 0) {
+            if (len == sizeof(buf)) flush();
+            size_t chunk = sizeof(buf) - len < n ? sizeof(buf) - len : n;
+            memcpy(buf + len, s, chunk);
+            len += chunk;
+            s += chunk;
+            n -= chunk;
+        }
+    }
+
+    void put(const char* s) { put(s, strlen(s)); }
+
+    void startOutput() {
+        const uint8_t* p = prefix;
+        prefix = nullptr;
+        put((const char*)p, prefixLen);
+    }
+
+    void cborHeadOut(uint8_t major, uint64_t v) {
+        uint8_t h[9];
+        put((const char*)h, cborHead(major, v, h));
+    }
+
+    void separate() {
+        if (cbor) return;
+        if (afterKey) {
+            afterKey = false;
+            return;
+        }
+        if (depth == 0) return;
+        uint16_t bit = 1 << (depth - 1);
+        if (hasItems & bit) put(',');
+        hasItems |= bit;
+    }
+
+    void open(char c) {
+        separate();
+        if (cbor) put((char)(c == '{' ? CBOR_MAP_START : CBOR_ARRAY_START));
+        else put(c);
+        if (depth < JSON_WRITER_DEPTH) depth++;
+        hasItems &= ~(1 << (depth - 1));
+    }
+
+    void close(char c) {
+        if (depth > 0) depth--;
+        put(cbor ? (char)CBOR_BREAK : c);
+    }
+
+    void quoted(const char* s, size_t n) {
+        static const char hex[] = "0123456789abcdef";
+        if (cbor) {
+            cborHeadOut(CBOR_TEXT, n);
+            put(s, n);
+            return;
+        }
+        put('"');
+        for (size_t i = 0; i < n; i++) {
+            char c = s[i];
+            switch (c) {
+                case '"': put("\\\"", 2); break;
+                case '\\': put("\\\\", 2); break;
+                case '\n': put("\\n", 2); break;
+                case '\r': put("\\r", 2); break;
+                case '\t': put("\\t", 2); break;
+                default:
+                    if ((uint8_t)c < 0x20) {
+                        char esc[6] = {'\\', 'u', '0', '0', hex[(c >> 4) & 0xF], hex[c & 0xF]};
+                        put(esc, sizeof(esc));
+                    } else {
+                        put(c);
+                    }
+            }
+        }
+        put('"');
+    }
+
+    JsonWriter& number(const char* fmt, ...) {
+        char tmp[24];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(tmp, sizeof(tmp), fmt, args);
+        va_end(args);
+        separate();
+        put(tmp, n < (int)sizeof(tmp) ? n : sizeof(tmp) - 1);
+        return *this;
+    }
+
+    JsonWriter& integer(long long v) {
+        if (v < 0) cborHeadOut(CBOR_NEGINT, (uint64_t)(-1 - v));
+        else cborHeadOut(CBOR_UINT, (uint64_t)v);
+        return *this;
+    }
+
+    void variant(JsonVariantConst v) {
+        if (v.is<JsonObjectConst>()) {
+            beginObject();
+            for (JsonPairConst kv : v.as<JsonObjectConst>()) {
+                key(kv.key().c_str());
+                variant(kv.value());
+            }
+            endObject();
+        } else if (v.is<JsonArrayConst>()) {
+            beginArray();
+            for (JsonVariantConst item : v.as<JsonArrayConst>()) variant(item);
+            endArray();
+        } else if (v.is<bool>()) {
+            value(v.as<bool>());
+        } else if (v.is<long>()) {
+            value(v.as<long>());
+        } else if (v.is<unsigned long>()) {
+            value(v.as<unsigned long>());
+        } else if (v.is<double>()) {
+            value(v.as<double>());
+        } else if (v.is<const char*>()) {
+            value(v.as<const char*>());
+        } else {
+            null();
+        }
+    }
+
+public:
+    explicit JsonWriter(Print& out, const char* prefix = nullptr)
+        : out(out), prefix((const uint8_t*)prefix), prefixLen(prefix ? strlen(prefix) : 0), cbor(false),
+          len(0), total(0), depth(0), hasItems(0), afterKey(false) {}
+
+    // Binary prefixes may contain zero bytes, so they carry a length
+    JsonWriter(Print& out, JsonEncoding encoding, const uint8_t* prefix, size_t prefixLen)
+        : out(out), prefix(prefixLen ? prefix : nullptr), prefixLen(prefixLen), cbor(encoding == JSON_CBOR),
+          len(0), total(0), depth(0), hasItems(0), afterKey(false) {}
+
+    ~JsonWriter() { flush(); }
+
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    JsonWriter& beginObject() { open('{'); return *this; }
+    JsonWriter& endObject() { close('}'); return *this; }
+    JsonWriter& beginArray() { open('['); return *this; }
+    JsonWriter& endArray() { close(']'); return *this; }
+
+    JsonWriter& key(const char* k) {
+        separate();
+        quoted(k, strlen(k));
+        if (!cbor) put(':');
+        afterKey = true;
+        return *this;
+    }
+
+    JsonWriter& value(const char* s) {
+        if (!s) return null();
+        separate();
+        quoted(s, strlen(s));
+        return *this;
+    }
+
+    JsonWriter& value(const String& s) {
+        separate();
+        quoted(s.c_str(), s.length());
+        return *this;
+    }
+
+    JsonWriter& value(bool b) {
+        separate();
+        if (cbor) put((char)(b ? CBOR_TRUE : CBOR_FALSE));
+        else put(b ? "true" : "false");
+        return *this;
+    }
+
+    JsonWriter& value(int v) { return cbor ? integer(v) : number("%d", v); }
+    JsonWriter& value(unsigned int v) { return cbor ? integer(v) : number("%u", v); }
+    JsonWriter& value(long v) { return cbor ? integer(v) : number("%ld", v); }
+    JsonWriter& value(unsigned long v) { return cbor ? integer(v) : number("%lu", v); }
+
+    JsonWriter& value(double v, uint8_t digits = 2) {
+        if (!cbor) return number("%.*f", digits, v);
+        float f = v;
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof(bits));
+        uint8_t b[5] = {CBOR_FLOAT32, (uint8_t)(bits >> 24), (uint8_t)(bits >> 16), (uint8_t)(bits >> 8), (uint8_t)bits};
+        put((const char*)b, sizeof(b));
+        return *this;
+    }
+
+    JsonWriter& null() {
+        separate();
+        if (cbor) put((char)CBOR_NULL);
+        else put("null");
+        return *this;
+    }
+
+    // Pre-formatted JSON (a literal, or output of another serializer). For
+    // CBOR output it is parsed and re-encoded, so keep it small.
+    JsonWriter& raw(const char* json) {
+        if (cbor) {
+            StaticJsonDocument<256> doc;
+            if (deserializeJson(doc, json)) return null();
+            variant(doc.as<JsonVariantConst>());
+            return *this;
+        }
+        separate();
+        put(json);
+        return *this;
+    }
+
+    template <typename T>
+    JsonWriter& field(const char* k, const T& v) {
+        key(k);
+        return value(v);
+    }
+
+    JsonWriter& field(const char* k, double v, uint8_t digits) {
+        key(k);
+        return value(v, digits);
+    }
+
+    // Text outside the JSON structure (the envelope tail)
+    void text(const char* s) { put(s); }
+
+    // A value produced by another writer (a batched command's result):
+    // returns the Print to write it to, and endExternal() counts its bytes
+    Print& beginExternal() {
+        separate();
+        if (prefix) startOutput();
+        flush();
+        return out;
+    }
+
+    void endExternal(size_t bytes) { total += bytes; }
+
+    JsonEncoding encoding() const { return cbor ? JSON_CBOR : JSON_TEXT; }
+
+    void flush() {
+        if (len == 0) return;
+        out.write((const uint8_t*)buf, len);
+        total += len;
+        len = 0;
+    }
+
+    size_t bytesWritten() const { return total + len; }
+};
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,253 @@
+#ifndef KEYBOARD_INTERFACE_H
+#define KEYBOARD_INTERFACE_H
+
+#include <Arduino.h>
+#include "config.h"
+#include "HidTypist.h"
+#include "TypingSync.h"
+
+// Keyboard mode enumeration
+enum KeyboardMode {
+  KB_MODE_BLE = 0,
+  KB_MODE_USB = 1,
+  KB_MODE_AUTO = 2
+};
+
+// Abstract keyboard interface. Each transport is also the ReportSink the
+// typing engine drives, and can be brought up and down at runtime. The
+// concrete classes are final, so code templated on them (the credential
+// playback loop) calls sendReport/waitSent directly instead of through the
+// vtable.
+class KeyboardInterface : public ReportSink {
+public:
+  virtual ~KeyboardInterface() {}
+  virtual bool begin() = 0;        // Bring the transport up (idempotent)
+  virtual void end() = 0;          // Take it down; the host sees no keyboard activity
+  virtual bool isUp() = 0;
+  virtual bool isConnected() = 0;
+  virtual bool isReady() = 0;      // Connected and able to deliver reports now
+  virtual uint32_t reportIntervalUs() = 0;  // Expected per-report latency, for AUTO routing
+  virtual bool wake() = 0;         // Ask a sleeping host to resume; false if it cannot be woken
+  virtual void print(const String& text) = 0;
+  virtual void write(uint8_t key) = 0;
+  virtual void releaseAll() = 0;
+  virtual const char* getModeName() = 0;
+  virtual KeyboardMode getMode() = 0;
+};
+
+// ========================================
+// BLE Keyboard Implementation
+// ========================================
+// Bluedroid is initialised once by the first begin(); afterwards end()/begin()
+// only drop the link and stop/restart advertising, which takes milliseconds.
+#if TOUCHPASS_HAS_BLE
+
+#include <BleKeyboard.h>
+#include "BleLink.h"
+
+class BLEKeyboardWrapper final : public KeyboardInterface {
+private:
+  BleKeyboard& bleKb;
+  BleLinkMonitor& link;
+  HostLeds* leds;
+  const TypingPace& pace;
+  bool started;
+  bool up;
+
+public:
+  BLEKeyboardWrapper(BleKeyboard& kb, BleLinkMonitor& link, HostLeds* leds, const TypingPace& pace)
+    : bleKb(kb), link(link), leds(leds), pace(pace), started(false), up(false) {}
+
+  bool begin() override {
+    if (!started) {
+      link.watch();
+      bleKb.begin();
+      link.begin(leds);
+      started = true;
+    }
+    link.setEnabled(true);
+    up = true;
+    return true;
+  }
+
+  void end() override {
+    if (!up) return;
+    link.setEnabled(false);
+    up = false;
+  }
+
+  bool isUp() override {
+    return up;
+  }
+
+  bool isConnected() override {
+    return up && bleKb.isConnected();
+  }
+
+  bool isReady() override {
+    return up && link.isReady();
+  }
+
+  uint32_t reportIntervalUs() override {
+    return (uint32_t)(link.intervalMs() * 1000);
+  }
+
+  // A sleeping BLE host reconnects on its own; touches are queued meanwhile
+  bool wake() override {
+    return false;
+  }
+
+  void print(const String& text) override {
+    if (isConnected()) {
+      HidTypist typist(*this, pace);
+      typist.type(text.c_str(), text.length());
+    }
+  }
+
+  bool sendReport(const HidReport& report) override {
+    if (!isConnected()) return false;
+    link.noteQueued();
+    bleKb.sendReport((KeyReport*)&report);
+    return true;
+  }
+
+  bool waitSent(uint32_t timeoutMs) override {
+    bool ok = link.waitComplete(timeoutMs);
+    if (pace.gapMs) delay(pace.gapMs);
+    return ok;
+  }
+
+  void write(uint8_t key) override {
+    if (isConnected()) {
+      bleKb.write(key);
+    }
+  }
+
+  void releaseAll() override {
+    if (isConnected()) {
+      bleKb.releaseAll();
+    }
+  }
+
+  const char* getModeName() override {
+    return "BLE";
+  }
+
+  KeyboardMode getMode() override {
+    return KB_MODE_BLE;
+  }
+};
+
+#endif  // TOUCHPASS_HAS_BLE
+
+// ========================================
+// USB HID Keyboard Implementation (USB OTG boards only)
+// ========================================
+// The HID interface is part of the USB descriptor from boot (USBHID registers
+// it when the keyboard object is constructed), so bringing USB up or down
+// never re-enumerates the device or drops the CDC config port.
+#if TOUCHPASS_HAS_USB
+
+#include <USB.h>
+#include <USBHIDKeyboard.h>
+#include "tusb.h"
+
+class USBKeyboardWrapper final : public KeyboardInterface {
+private:
+  USBHIDKeyboard& usbKb;
+  HostLeds* leds;
+  const TypingPace& pace;
+  bool started;
+  bool up;
+  uint32_t ledsAtWake;
+
+public:
+  USBKeyboardWrapper(USBHIDKeyboard& kb, HostLeds* leds, const TypingPace& pace)
+    : usbKb(kb), leds(leds), pace(pace), started(false), up(false), ledsAtWake(0) {}
+
+  bool begin() override {
+    if (!started) {
+      usbKb.begin();
+      started = true;
+    }
+    up = true;
+    return true;
+  }
+
+  void end() override {
+    if (!up) return;
+    if (tud_mounted()) usbKb.releaseAll();
+    up = false;
+  }
+
+  bool isUp() override {
+    return up;
+  }
+
+  // Follows the cable: unmounted when unplugged or not yet configured
+  bool isConnected() override {
+    return up && tud_mounted();
+  }
+
+  // Resumed, and either still configured or already re-sending its LED
+  // state (hosts that reset the bus on resume configure the device again)
+  bool isReady() override {
+    if (!up || tud_suspended()) return false;
+    return tud_mounted() || (leds && leds->reports != ledsAtWake);
+  }
+
+  // Full-speed interrupt endpoint, 1 ms polling
+  uint32_t reportIntervalUs() override {
+    return 1000;
+  }
+
+  // Remote wakeup only succeeds if the host enabled it for this device
+  bool wake() override {
+    if (!up || !tud_suspended()) return false;
+    if (leds) ledsAtWake = leds->reports;
+    return tud_remote_wakeup();
+  }
+
+  void print(const String& text) override {
+    if (isConnected()) {
+      HidTypist typist(*this, pace);
+      typist.type(text.c_str(), text.length());
+    }
+  }
+
+  // USBHID::SendReport blocks until TinyUSB reports the IN transfer complete
+  bool sendReport(const HidReport& report) override {
+    if (!isConnected()) return false;
+    usbKb.sendReport((KeyReport*)&report);
+    return true;
+  }
+
+  bool waitSent(uint32_t timeoutMs) override {
+    if (pace.gapMs) delay(pace.gapMs);
+    return true;
+  }
+
+  void write(uint8_t key) override {
+    if (isConnected()) {
+      usbKb.write(key);
+    }
+  }
+
+  void releaseAll() override {
+    if (isConnected()) {
+      usbKb.releaseAll();
+    }
+  }
+
+  const char* getModeName() override {
+    return "USB-HID";
+  }
+
+  KeyboardMode getMode() override {
+    return KB_MODE_USB;
+  }
+};
+
+#endif  // TOUCHPASS_HAS_USB
+
+#endif  // KEYBOARD_INTERFACE_H
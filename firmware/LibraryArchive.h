@@ -0,0 +1,143 @@
+#ifndef LIBRARY_ARCHIVE_H
+#define LIBRARY_ARCHIVE_H
+
+// Binary container used by export_library / import_library.
+//
+// The stream is a sequence of frames:
+//   [type u8][len u16 LE][payload ...][crc32 LE]
+// where the CRC covers type, len and payload.
+//
+//   'H'  header    magic "TPLB", version u8, count u16, packetSize u16
+//   'R'  record    index u16, slot u16, fingerId i8, flags u8, nameLen u8, name
+//   'T'  template  one sensor data packet worth of template bytes
+//   'U'  template  final chunk of the current record's template
+//   'E'  end       count u16
+//
+// Multi-byte fields are little-endian. Passwords are never exported.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define ARCHIVE_MAGIC "TPLB"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_MAX_PAYLOAD 300
+#define ARCHIVE_MAX_NAME 64
+
+#define ARCHIVE_FRAME_HEADER 'H'
+#define ARCHIVE_FRAME_RECORD 'R'
+#define ARCHIVE_FRAME_CHUNK 'T'
+#define ARCHIVE_FRAME_LAST 'U'
+#define ARCHIVE_FRAME_END 'E'
+
+#define ARCHIVE_FLAG_PRESS_ENTER 0x01
+
+inline uint32_t crc32Update(uint32_t crc, const uint8_t* data, size_t len) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+inline uint32_t crc32(const uint8_t* data, size_t len) {
+    return crc32Update(0, data, len);
+}
+
+inline void putLe16(uint8_t* p, uint16_t v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+inline uint16_t getLe16(const uint8_t* p) { return p[0] | (p[1] << 8); }
+inline void putLe32(uint8_t* p, uint32_t v) { putLe16(p, v & 0xFFFF); putLe16(p + 2, v >> 16); }
+inline uint32_t getLe32(const uint8_t* p) { return getLe16(p) | ((uint32_t)getLe16(p + 2) << 16); }
+
+struct ArchiveRecord {
+    uint16_t index;
+    uint16_t slot;
+    int8_t fingerId;
+    uint8_t flags;
+    char name[ARCHIVE_MAX_NAME + 1];
+};
+
+// Out needs write(const uint8_t*, size_t)
+template <typename Out>
+void writeArchiveFrame(Out& out, uint8_t type, const uint8_t* payload, uint16_t len) {
+    uint8_t head[3] = {type, (uint8_t)(len & 0xFF), (uint8_t)(len >> 8)};
+    uint32_t crc = crc32Update(crc32(head, sizeof(head)), payload, len);
+    uint8_t tail[4];
+    putLe32(tail, crc);
+    out.write(head, sizeof(head));
+    if (len > 0) out.write(payload, len);
+    out.write(tail, sizeof(tail));
+}
+
+template <typename Out>
+void writeArchiveHeader(Out& out, uint16_t count, uint16_t packetSize) {
+    uint8_t p[9];
+    memcpy(p, ARCHIVE_MAGIC, 4);
+    p[4] = ARCHIVE_VERSION;
+    putLe16(p + 5, count);
+    putLe16(p + 7, packetSize);
+    writeArchiveFrame(out, ARCHIVE_FRAME_HEADER, p, sizeof(p));
+}
+
+template <typename Out>
+void writeArchiveRecord(Out& out, const ArchiveRecord& rec) {
+    uint8_t p[7 + ARCHIVE_MAX_NAME];
+    size_t nameLen = strnlen(rec.name, ARCHIVE_MAX_NAME);
+    putLe16(p, rec.index);
+    putLe16(p + 2, rec.slot);
+    p[4] = (uint8_t)rec.fingerId;
+    p[5] = rec.flags;
+    p[6] = (uint8_t)nameLen;
+    memcpy(p + 7, rec.name, nameLen);
+    writeArchiveFrame(out, ARCHIVE_FRAME_RECORD, p, 7 + nameLen);
+}
+
+template <typename Out>
+void writeArchiveEnd(Out& out, uint16_t count) {
+    uint8_t p[2];
+    putLe16(p, count);
+    writeArchiveFrame(out, ARCHIVE_FRAME_END, p, sizeof(p));
+}
+
+// In needs readBytes(uint8_t*, size_t) returning the count read (with its own timeout).
+// Returns the payload length, or -1 on timeout / CRC mismatch / oversize frame.
+template <typename In>
+int readArchiveFrame(In& in, uint8_t* type, uint8_t* payload, size_t cap) {
+    uint8_t head[3];
+    if (in.readBytes(head, sizeof(head)) != sizeof(head)) return -1;
+    uint16_t len = getLe16(head + 1);
+    if (len > cap) return -1;
+    if (len > 0 && in.readBytes(payload, len) != len) return -1;
+    uint8_t tail[4];
+    if (in.readBytes(tail, sizeof(tail)) != sizeof(tail)) return -1;
+    uint32_t crc = crc32Update(crc32(head, sizeof(head)), payload, len);
+    if (crc != getLe32(tail)) return -1;
+    *type = head[0];
+    return len;
+}
+
+inline bool parseArchiveHeader(const uint8_t* p, int len, uint16_t* count, uint16_t* packetSize) {
+    if (len != 9 || memcmp(p, ARCHIVE_MAGIC, 4) != 0 || p[4] != ARCHIVE_VERSION) return false;
+    *count = getLe16(p + 5);
+    *packetSize = getLe16(p + 7);
+    return true;
+}
+
+inline bool parseArchiveRecord(const uint8_t* p, int len, ArchiveRecord* rec) {
+    if (len < 7 || p[6] > ARCHIVE_MAX_NAME || len != 7 + p[6]) return false;
+    rec->index = getLe16(p);
+    rec->slot = getLe16(p + 2);
+    rec->fingerId = (int8_t)p[4];
+    rec->flags = p[5];
+    memcpy(rec->name, p + 7, p[6]);
+    rec->name[p[6]] = '\0';
+    return true;
+}
+
+#endif // LIBRARY_ARCHIVE_H
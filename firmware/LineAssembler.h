@@ -0,0 +1,165 @@
+#ifndef LINE_ASSEMBLER_H
+#define LINE_ASSEMBLER_H
+
+// Newline framing for the config port without per-byte heap traffic.
+//
+// Bytes are read from the stream in bulk into one fixed buffer and complete
+// lines are found with a word-at-a-time newline scan. A line is handed out
+// as a mutable, NUL-terminated slice of that buffer, so ArduinoJson can
+// parse it in place: with a non-const input, string values point into the
+// buffer instead of being copied. The slice stays valid until the next
+// fill(). Consumed bytes are compacted away at the start of fill(), which
+// keeps each line contiguous.
+//
+// Bytes that arrive after a newline stay buffered. readBytes() drains them
+// before reading the stream, so a command whose binary payload follows its
+// line on the same port (import_library) sees the payload intact.
+//
+// Data starting with a zero byte is a binary frame (BinaryFrame.h) instead
+// of a line: it runs to the next zero byte and is returned untrimmed.
+
+#include <Arduino.h>
+
+template <size_t N>
+class LineAssembler {
+private:
+    char buf[N + 1];
+    Stream* stream;
+    size_t head;      // First unconsumed byte
+    size_t tail;      // End of buffered data
+    size_t scanned;   // [head, scanned) is known to hold no delimiter
+    bool discarding;  // Dropping an over-long line or frame up to its delimiter
+    char discardDelim;
+    bool overflow;
+
+    static bool hasByte(uint32_t w, uint32_t pattern) {
+        uint32_t x = w ^ pattern;
+        return ((x - 0x01010101UL) & ~x & 0x80808080UL) != 0;
+    }
+
+    static bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+    // Index of the next delim in [scanned, tail), or tail
+    size_t find(char delim) {
+        uint32_t pattern = (uint8_t)delim * 0x01010101UL;
+        size_t i = scanned;
+        while (i < tail && ((uintptr_t)(buf + i) & 3)) {
+            if (buf[i] == delim) return i;
+            i++;
+        }
+        while (i + 4 <= tail) {
+            uint32_t w;
+            memcpy(&w, buf + i, 4);
+            if (hasByte(w, pattern)) break;
+            i += 4;
+        }
+        while (i < tail) {
+            if (buf[i] == delim) return i;
+            i++;
+        }
+        return tail;
+    }
+
+public:
+    LineAssembler() : stream(nullptr), head(0), tail(0), scanned(0), discarding(false), discardDelim('\n'), overflow(false) {}
+
+    void begin(Stream* s) {
+        stream = s;
+        head = tail = scanned = 0;
+        discarding = false;
+    }
+
+    // Reads whatever the stream has ready, up to the free space. Returns the
+    // number of bytes read.
+    size_t fill() {
+        if (!stream) return 0;
+        if (head > 0) {
+            memmove(buf, buf + head, tail - head);
+            tail -= head;
+            scanned -= head;
+            head = 0;
+        }
+        int avail = stream->available();
+        if (avail <= 0 || tail >= N) return 0;
+        size_t n = (size_t)avail < N - tail ? (size_t)avail : N - tail;
+        n = stream->readBytes(buf + tail, n);
+        tail += n;
+        return n;
+    }
+
+    // Next complete line with surrounding whitespace trimmed, or nullptr.
+    // *binary is set for a binary frame, returned without its delimiters.
+    // A line or frame longer than the buffer is dropped and reported by
+    // takeOverflow().
+    char* next(size_t* len, bool* binary = nullptr) {
+        while (true) {
+            size_t start = head;
+            char delim = '\n';
+            if (discarding) {
+                delim = discardDelim;
+            } else if (head < tail && buf[head] == 0) {
+                // Skip the opening delimiter (and any empty frames)
+                while (start < tail && buf[start] == 0) start++;
+                if (start == tail) {
+                    head = scanned = tail - 1;  // Keep one zero: the next byte starts a frame
+                    return nullptr;
+                }
+                delim = 0;
+                if (scanned < start) scanned = start;
+            }
+
+            size_t nl = find(delim);
+            if (nl == tail) {
+                scanned = tail;
+                if (head == 0 && tail == N) {
+                    // Full buffer with no delimiter: drop it and the rest of the line
+                    head = tail = scanned = 0;
+                    if (!discarding) overflow = true;
+                    discarding = true;
+                    discardDelim = delim;
+                }
+                return nullptr;
+            }
+
+            head = scanned = nl + 1;
+            if (discarding) {
+                discarding = false;
+                continue;
+            }
+
+            if (delim == 0) {
+                if (binary) *binary = true;
+                *len = nl - start;
+                return buf + start;
+            }
+            if (binary) *binary = false;
+
+            size_t end = nl;
+            while (end > start && isSpace(buf[end - 1])) end--;
+            while (start < end && isSpace(buf[start])) start++;
+            buf[end] = '\0';
+            *len = end - start;
+            return buf + start;
+        }
+    }
+
+    bool takeOverflow() {
+        bool o = overflow;
+        overflow = false;
+        return o;
+    }
+
+    // Buffered bytes first, then the stream (with its timeout)
+    size_t readBytes(uint8_t* out, size_t len) {
+        size_t n = tail - head < len ? tail - head : len;
+        memcpy(out, buf + head, n);
+        head += n;
+        if (scanned < head) scanned = head;
+        if (n < len && stream) n += stream->readBytes(out + n, len - n);
+        return n;
+    }
+};
+
+#endif // LINE_ASSEMBLER_H
@@ -0,0 +1,127 @@
+#ifndef METADATA_IMAGE_H
+#define METADATA_IMAGE_H
+
+// Pre-seeded finger metadata image ("TPMI").
+//
+// Written by tools/mkseed to the seed partition and adopted into NVS on the
+// first boot that finds it. The same reader is compiled into the host tool
+// for its --verify round trip.
+//
+//   Header (16 bytes):
+//     magic "TPMI", version u8, reserved u8, count u16,
+//     payloadLen u32, crc32 u32 (over the payload)
+//   Payload, one entry per slot:
+//     slot u16, fingerId i8, flags u8, nameLen u8, name, pwLen u16, password
+//
+// Multi-byte fields are little-endian. Erased flash (0xFF) never matches the magic.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "LibraryArchive.h"
+
+#define SEED_MAGIC "TPMI"
+#define SEED_VERSION 1
+#define SEED_HEADER_LEN 16
+#define SEED_MAX_NAME ARCHIVE_MAX_NAME
+#define SEED_MAX_PASSWORD 256
+#define SEED_MAX_PAYLOAD 0x10000
+
+#define SEED_FLAG_PRESS_ENTER 0x01
+
+struct SeedEntry {
+    uint16_t slot;
+    int8_t fingerId;
+    uint8_t flags;
+    const char* name;       // Not NUL-terminated when read from an image
+    uint8_t nameLen;
+    const char* password;
+    uint16_t passwordLen;
+};
+
+inline size_t seedEntrySize(const SeedEntry& e) {
+    return 7 + e.nameLen + e.passwordLen;
+}
+
+// Returns the image length, or 0 if it does not fit
+inline size_t writeSeedImage(const SeedEntry* entries, uint16_t count, uint8_t* out, size_t cap) {
+    if (cap < SEED_HEADER_LEN) return 0;
+    size_t pos = SEED_HEADER_LEN;
+    for (uint16_t i = 0; i < count; i++) {
+        const SeedEntry& e = entries[i];
+        if (e.nameLen > SEED_MAX_NAME || e.passwordLen > SEED_MAX_PASSWORD) return 0;
+        if (pos + seedEntrySize(e) > cap) return 0;
+        putLe16(out + pos, e.slot);
+        out[pos + 2] = (uint8_t)e.fingerId;
+        out[pos + 3] = e.flags;
+        out[pos + 4] = e.nameLen;
+        memcpy(out + pos + 5, e.name, e.nameLen);
+        pos += 5 + e.nameLen;
+        putLe16(out + pos, e.passwordLen);
+        memcpy(out + pos + 2, e.password, e.passwordLen);
+        pos += 2 + e.passwordLen;
+    }
+
+    uint32_t payloadLen = pos - SEED_HEADER_LEN;
+    if (payloadLen > SEED_MAX_PAYLOAD) return 0;
+    memcpy(out, SEED_MAGIC, 4);
+    out[4] = SEED_VERSION;
+    out[5] = 0;
+    putLe16(out + 6, count);
+    putLe32(out + 8, payloadLen);
+    putLe32(out + 12, crc32(out + SEED_HEADER_LEN, payloadLen));
+    return pos;
+}
+
+// Validates the header only; payloadLen tells the caller how much to read
+inline bool parseSeedHeader(const uint8_t* head, uint16_t* count, uint32_t* payloadLen) {
+    if (memcmp(head, SEED_MAGIC, 4) != 0 || head[4] != SEED_VERSION) return false;
+    *count = getLe16(head + 6);
+    *payloadLen = getLe32(head + 8);
+    return *payloadLen <= SEED_MAX_PAYLOAD;
+}
+
+class SeedImageReader {
+private:
+    const uint8_t* payload;
+    size_t len;
+    size_t pos;
+    uint16_t remaining;
+
+public:
+    SeedImageReader() : payload(nullptr), len(0), pos(0), remaining(0) {}
+
+    // image points at the header, imageLen covers header + payload
+    bool begin(const uint8_t* image, size_t imageLen) {
+        uint16_t count;
+        uint32_t payloadLen;
+        if (imageLen < SEED_HEADER_LEN || !parseSeedHeader(image, &count, &payloadLen)) return false;
+        if (imageLen < SEED_HEADER_LEN + payloadLen) return false;
+        if (crc32(image + SEED_HEADER_LEN, payloadLen) != getLe32(image + 12)) return false;
+        payload = image + SEED_HEADER_LEN;
+        len = payloadLen;
+        pos = 0;
+        remaining = count;
+        return true;
+    }
+
+    // Entry strings point into the image. Returns false at the end or on a malformed entry.
+    bool next(SeedEntry* e) {
+        if (remaining == 0 || pos + 5 > len) return false;
+        const uint8_t* p = payload + pos;
+        e->slot = getLe16(p);
+        e->fingerId = (int8_t)p[2];
+        e->flags = p[3];
+        e->nameLen = p[4];
+        if (e->nameLen > SEED_MAX_NAME || pos + 7 + e->nameLen > len) return false;
+        e->name = (const char*)p + 5;
+        e->passwordLen = getLe16(p + 5 + e->nameLen);
+        if (e->passwordLen > SEED_MAX_PASSWORD || pos + seedEntrySize(*e) > len) return false;
+        e->password = (const char*)p + 7 + e->nameLen;
+        pos += seedEntrySize(*e);
+        remaining--;
+        return true;
+    }
+};
+
+#endif // METADATA_IMAGE_H
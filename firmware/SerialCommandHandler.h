@@ -3,45 +3,269 @@
 
 #include <Arduino.h>
 #include <ArduinoJson.h>
+#include "BinaryFrame.h"
+#include "CommandRegistry.h"
+#include "EventLog.h"
+#include "JsonWriter.h"
+#include "LineAssembler.h"
+#include "TxRing.h"
+#include <esp_heap_caps.h>
+#include <esp_idf_version.h>
 
-// Forward declarations of command handler functions (implemented in firmware.ino)
-String getStatusJson();
-String getDetectJson();
-String getFingersJson();
-String enrollStartJson(JsonObject params);
-String getEnrollStatusJson();
-String enrollCancelJson();
-String deleteFingerJson(JsonObject params);
-String emptyLibraryJson();
-String getBLEStatusJson();
-String getFingerJson(JsonObject params);
-String updateFingerJson(JsonObject params);
-String getSystemInfoJson();
-String getKeyboardModeJson();
-String setKeyboardModeJson(JsonObject params);
-String rebootJson();
-String getDiagnosticsJson();
+// IDF 5.3 can track the heap low-water mark over a window of code
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+#define HEAP_MONITOR_LOCAL 1
+#else
+#define HEAP_MONITOR_LOCAL 0
+#endif
+
+// Frames everything written to it for the binary protocol
+class FramePrint : public Print {
+private:
+    FrameEncoder<Print> encoder;
+
+public:
+    explicit FramePrint(Print& port) : encoder(port) {}
+
+    size_t write(uint8_t b) override {
+        encoder.write(b);
+        return 1;
+    }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        encoder.write(data, len);
+        return len;
+    }
+
+    void finish() { encoder.finish(); }
+};
+
+// Passes a batched command's result through and keeps its first bytes, so a
+// result reporting "ok": false can be recognized
+class ResultTap : public Print {
+private:
+    Print& to;
+    uint8_t head[11];
+    size_t n;
+
+public:
+    explicit ResultTap(Print& to) : to(to), n(0) {}
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        for (size_t i = 0; i < len && n < sizeof(head); i++) head[n++] = data[i];
+        return to.write(data, len);
+    }
+
+    bool failed(JsonEncoding encoding) const {
+        static const uint8_t cborFailed[] = {CBOR_MAP_START, 0x62, 'o', 'k', CBOR_FALSE};
+        if (encoding == JSON_CBOR) return n >= sizeof(cborFailed) && memcmp(head, cborFailed, sizeof(cborFailed)) == 0;
+        return n == sizeof(head) && memcmp(head, "{\"ok\":false", sizeof(head)) == 0;
+    }
+};
+
+// Renders one event as an object (implemented in firmware.ino)
+void eventJson(const Event& e, JsonWriter& out);
+
+// Locks shared with the sensor and typing tasks (implemented in firmware.ino,
+// see Tasks.h). lockSensor() returns false if the sensor stayed busy.
+bool lockSensor(bool wait);
+void unlockSensor();
+void lockState();
+void unlockState();
+int releaseState();
+void retakeState(int held);
+
+// Redo journal and dry run for atomic batches (implemented in firmware.ino)
+bool saveBatchJournal(JsonObject params);
+void clearBatchJournal();
+const char* checkMetadataWrite(const char* cmd, JsonObject params);
+
+#define JOB_QUEUE_DEPTH 4
+#define JOB_PARAMS_MAX 512
+#define JOB_CHANNEL_MAX 2  // Per channel when several are attached, so none can fill the queue
+
+#ifndef COMMAND_CHANNELS
+#define COMMAND_CHANNELS 3  // USB CDC, BLE UART, WiFi
+#endif
+#define CHANNEL_LINES_PER_PASS 4
+
+#define BATCH_MAX_COMMANDS 16
+#define BATCH_RESPONSE_MAX 16384  // No further commands are started past this
 
 class SerialCommandHandler {
 private:
-    String rxBuffer;
-    Stream* serial;
     static const size_t MAX_BUFFER = 2048;
     static const size_t JSON_DOC_SIZE = 2048;
 
-    void processLine(const String& line) {
-        // Parse JSON command
+    // One transport with its own framing and output. Replies and events go
+    // to the channel their request or subscription came from.
+    struct Channel {
+        const char* name;
+        Stream* port;
+        LineAssembler<MAX_BUFFER> lines;
+        TxRing<TX_RING_SIZE> tx;  // All output; drained as the port takes it
+        uint8_t jobs;             // Queued jobs from this channel
+        uint32_t commands;
+
+        // Event subscription: events after sentSeq are still to be pushed
+        bool subscribed;
+        bool subscriberBinary;
+        uint32_t sentSeq;
+    };
+    Channel channels[COMMAND_CHANNELS];
+    uint8_t channelCount;
+    uint8_t firstChannel;  // Served first in the next pass
+    Channel* current;      // Channel of the command being handled
+
+    // A queued command; params are kept as JSON text since the request
+    // buffer is reused by the next line
+    struct Job {
+        uint8_t index;
+        uint8_t channel;
+        bool binary;
+        int32_t id;
+        char params[JOB_PARAMS_MAX];
+    };
+    Job jobs[JOB_QUEUE_DEPTH];
+    uint8_t jobHead;
+    uint8_t jobCount;
+    uint8_t jobsPeak;
+    uint32_t jobsRejected;
+    uint32_t jobsDeferred;  // Passes a job waited because the sensor was busy
+
+    struct CommandStats {
+        uint32_t calls;
+        uint32_t maxUs;
+        uint64_t totalUs;
+    };
+    CommandStats stats[COMMAND_COUNT];
+
+    // Previous command, for diagnostics
+    int lastCmd;  // Index into COMMANDS, -1 before the first command
+    uint32_t lastCmdUs;
+    uint32_t lastBytes;
+    uint32_t lastPeakHeap;  // Heap used at the deepest point while handling it
+
+    bool binaryRequest;  // Reply in the protocol the request came in
+
+    uint32_t eventsSkipped;  // Lost to a full log while the port was backed up
+
+    void processLine(char* line, size_t len) {
+        binaryRequest = false;
+
+        // Parse JSON command in place; strings in commandDoc point into the
+        // line buffer, which is left alone until the command has finished
         StaticJsonDocument<JSON_DOC_SIZE> commandDoc;
-        DeserializationError error = deserializeJson(commandDoc, line);
+        DeserializationError error = deserializeJson(commandDoc, line, len);
 
         if (error) {
             sendError("Invalid JSON", -1);
             return;
         }
 
+        handleCommand(commandDoc, commandDoc["id"] | -1);
+    }
+
+    void processFrame(uint8_t* frame, size_t len) {
+        binaryRequest = true;
+
+        int payload = framePayload(frame, cobsDecode(frame, len));
+        if (payload < 2) {
+            sendError("Bad frame", FRAME_NO_ID);
+            return;
+        }
+        int id = getLe16(frame);
+
+        // Decoded in place like JSON lines: strings point into the frame
+        StaticJsonDocument<JSON_DOC_SIZE> commandDoc;
+        CborReader reader(frame + 2, payload - 2);
+        if (!readCbor(reader, commandDoc.to<JsonVariant>(), 0) || !reader.atEnd()) {
+            sendError("Invalid CBOR", id);
+            return;
+        }
+
+        handleCommand(commandDoc, id);
+    }
+
+    // Dst is a JsonVariant or a member proxy, so map values are added under
+    // their key without a lookup
+    template <typename Dst>
+    static bool readCbor(CborReader& r, Dst dst, uint8_t depth) {
+        if (depth > 8 || r.atEnd()) return false;
+        uint8_t initial = *r.p;
+        uint8_t major;
+        uint64_t v;
+        bool indefinite;
+        if (!r.head(&major, &v, &indefinite)) return false;
+
+        switch (major) {
+            case CBOR_UINT:
+                return v <= 0xFFFFFFFFULL && dst.set((uint32_t)v);
+            case CBOR_NEGINT:
+                return v <= 0x7FFFFFFFULL && dst.set((int32_t)(-1 - (int64_t)v));
+            case CBOR_TEXT: {
+                char* text = indefinite ? nullptr : r.text(v);
+                return text && dst.set((const char*)text);
+            }
+            case CBOR_ARRAY: {
+                JsonArray arr = dst.template to<JsonArray>();
+                for (uint64_t i = 0; indefinite || i < v; i++) {
+                    if (indefinite && r.atBreak()) {
+                        r.p++;
+                        break;
+                    }
+                    if (!readCbor(r, arr.add(), depth + 1)) return false;
+                }
+                return true;
+            }
+            case CBOR_MAP: {
+                JsonObject obj = dst.template to<JsonObject>();
+                for (uint64_t i = 0; indefinite || i < v; i++) {
+                    if (indefinite && r.atBreak()) {
+                        r.p++;
+                        break;
+                    }
+                    uint8_t keyMajor;
+                    uint64_t keyLen;
+                    bool keyIndefinite;
+                    if (!r.head(&keyMajor, &keyLen, &keyIndefinite)) return false;
+                    if (keyMajor != CBOR_TEXT || keyIndefinite) return false;
+                    const char* key = r.text(keyLen);
+                    if (!key || !readCbor(r, obj[key], depth + 1)) return false;
+                }
+                return true;
+            }
+            case CBOR_TAG:
+                return readCbor(r, dst, depth + 1);
+            case CBOR_SIMPLE:
+                switch (initial) {
+                    case CBOR_FALSE: return dst.set(false);
+                    case CBOR_TRUE: return dst.set(true);
+                    case CBOR_NULL:
+                    case CBOR_UNDEFINED: return dst.set((const char*)nullptr);
+                    case CBOR_FLOAT16: return dst.set(cborHalf((uint16_t)v));
+                    case CBOR_FLOAT32: {
+                        uint32_t bits = (uint32_t)v;
+                        float f;
+                        memcpy(&f, &bits, sizeof(f));
+                        return dst.set(f);
+                    }
+                    case CBOR_FLOAT64: {
+                        double d;
+                        memcpy(&d, &v, sizeof(d));
+                        return dst.set(d);
+                    }
+                }
+                return false;
+        }
+        return false;  // Byte strings are not used by any command
+    }
+
+    void handleCommand(JsonDocument& commandDoc, int id) {
         // Extract command fields
         const char* cmd = commandDoc["cmd"];
-        int id = commandDoc["id"] | -1;
         JsonObject params = commandDoc["params"];
 
         if (!cmd) {
@@ -53,105 +277,488 @@ private:
         executeCommand(cmd, params, id);
     }
 
+    // Required params and size limits come from the command table. Returns
+    // false with the reason in message.
+    static bool check(const CommandInfo& info, JsonObject params, char* message, size_t size) {
+        const char* p = info.required;
+        while (*p) {
+            char key[24];
+            size_t n = strcspn(p, " ");
+            if (n >= sizeof(key)) n = sizeof(key) - 1;
+            memcpy(key, p, n);
+            key[n] = '\0';
+            if (!params.containsKey(key)) {
+                snprintf(message, size, "Missing %s", key);
+                return false;
+            }
+            p += strcspn(p, " ");
+            p += strspn(p, " ");
+        }
+        if (info.maxParams && measureJson(params) > info.maxParams) {
+            snprintf(message, size, "Params too large");
+            return false;
+        }
+        return true;
+    }
+
+    bool validate(const CommandInfo& info, JsonObject params, int id) {
+        char message[40];
+        if (check(info, params, message, sizeof(message))) return true;
+        sendError(message, id);
+        return false;
+    }
+
+    // Checks one batch entry; returns the command index, or -1 with the
+    // reason in message
+    static int checkBatched(JsonObject entry, uint8_t requiredFlags, char* message, size_t size) {
+        const char* cmd = entry["cmd"];
+        int index = cmd ? findCommand(cmd) : -1;
+        if (index < 0) {
+            snprintf(message, size, cmd ? "Unknown command" : "Missing cmd field");
+            return -1;
+        }
+        const CommandInfo& info = COMMANDS[index];
+        if ((info.flags & COMMAND_STREAMS) || (info.flags & requiredFlags) != requiredFlags) {
+            snprintf(message, size, requiredFlags ? "Not allowed in an atomic batch" : "Not allowed in a batch");
+            return -1;
+        }
+        return check(info, entry["params"], message, size) ? index : -1;
+    }
+
+    void record(int index, uint32_t us) {
+        CommandStats& st = stats[index];
+        st.calls++;
+        st.totalUs += us;
+        if (us > st.maxUs) st.maxUs = us;
+    }
+
+    void batchRejected(JsonWriter& out, int index, const char* message) {
+        out.beginObject();
+        out.field("ok", false);
+        if (index >= 0) out.field("index", index);
+        out.field("status", message);
+        out.endObject();
+    }
+
+    // Takes the locks a command needs, the sensor before the state. Without
+    // wait, a sensor command gives up at once if the sensor is in use.
+    static bool acquire(const CommandInfo& info, bool wait) {
+        if ((info.flags & COMMAND_SENSOR) && !lockSensor(wait)) return false;
+        lockState();
+        return true;
+    }
+
+    static void release(const CommandInfo& info) {
+        unlockState();
+        if (info.flags & COMMAND_SENSOR) unlockSensor();
+    }
+
     void executeCommand(const char* cmd, JsonObject params, int id) {
-        String dataJson = "";
-
-        // Route command to appropriate handler
-        if (strcmp(cmd, "get_status") == 0) {
-            dataJson = getStatusJson();
-        } else if (strcmp(cmd, "get_detect") == 0) {
-            dataJson = getDetectJson();
-        } else if (strcmp(cmd, "get_fingers") == 0) {
-            dataJson = getFingersJson();
-        } else if (strcmp(cmd, "enroll_start") == 0) {
-            dataJson = enrollStartJson(params);
-        } else if (strcmp(cmd, "enroll_status") == 0) {
-            dataJson = getEnrollStatusJson();
-        } else if (strcmp(cmd, "enroll_cancel") == 0) {
-            dataJson = enrollCancelJson();
-        } else if (strcmp(cmd, "delete_finger") == 0) {
-            dataJson = deleteFingerJson(params);
-        } else if (strcmp(cmd, "empty_library") == 0) {
-            dataJson = emptyLibraryJson();
-        } else if (strcmp(cmd, "get_ble_status") == 0) {
-            dataJson = getBLEStatusJson();
-        } else if (strcmp(cmd, "get_finger") == 0) {
-            dataJson = getFingerJson(params);
-        } else if (strcmp(cmd, "update_finger") == 0) {
-            dataJson = updateFingerJson(params);
-        } else if (strcmp(cmd, "get_system_info") == 0) {
-            dataJson = getSystemInfoJson();
-        } else if (strcmp(cmd, "get_keyboard_mode") == 0) {
-            dataJson = getKeyboardModeJson();
-        } else if (strcmp(cmd, "set_keyboard_mode") == 0) {
-            dataJson = setKeyboardModeJson(params);
-        } else if (strcmp(cmd, "reboot") == 0) {
-            dataJson = rebootJson();
-        } else if (strcmp(cmd, "diagnostics") == 0) {
-            dataJson = getDiagnosticsJson();
-        } else {
+        int index = findCommand(cmd);
+        if (index < 0) {
             sendError("Unknown command", id);
             return;
         }
+        const CommandInfo& info = COMMANDS[index];
+        if (!validate(info, params, id)) return;
 
-        // Send response with data
-        sendResponse("ok", dataJson, id);
+        // Without an id the client cannot match an out-of-order reply
+        bool slow = info.flags & (COMMAND_SENSOR | COMMAND_BLOCKS);
+        if (slow && id >= 0 && !(info.flags & COMMAND_STREAMS)) {
+            queueJob(index, params, id);
+        } else if (acquire(info, true)) {
+            run(index, params, id);
+            release(info);
+        } else {
+            sendError("Sensor busy", id);
+        }
     }
 
-    void sendResponse(const char* status, const String& dataJson, int id) {
-        serial->print("{\"status\":\"");
-        serial->print(status);
-        serial->print("\",\"data\":");
-        serial->print(dataJson);
-        if (id >= 0) {
-            serial->print(",\"id\":");
-            serial->print(id);
+    void queueJob(int index, JsonObject params, int id) {
+        if (jobCount == JOB_QUEUE_DEPTH || (channelCount > 1 && current->jobs == JOB_CHANNEL_MAX)) {
+            jobsRejected++;
+            sendError("Busy", id);
+            return;
+        }
+        if (measureJson(params) >= JOB_PARAMS_MAX) {
+            sendError("Params too large", id);
+            return;
         }
-        serial->println("}");
+        Job& job = jobs[(jobHead + jobCount) % JOB_QUEUE_DEPTH];
+        job.index = index;
+        job.channel = current - channels;
+        job.binary = binaryRequest;
+        job.id = id;
+        serializeJson(params, job.params, sizeof(job.params));
+        jobCount++;
+        current->jobs++;
+        if (jobCount > jobsPeak) jobsPeak = jobCount;
+    }
+
+    // Runs the oldest queued job, one per loop(); a sensor job waits in the
+    // queue while the sensor task is using the sensor
+    void runJob() {
+        if (jobCount == 0) return;
+        Job& job = jobs[jobHead];
+        const CommandInfo& info = COMMANDS[job.index];
+        if (!acquire(info, false)) {
+            jobsDeferred++;
+            return;
+        }
+        StaticJsonDocument<JSON_DOC_SIZE> paramsDoc;
+        deserializeJson(paramsDoc, job.params);
+        current = &channels[job.channel];
+        binaryRequest = job.binary;
+        run(job.index, paramsDoc.as<JsonObject>(), job.id);
+        release(info);
+        current->jobs--;
+        jobHead = (jobHead + 1) % JOB_QUEUE_DEPTH;
+        jobCount--;
+    }
+
+    // The envelope is the writer's prefix, so handlers that send binary data
+    // before their JSON (export_library) still come out in the right order
+    void run(int index, JsonObject params, int id) {
+        const CommandInfo& info = COMMANDS[index];
+        lastCmd = index;
+        uint32_t freeBefore = ESP.getFreeHeap();
+#if HEAP_MONITOR_LOCAL
+        heap_caps_monitor_local_minimum_free_size_start();
+#endif
+        unsigned long start = micros();
+
+        if (binaryRequest) {
+            uint8_t header[3] = {(uint8_t)id, (uint8_t)(id >> 8), FRAME_STATUS_OK};
+            FramePrint frame(current->tx);
+            JsonWriter out(frame, JSON_CBOR, header, sizeof(header));
+            info.handler(params, out);
+            out.flush();
+            frame.finish();
+            lastBytes = out.bytesWritten();
+        } else {
+            JsonWriter out(current->tx, "{\"status\":\"ok\",\"data\":");
+            info.handler(params, out);
+            if (id >= 0) {
+                out.text(",\"id\":");
+                out.value(id);
+            }
+            out.text("}\r\n");
+            out.flush();
+            lastBytes = out.bytesWritten();
+        }
+
+        lastCmdUs = micros() - start;
+        record(index, lastCmdUs);
+#if HEAP_MONITOR_LOCAL
+        uint32_t lowest = heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT);
+        heap_caps_monitor_local_minimum_free_size_stop();
+#else
+        // Lower bound: only what was still allocated when the handler returned
+        uint32_t lowest = ESP.getFreeHeap();
+#endif
+        lastPeakHeap = lowest < freeBefore ? freeBefore - lowest : 0;
     }
 
     void sendError(const char* message, int id) {
+        if (binaryRequest) {
+            uint8_t header[3] = {(uint8_t)id, (uint8_t)(id >> 8), FRAME_STATUS_ERROR};
+            FramePrint frame(current->tx);
+            JsonWriter out(frame, JSON_CBOR, header, sizeof(header));
+            out.value(message);
+            out.flush();
+            frame.finish();
+            return;
+        }
+
         // Build error response: {"status":"error","message":"...","id":123}
-        serial->print("{\"status\":\"error\",\"message\":\"");
-        serial->print(message);
-        serial->print("\"");
+        Print& tx = current->tx;
+        tx.print("{\"status\":\"error\",\"message\":\"");
+        tx.print(message);
+        tx.print("\"");
         if (id >= 0) {
-            serial->print(",\"id\":");
-            serial->print(id);
+            tx.print(",\"id\":");
+            tx.print(id);
         }
-        serial->println("}");
+        tx.println("}");
     }
 
 public:
-    SerialCommandHandler() : serial(nullptr) {}
+    SerialCommandHandler() : channelCount(0), firstChannel(0), current(nullptr), jobHead(0), jobCount(0), jobsPeak(0), jobsRejected(0), jobsDeferred(0), stats(), lastCmd(-1), lastCmdUs(0), lastBytes(0), lastPeakHeap(0), binaryRequest(false),
+          eventsSkipped(0) {}
 
-    void begin(Stream* serialPort) {
-        serial = serialPort;
-        rxBuffer.reserve(MAX_BUFFER);
-        rxBuffer = "";
+    // Adds a transport; up to COMMAND_CHANNELS, served round robin
+    bool attach(const char* name, Stream* port) {
+        if (channelCount == COMMAND_CHANNELS) return false;
+        Channel& ch = channels[channelCount++];
+        ch.name = name;
+        ch.port = port;
+        ch.lines.begin(port);
+        ch.tx.begin(port);
+        ch.tx.onStall(releaseState, retakeState);
+        ch.jobs = 0;
+        ch.commands = 0;
+        ch.subscribed = false;
+        ch.subscriberBinary = false;
+        ch.sentSeq = 0;
+        if (!current) current = &ch;
+        return true;
     }
 
-    void loop() {
-        if (!serial) return;
+    // Bytes following the current command line on its port, for commands
+    // that read a binary payload (readBytes with the stream's timeout)
+    LineAssembler<MAX_BUFFER>& input() {
+        return current->lines;
+    }
 
-        while (serial->available() > 0) {
-            char c = serial->read();
+    // The current command's port, for its read timeout
+    Stream& port() {
+        return *current->port;
+    }
 
-            if (rxBuffer.length() >= MAX_BUFFER) {
-                rxBuffer = "";
-                sendError("Buffer overflow", -1);
-                continue;
+    // Where commands that stream raw data (export_library) write it, so it
+    // stays in order with the JSON around it
+    Print& output() {
+        return current->tx;
+    }
+
+    // Passes queued output to the port without waiting, for handlers that
+    // run for a while and expect the host to answer what they sent
+    void drainOutput() {
+        current->tx.drain();
+    }
+
+    // Sends everything queued before a restart
+    void flushOutput() {
+        for (uint8_t i = 0; i < channelCount; i++) channels[i].tx.flush();
+    }
+
+    const char* lastCommand() const { return lastCmd >= 0 ? COMMANDS[lastCmd].name : ""; }
+    uint32_t lastUs() const { return lastCmdUs; }
+    uint32_t lastResponseBytes() const { return lastBytes; }
+    uint32_t lastPeakHeapBytes() const { return lastPeakHeap; }
+
+    // Per-command call counts and handling time since boot
+    void statsJson(JsonWriter& out) const {
+        out.beginObject();
+        out.key("commands").beginArray();
+        for (size_t i = 0; i < COMMAND_COUNT; i++) {
+            const CommandStats& st = stats[i];
+            out.beginObject();
+            out.field("name", COMMANDS[i].name);
+            out.key("flags").beginArray();
+            if (COMMANDS[i].flags & COMMAND_SENSOR) out.value("sensor");
+            if (COMMANDS[i].flags & COMMAND_BLOCKS) out.value("blocks");
+            if (COMMANDS[i].flags & COMMAND_WRITES) out.value("writes");
+            if (COMMANDS[i].flags & COMMAND_STREAMS) out.value("streams");
+            if (COMMANDS[i].flags & COMMAND_METADATA) out.value("metadata");
+            out.endArray();
+            out.field("calls", st.calls);
+            out.field("avgUs", st.calls ? (uint32_t)(st.totalUs / st.calls) : 0);
+            out.field("maxUs", st.maxUs);
+            out.endObject();
+        }
+        out.endArray();
+        out.key("jobs").beginObject();
+        out.field("queued", jobCount);
+        out.field("depth", JOB_QUEUE_DEPTH);
+        out.field("peak", jobsPeak);
+        out.field("rejected", jobsRejected);
+        out.field("deferred", jobsDeferred);
+        out.endObject();
+        out.key("channels").beginArray();
+        for (uint8_t i = 0; i < channelCount; i++) {
+            const Channel& ch = channels[i];
+            out.beginObject();
+            out.field("name", ch.name);
+            out.field("commands", ch.commands);
+            out.field("subscribed", ch.subscribed);
+            out.key("tx");
+            ch.tx.statsJson(out);
+            out.endObject();
+        }
+        out.endArray();
+        out.field("eventsSkipped", eventsSkipped);
+        out.endObject();
+    }
+
+    // Starts pushing events to the current channel, in the protocol of the
+    // request. With resume, events after since that are still in the log
+    // are replayed.
+    void subscribe(const EventLog& log, bool resume, uint32_t since, JsonWriter& out) {
+        uint32_t from = log.latest();
+        uint32_t missed = 0;
+        if (resume && since < from) {
+            from = since;
+            if (from < log.oldest() - 1) {
+                missed = log.oldest() - 1 - from;
+                from = log.oldest() - 1;
             }
+        }
+        current->subscribed = true;
+        current->subscriberBinary = binaryRequest;
+        current->sentSeq = from;
+
+        out.beginObject();
+        out.field("ok", true);
+        out.field("seq", log.latest());
+        out.field("replay", log.latest() - from);
+        out.field("missed", missed);
+        out.endObject();
+    }
+
+    void unsubscribe() {
+        current->subscribed = false;
+    }
 
-            rxBuffer += c;
+    // Runs params.commands in order and answers with one array of results.
+    // Stops at the first failure unless params.continue is set; with
+    // params.atomic every entry must be a metadata write and passes a dry run
+    // of its command's checks before any runs, continue and the response
+    // limit do not apply, and the batch is journaled until every entry has
+    // succeeded, so a reset part-way through finishes it on the next boot.
+    void batch(JsonObject params, JsonWriter& out) {
+        JsonArray commands = params["commands"];
+        bool atomic = params["atomic"] | false;
+        bool keepGoing = !atomic && (params["continue"] | false);
+        char message[48];
 
-            if (c == '\n') {
-                String line = rxBuffer;
-                rxBuffer = "";
-                line.trim();
-                if (line.length() > 0) {
-                    processLine(line);
+        if (commands.size() == 0 || commands.size() > BATCH_MAX_COMMANDS) {
+            snprintf(message, sizeof(message), "Batch needs 1 to %d commands", BATCH_MAX_COMMANDS);
+            batchRejected(out, -1, message);
+            return;
+        }
+        if (atomic) {
+            int i = 0;
+            for (JsonObject entry : commands) {
+                if (checkBatched(entry, COMMAND_METADATA, message, sizeof(message)) < 0) {
+                    batchRejected(out, i, message);
+                    return;
+                }
+                const char* problem = checkMetadataWrite(entry["cmd"], entry["params"]);
+                if (problem) {
+                    batchRejected(out, i, problem);
+                    return;
                 }
+                i++;
+            }
+            if (!saveBatchJournal(params)) {
+                batchRejected(out, -1, "Journal write failed");
+                return;
+            }
+        }
+
+        int ran = 0, failed = 0;
+        bool truncated = false;
+        out.beginObject();
+        out.key("results").beginArray();
+        for (JsonObject entry : commands) {
+            if (failed && !keepGoing) break;
+            if (!atomic && out.bytesWritten() > BATCH_RESPONSE_MAX) {
+                truncated = true;
+                break;
+            }
+
+            out.beginObject();
+            out.field("cmd", entry["cmd"] | "");
+            int index = checkBatched(entry, 0, message, sizeof(message));
+            if (index < 0) {
+                out.field("ok", false);
+                out.field("error", message);
+                failed++;
+            } else {
+                unsigned long start = micros();
+                ResultTap tap(out.key("data").beginExternal());
+                JsonWriter result(tap, out.encoding(), nullptr, 0);
+                COMMANDS[index].handler(entry["params"], result);
+                result.flush();
+                out.endExternal(result.bytesWritten());
+                record(index, micros() - start);
+
+                bool ok = !tap.failed(out.encoding());
+                out.field("ok", ok);
+                if (!ok) failed++;
+            }
+            out.endObject();
+            ran++;
+        }
+        out.endArray();
+
+        if (atomic && failed == 0) clearBatchJournal();
+
+        out.field("ok", failed == 0 && ran == (int)commands.size());
+        out.field("ran", ran);
+        out.field("failed", failed);
+        out.field("skipped", (int)commands.size() - ran);
+        out.field("truncated", truncated);
+        out.endObject();
+    }
+
+    // A few events per channel and call, so a long replay does not hold up
+    // the loop
+    void pushEvents(const EventLog& log) {
+        for (uint8_t i = 0; i < channelCount; i++) {
+            Channel& ch = channels[i];
+            if (!ch.subscribed) continue;
+            if (ch.sentSeq < log.oldest() - 1) {
+                // Overrun while the port was backed up: the gap shows in seq
+                eventsSkipped += log.oldest() - 1 - ch.sentSeq;
+                ch.sentSeq = log.oldest() - 1;
+            }
+            for (int n = 0; n < 8 && ch.sentSeq < log.latest() && ch.tx.hasRoom(); n++) {
+                const Event* e = log.find(++ch.sentSeq);
+                if (!e) continue;
+                if (ch.subscriberBinary) {
+                    uint8_t header[3] = {FRAME_EVENT_ID & 0xFF, FRAME_EVENT_ID >> 8, FRAME_STATUS_OK};
+                    FramePrint frame(ch.tx);
+                    JsonWriter out(frame, JSON_CBOR, header, sizeof(header));
+                    eventJson(*e, out);
+                    out.flush();
+                    frame.finish();
+                } else {
+                    JsonWriter out(ch.tx);
+                    eventJson(*e, out);
+                    out.text("\r\n");
+                }
+            }
+            ch.tx.drain();
+        }
+    }
+
+    // Serves every channel in turn, a few lines each, starting one further
+    // along on every call, so a busy client cannot starve the others
+    void loop() {
+        if (channelCount == 0) return;
+
+        for (uint8_t k = 0; k < channelCount; k++) {
+            current = &channels[(firstChannel + k) % channelCount];
+            current->tx.drain();
+            serve(*current);
+        }
+        firstChannel = (firstChannel + 1) % channelCount;
+
+        runJob();
+        for (uint8_t i = 0; i < channelCount; i++) channels[i].tx.drain();
+    }
+
+private:
+    void serve(Channel& ch) {
+        for (int n = 0; n < CHANNEL_LINES_PER_PASS; n++) {
+            size_t len;
+            bool binary;
+            char* line = ch.lines.next(&len, &binary);
+            if (!line && ch.lines.fill() > 0) line = ch.lines.next(&len, &binary);
+            if (ch.lines.takeOverflow()) {
+                binaryRequest = false;
+                sendError("Buffer overflow", -1);
+            }
+            if (!line) return;
+
+            if (binary) {
+                ch.commands++;
+                processFrame((uint8_t*)line, len);
+            } else if (len > 0) {
+                ch.commands++;
+                processLine(line, len);
             }
         }
     }
@@ -0,0 +1,117 @@
+#ifndef STATE_VERSIONS_H
+#define STATE_VERSIONS_H
+
+// Version numbers for the template library, finger metadata and settings.
+//
+// Every change takes the next number from one counter, so versions of all
+// three can be compared, and the version of each slot's last change is kept
+// for delta listings. The top 16 bits are a random boot id: a version from
+// before a restart never matches, and the client gets a full answer.
+//
+// A pre-serialized response can be kept in a SnapshotCache and served again,
+// byte for byte, while its version is current.
+
+#include <Arduino.h>
+#include "JsonWriter.h"
+
+#define VERSION_SLOTS 256  // Slots listed by get_fingers (one index table page)
+
+enum VersionDomain : uint8_t {
+    VERSION_LIBRARY,   // Templates added or removed
+    VERSION_METADATA,  // Names, credentials and other per-slot NVS data
+    VERSION_SETTINGS   // Keyboard mode, typing and time settings
+};
+
+class StateVersions {
+private:
+    uint32_t current;
+    uint32_t domains[3];
+    uint32_t slots[VERSION_SLOTS];
+    uint32_t allSlots;  // Last change that touched every slot (clear, import)
+
+public:
+    StateVersions() : current(0), domains(), slots(), allSlots(0) {}
+
+    void begin(uint16_t bootId) {
+        current = ((uint32_t)(bootId | 1) << 16) | 1;
+        for (uint32_t& d : domains) d = current;
+        allSlots = current;
+    }
+
+    // Records a change to one slot, or to all of them with slot -1
+    uint32_t bump(VersionDomain domain, int slot = -1) {
+        if ((current & 0xFFFF) == 0xFFFF) current += 1;  // Counter wrapped: a new boot id as far as clients can tell
+        current++;
+        domains[domain] = current;
+        if (domain == VERSION_SETTINGS) return current;
+        if (slot < 0) allSlots = current;
+        else if (slot < VERSION_SLOTS) slots[slot] = current;
+        return current;
+    }
+
+    uint32_t latest() const { return current; }
+
+    uint32_t of(VersionDomain domain) const { return domains[domain]; }
+
+    // Templates and metadata, which together make up the finger list
+    uint32_t fingers() const {
+        return domains[VERSION_LIBRARY] > domains[VERSION_METADATA] ? domains[VERSION_LIBRARY] : domains[VERSION_METADATA];
+    }
+
+    // Whether the slots changed after since can be listed on their own
+    bool canDelta(uint32_t since) const {
+        return (since >> 16) == (current >> 16) && since >= allSlots && since <= current;
+    }
+
+    bool changedSince(int slot, uint32_t since) const {
+        return slot < VERSION_SLOTS && slots[slot] > since;
+    }
+};
+
+// Tees everything written through it into a fixed buffer. A response that
+// does not fit is passed through but not kept.
+template <size_t N>
+class SnapshotCache : public Print {
+private:
+    Print* to;
+    uint8_t data[N];
+    size_t len;
+    bool overflow;
+    bool valid;
+    uint32_t version;
+    JsonEncoding encoding;
+
+public:
+    SnapshotCache() : to(nullptr), len(0), overflow(false), valid(false), version(0), encoding(JSON_TEXT) {}
+
+    // Starts recording a response built for version
+    Print& record(Print& port, uint32_t v, JsonEncoding e) {
+        to = &port;
+        len = 0;
+        overflow = false;
+        valid = false;
+        version = v;
+        encoding = e;
+        return *this;
+    }
+
+    void finish(bool keep) { valid = keep && !overflow; }
+
+    bool matches(uint32_t v, JsonEncoding e) const { return valid && version == v && encoding == e; }
+
+    size_t replay(Print& port) const { return port.write(data, len); }
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t* buf, size_t n) override {
+        if (!overflow && len + n <= N) {
+            memcpy(data + len, buf, n);
+            len += n;
+        } else {
+            overflow = true;
+        }
+        return to->write(buf, n);
+    }
+};
+
+#endif // STATE_VERSIONS_H
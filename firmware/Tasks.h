@@ -0,0 +1,106 @@
+#ifndef TASKS_H
+#define TASKS_H
+
+// Task layout.
+//
+// The work that used to share loop() runs in three tasks, so a slow sensor
+// round trip (GenImg can take seconds) no longer holds up the config port
+// or typing:
+//   sensor   detection and enrollment; the only user of the sensor UART
+//            besides sensor commands
+//   typing   types the credential for each matched slot it is handed on a
+//            queue, and touches queued while the host reconnects
+//   command  config channels, events and BLE housekeeping
+//
+// Core and priority come from the board profile (config.h): on the S3 the
+// sensor task shares core 0 with the radio stacks and the others run on
+// core 1; the C6 has one core, so they share it by priority. Typing is
+// highest so a credential is not interleaved with anything else.
+//
+// Three recursive mutexes guard what the tasks share, always taken in this
+// order:
+//   sensorLock  the sensor UART and its buffers, templateCount and the
+//               index bitmap, and enrollment state (changed only by the
+//               sensor task and sensor commands)
+//   stateLock   everything else the tasks share: detection results,
+//               lastStatus, the event log and versions, the transports,
+//               and the Preferences object
+//   typingLock  the keyboard transport while a credential is typed. The
+//               typing task copies what it needs under stateLock, takes
+//               typingLock and lets go of stateLock; switching the
+//               transport takes typingLock under stateLock.
+// Commands hold stateLock while they run, and sensor commands take
+// sensorLock first (SerialCommandHandler::acquire). The sensor task takes
+// stateLock only for the short updates that follow a sensor operation, so
+// commands that do not use the sensor answer while one is in flight. A
+// reply stalled on a slow host lets go of stateLock until the port takes
+// it again (TxRing::onStall).
+
+#include <Arduino.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/queue.h>
+
+#define TASK_TYPING_PRIORITY 3
+#define TASK_SENSOR_PRIORITY 2
+#define TASK_COMMAND_PRIORITY 1
+
+#define TASK_SENSOR_STACK 8192   // Enrollment seals and renders the credential
+#define TASK_TYPING_STACK 8192   // Decrypted report stream and code on the stack
+#define TASK_COMMAND_STACK 12288 // Two 2 KB JSON documents plus the handler
+
+#define TYPING_QUEUE_DEPTH 4
+#define TYPING_POLL_MS 50       // Checks a touch waiting for the host this often
+#define SENSOR_POLL_MS 5
+#define SENSOR_WAIT_MS 5000     // Longest a command waits for the sensor
+
+// Holds a recursive mutex for a scope
+class TaskLock {
+private:
+    SemaphoreHandle_t mutex;
+    bool held;
+
+public:
+    explicit TaskLock(SemaphoreHandle_t m, TickType_t wait = portMAX_DELAY)
+        : mutex(m), held(xSemaphoreTakeRecursive(m, wait) == pdTRUE) {}
+
+    ~TaskLock() {
+        if (held) xSemaphoreGiveRecursive(mutex);
+    }
+
+    TaskLock(const TaskLock&) = delete;
+    TaskLock& operator=(const TaskLock&) = delete;
+
+    bool isHeld() const { return held; }
+
+    // Lets the other tasks in while this one waits on something else
+    void unlock() {
+        if (held) xSemaphoreGiveRecursive(mutex);
+        held = false;
+    }
+
+    void lock() {
+        if (!held) held = xSemaphoreTakeRecursive(mutex, portMAX_DELAY) == pdTRUE;
+    }
+};
+
+// Runs fn holding m, for single sensor round trips
+template <typename F>
+auto withLock(SemaphoreHandle_t m, F fn) -> decltype(fn()) {
+    TaskLock lock(m);
+    return fn();
+}
+
+struct TaskInfo {
+    const char* name;
+    TaskHandle_t handle;
+    int core;
+    UBaseType_t priority;
+    uint32_t stack;
+};
+
+inline bool startTask(TaskInfo& t, TaskFunction_t fn) {
+    return xTaskCreatePinnedToCore(fn, t.name, t.stack, nullptr, t.priority, &t.handle, t.core) == pdPASS;
+}
+
+#endif // TASKS_H
@@ -0,0 +1,95 @@
+#ifndef TRANSPORT_MANAGER_H
+#define TRANSPORT_MANAGER_H
+
+// Runtime keyboard transport selection.
+//
+// BLE and USB modes keep exactly one transport up; AUTO keeps both up and
+// routes each typing request to the ready transport with the lowest
+// per-report latency, so plugging in a cable moves typing to USB and
+// unplugging it falls back to BLE without any mode change. Transports left
+// out of the build (TOUCHPASS_TRANSPORT) are passed as nullptr.
+
+#include "KeyboardInterface.h"
+
+class TransportManager {
+private:
+    KeyboardInterface* ble;  // nullptr in USB-only builds
+    KeyboardInterface* usb;  // nullptr on boards without USB OTG or in BLE-only builds
+    KeyboardMode mode;
+    uint32_t lastSwitchUs;
+
+public:
+    TransportManager(KeyboardInterface* ble, KeyboardInterface* usb)
+        : ble(ble), usb(usb), mode(defaultMode()), lastSwitchUs(0) {}
+
+    // With a single transport, AUTO is just that transport
+    bool supports(KeyboardMode m) const {
+        return m == KB_MODE_AUTO || transport(m) != nullptr;
+    }
+
+    KeyboardMode defaultMode() const {
+        return ble ? KB_MODE_BLE : KB_MODE_USB;
+    }
+
+    // Brings the new transport up before taking the old one down
+    bool setMode(KeyboardMode m) {
+        if (!supports(m)) return false;
+        unsigned long start = micros();
+        bool wantBle = m != KB_MODE_USB;
+        bool wantUsb = m != KB_MODE_BLE;
+        if (wantBle && ble) ble->begin();
+        if (wantUsb && usb) usb->begin();
+        if (!wantBle && ble) ble->end();
+        if (!wantUsb && usb) usb->end();
+        mode = m;
+        lastSwitchUs = micros() - start;
+        return true;
+    }
+
+    KeyboardMode getMode() const { return mode; }
+    uint32_t switchUs() const { return lastSwitchUs; }
+
+    KeyboardInterface* transport(KeyboardMode m) const {
+        return m == KB_MODE_USB ? usb : ble;
+    }
+
+    bool isUp(KeyboardMode m) const {
+        KeyboardInterface* t = transport(m);
+        return t && t->isUp();
+    }
+
+    // Ready transport for the next credential, or nullptr if none
+    KeyboardInterface* route() const {
+        KeyboardInterface* best = nullptr;
+        KeyboardInterface* candidates[] = {usb, ble};
+        for (KeyboardInterface* t : candidates) {
+            if (!t || !t->isUp() || !t->isReady()) continue;
+            if (!best || t->reportIntervalUs() < best->reportIntervalUs()) best = t;
+        }
+        return best;
+    }
+
+    // Signals the first up transport whose host is asleep and can be woken;
+    // returns it, or nullptr. The caller waits for it to become ready.
+    KeyboardInterface* wake() const {
+        KeyboardInterface* candidates[] = {usb, ble};
+        for (KeyboardInterface* t : candidates) {
+            if (t && t->isUp() && t->wake()) return t;
+        }
+        return nullptr;
+    }
+
+    bool isConnected() const {
+        return (usb && usb->isConnected()) || (ble && ble->isConnected());
+    }
+
+    static const char* modeName(KeyboardMode m) {
+        switch (m) {
+            case KB_MODE_USB: return "USB-HID";
+            case KB_MODE_AUTO: return "AUTO";
+            default: return "BLE";
+        }
+    }
+};
+
+#endif // TRANSPORT_MANAGER_H
@@ -0,0 +1,213 @@
+#ifndef TX_RING_H
+#define TX_RING_H
+
+// Transmit ring for the config port.
+//
+// Everything sent on the port is written into a fixed ring, and drain()
+// moves only as much to the port as availableForWrite() says it takes, so
+// sending never blocks the command task when the host stops reading (a
+// browser tab in the background, a crashed tool).
+//
+// Message classes:
+//   responses  never dropped while the host reads: a full ring is drained
+//              in place, waiting up to TX_STALL_MS. A host that reads
+//              nothing for that long is considered gone, and output is
+//              discarded (and counted) until the ring has emptied.
+//              The command task holds its locks while it writes a reply,
+//              so they are let go for the wait (onStall()); a slow host
+//              then holds up the reply, not matches and typing.
+//
+// Output is only ever dropped in whole messages (JSON lines ending in '\n',
+// binary frames between 0x00 delimiters). The unfinished message is taken
+// back out of the ring, or, if part of it already went out, cut short with
+// its terminator, and the rest of it is skipped; the next message is kept
+// once the ring has emptied. A dropped response is never joined to the
+// one after it.
+//   events     only queued when they fit without waiting (hasRoom()); the
+//              rest stay in the EventLog and are sent later, or skipped
+//              if the log wraps (SerialCommandHandler::pushEvents).
+
+#include <Arduino.h>
+#include "JsonWriter.h"
+
+#define TX_RING_SIZE 4096
+#define TX_STALL_MS 500
+#define TX_EVENT_MAX 256  // Room an event needs before it is queued
+
+// Lets go of the caller's locks for a stall and returns how many were
+// held; the count is handed back to retake them
+typedef int (*TxStallRelease)();
+typedef void (*TxStallRetake)(int held);
+
+template <size_t N>
+class TxRing : public Print {
+private:
+    enum Message : uint8_t { MESSAGE_NONE, MESSAGE_LINE, MESSAGE_FRAME };
+
+    Stream* port;
+    uint8_t buf[N];
+    size_t head;     // Oldest queued byte
+    size_t count;    // Bytes queued
+    size_t partial;  // Queued bytes of the unfinished message
+    Message message; // Kind of message being written
+    bool discarding;
+    TxStallRelease stallRelease;
+    TxStallRetake stallRetake;
+
+    // Counters since boot
+    uint32_t queued;
+    uint32_t dropped;
+    uint32_t stalls;
+    uint32_t stalledMs;
+    size_t peak;
+
+    // Drains until there is room; false if the host stopped reading
+    bool waitForRoom() {
+        unsigned long start = millis();
+        stalls++;
+        int held = stallRelease ? stallRelease() : 0;
+        while (count == N) {
+            drain();
+            if (count < N) break;
+            if (millis() - start > TX_STALL_MS) {
+                abandon();
+                break;
+            }
+            delay(1);
+        }
+        if (stallRetake) stallRetake(held);
+        stalledMs += millis() - start;
+        return !discarding;
+    }
+
+    // Follows message boundaries over written bytes. With untilEnd, stops
+    // after the byte that ends the current message; returns bytes consumed.
+    size_t track(const uint8_t* data, size_t len, bool untilEnd) {
+        for (size_t i = 0; i < len; i++) {
+            uint8_t b = data[i];
+            bool end = false;
+            if (message == MESSAGE_NONE) {
+                if (b == 0x00) message = MESSAGE_FRAME;
+                else if (b == '\n') end = true;
+                else message = MESSAGE_LINE;
+            } else {
+                end = b == (message == MESSAGE_FRAME ? 0x00 : '\n');
+            }
+            if (end) {
+                message = MESSAGE_NONE;
+                partial = 0;
+                if (untilEnd) return i + 1;
+            } else {
+                partial++;
+            }
+        }
+        return len;
+    }
+
+    // The host stopped reading: takes the unfinished message back out of
+    // the ring, or ends it if part of it is already on the wire
+    void abandon() {
+        discarding = true;
+        if (message == MESSAGE_NONE) return;
+        if (partial <= count) {
+            count -= partial;
+            dropped += partial;
+        } else {
+            dropped += count;
+            head = 0;
+            buf[0] = message == MESSAGE_FRAME ? 0x00 : '\n';
+            count = 1;
+        }
+        partial = 0;
+    }
+
+    // Output is kept again from the next message once the ring is empty
+    void resume() {
+        if (discarding && count == 0 && message == MESSAGE_NONE) discarding = false;
+    }
+
+public:
+    TxRing()
+        : port(nullptr), head(0), count(0), partial(0), message(MESSAGE_NONE), discarding(false),
+          stallRelease(nullptr), stallRetake(nullptr), queued(0), dropped(0), stalls(0), stalledMs(0), peak(0) {}
+
+    void begin(Stream* p) { port = p; }
+
+    void onStall(TxStallRelease release, TxStallRetake retake) {
+        stallRelease = release;
+        stallRetake = retake;
+    }
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        size_t left = len;
+        while (left > 0) {
+            if (!discarding && count == N) waitForRoom();
+            if (discarding) {
+                size_t n = track(data, left, true);
+                dropped += n;
+                data += n;
+                left -= n;
+                drain();
+                resume();
+                continue;
+            }
+            size_t tail = (head + count) % N;
+            size_t chunk = N - count;
+            if (chunk > N - tail) chunk = N - tail;
+            if (chunk > left) chunk = left;
+            memcpy(buf + tail, data, chunk);
+            track(data, chunk, false);
+            count += chunk;
+            data += chunk;
+            left -= chunk;
+            queued += chunk;
+        }
+        if (count > peak) peak = count;
+        return len;  // Dropped bytes are reported as written; callers never retry
+    }
+
+    // Moves what the port will take right now; never blocks
+    void drain() {
+        while (count > 0 && port) {
+            int room = port->availableForWrite();
+            if (room <= 0) break;
+            size_t chunk = N - head < count ? N - head : count;
+            if (chunk > (size_t)room) chunk = room;
+            size_t n = port->write(buf + head, chunk);
+            if (n == 0) break;
+            head = (head + n) % N;
+            count -= n;
+        }
+        if (count == 0) head = 0;
+        resume();
+    }
+
+    // Waits until everything queued is on its way (restart, raw transfers)
+    void flush() override {
+        unsigned long start = millis();
+        while (count > 0 && !discarding && millis() - start <= TX_STALL_MS) {
+            drain();
+            if (count > 0) delay(1);
+        }
+        if (port) port->flush();
+    }
+
+    // Whether an event can be queued without waiting
+    bool hasRoom(size_t len = TX_EVENT_MAX) const { return !discarding && N - count >= len; }
+
+    void statsJson(JsonWriter& out) const {
+        out.beginObject();
+        out.field("size", (uint32_t)N);
+        out.field("pending", (uint32_t)count);
+        out.field("peak", (uint32_t)peak);
+        out.field("queued", queued);
+        out.field("dropped", dropped);
+        out.field("stalls", stalls);
+        out.field("stalledMs", stalledMs);
+        out.endObject();
+    }
+};
+
+#endif // TX_RING_H
@@ -0,0 +1,130 @@
+#ifndef TYPING_SYNC_H
+#define TYPING_SYNC_H
+
+// Closed-loop typing barrier.
+//
+// Completion events only say a report left the device. To know the host has
+// consumed everything typed so far, a barrier taps Scroll Lock at a chunk
+// boundary: the host's HID stack handles reports in order and answers the
+// toggle with a LED output report (USB set-report / BLE output report write)
+// only after the preceding keys. Hosts that never echo (macOS ignores Scroll
+// Lock) are detected by timeout and typed with timed pacing instead.
+
+#include <Arduino.h>
+#include "HidTypist.h"
+
+#define HID_KEY_SCROLL_LOCK 0x47
+
+// Updated from the USB LED event and the BLE output report write, and read
+// by the typing task without a lock: every field is a single volatile word
+struct HostLeds {
+    volatile uint32_t reports;  // LED output reports received
+    volatile uint8_t state;     // Last LED bitmap (bit 2 = Scroll Lock)
+    volatile bool echoes;       // Cleared when a barrier times out, set again by any LED report
+};
+
+inline void noteHostLeds(HostLeds& leds, uint8_t state) {
+    leds.state = state;
+    leds.reports++;
+    leds.echoes = true;
+}
+
+struct SyncStats {
+    uint32_t barriers;
+    uint32_t fallbacks;
+    uint32_t lastAckUs;
+    uint32_t maxAckUs;
+    uint64_t totalAckUs;
+};
+
+// Folds the counters of one credential into the running totals
+inline void addSyncStats(SyncStats& total, const SyncStats& run) {
+    total.barriers += run.barriers;
+    total.fallbacks += run.fallbacks;
+    total.totalAckUs += run.totalAckUs;
+    if (run.barriers) total.lastAckUs = run.lastAckUs;
+    if (run.maxAckUs > total.maxAckUs) total.maxAckUs = run.maxAckUs;
+}
+
+struct SyncConfig {
+    uint16_t chunkReports;   // Reports between barriers
+    uint16_t echoTimeoutMs;  // Longest wait for the LED report
+    uint16_t fallbackGapMs;  // Per-report pause once the host is found not to echo
+};
+
+class SyncedSink final : public ReportSink {
+private:
+    ReportSink& inner;
+    HostLeds& leds;
+    SyncStats& stats;
+    SyncConfig cfg;
+    uint16_t sinceBarrier;
+    uint8_t toggles;
+    bool released;
+
+    bool toggle(uint32_t timeoutMs) {
+        HidReport r;
+        memset(&r, 0, sizeof(r));
+        r.keys[0] = HID_KEY_SCROLL_LOCK;
+        if (!inner.sendReport(r)) return false;
+        inner.waitSent(timeoutMs);
+        r.keys[0] = 0;
+        if (!inner.sendReport(r)) return false;
+        inner.waitSent(timeoutMs);
+        toggles++;
+        return true;
+    }
+
+    void barrier() {
+        uint32_t seen = leds.reports;
+        unsigned long start = micros();
+        sinceBarrier = 0;
+        if (!toggle(cfg.echoTimeoutMs)) return;
+
+        while (leds.reports == seen) {
+            if (micros() - start >= cfg.echoTimeoutMs * 1000UL) {
+                leds.echoes = false;
+                stats.fallbacks++;
+                return;
+            }
+            // Spin briefly for USB-speed echoes, then yield
+            if (micros() - start < 2000) delayMicroseconds(100);
+            else delay(1);
+        }
+
+        uint32_t ackUs = micros() - start;
+        stats.barriers++;
+        stats.lastAckUs = ackUs;
+        stats.totalAckUs += ackUs;
+        if (ackUs > stats.maxAckUs) stats.maxAckUs = ackUs;
+    }
+
+public:
+    SyncedSink(ReportSink& inner, HostLeds& leds, SyncStats& stats, const SyncConfig& cfg)
+        : inner(inner), leds(leds), stats(stats), cfg(cfg), sinceBarrier(0), toggles(0), released(true) {}
+
+    bool sendReport(const HidReport& report) override {
+        static const uint8_t none[HID_ROLLOVER_KEYS] = {0};
+        released = report.modifiers == 0 && memcmp(report.keys, none, sizeof(none)) == 0;
+        sinceBarrier++;
+        return inner.sendReport(report);
+    }
+
+    bool waitSent(uint32_t timeoutMs) override {
+        bool ok = inner.waitSent(timeoutMs);
+        if (!leds.echoes) {
+            delay(cfg.fallbackGapMs);
+        } else if (released && sinceBarrier >= cfg.chunkReports) {
+            barrier();
+        }
+        return ok;
+    }
+
+    // Waits for the host to consume the tail and leaves Scroll Lock as found
+    void finish() {
+        if (leds.echoes && sinceBarrier > 0) barrier();
+        if (toggles % 2) toggle(cfg.echoTimeoutMs);
+    }
+};
+
+#endif // TYPING_SYNC_H
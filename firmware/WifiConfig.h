@@ -0,0 +1,85 @@
+#ifndef WIFI_CONFIG_H
+#define WIFI_CONFIG_H
+
+// Config port over WiFi (TOUCHPASS_CONFIG_WIFI in config.h).
+//
+// The device opens an access point and accepts one TCP client at a time on
+// WIFI_CONFIG_PORT, speaking the same line and frame protocol as the USB
+// port (for example `nc 192.168.4.1 7000`). A new client replaces the
+// previous one. It is a Stream, so SerialCommandHandler serves it like the
+// other channels; availableForWrite() is what the transmit ring paces on.
+//
+// The port serves the whole protocol without further authentication, so
+// the access point's WPA2 password is the only guard: it is generated per
+// device on first boot and kept in NVS (firmware.ino), and can be read over
+// USB with get_system_info.
+
+#include <Arduino.h>
+#include <WiFi.h>
+#include <lwip/sockets.h>
+
+#define WIFI_CONFIG_SSID "TouchPass"
+#define WIFI_CONFIG_PSK_LEN 16
+#define WIFI_CONFIG_PORT 7000
+#define WIFI_CONFIG_CHUNK 1436  // One TCP segment
+
+class WifiConfigPort : public Stream {
+private:
+    WiFiServer server;
+    WiFiClient client;
+    bool started;
+    uint32_t clients;
+
+public:
+    WifiConfigPort() : server(WIFI_CONFIG_PORT), started(false), clients(0) {}
+
+    bool begin(const char* password) {
+        WiFi.mode(WIFI_AP);
+        if (strlen(password) < 8 || !WiFi.softAP(WIFI_CONFIG_SSID, password)) return false;
+        server.begin();
+        server.setNoDelay(true);
+        started = true;
+        return true;
+    }
+
+    // Called from the command task; picks up a new client
+    void poll() {
+        if (!started || !server.hasClient()) return;
+        if (client) client.stop();
+        client = server.accept();
+        client.setNoDelay(true);
+        clients++;
+    }
+
+    bool isOpen() { return client.connected(); }
+    uint32_t clientCount() const { return clients; }
+
+    int available() override { return client ? client.available() : 0; }
+    int peek() override { return client ? client.peek() : -1; }
+    int read() override { return client ? client.read() : -1; }
+
+    // lwIP reports a socket writable only while more than its low-water mark
+    // (at least two segments) of send buffer is free, so one segment then
+    // goes out without blocking
+    int availableForWrite() override {
+        if (!isOpen()) return 0;
+        int fd = client.fd();
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(fd, &set);
+        timeval now = {0, 0};
+        return select(fd + 1, nullptr, &set, nullptr, &now) > 0 ? WIFI_CONFIG_CHUNK : 0;
+    }
+
+    size_t write(uint8_t b) override { return write(&b, 1); }
+
+    size_t write(const uint8_t* data, size_t len) override {
+        if (!isOpen()) return len;  // Nobody listening: dropped like on a closed port
+        return client.write(data, len);
+    }
+
+    // Writes are passed to the socket as they come
+    void flush() override {}
+};
+
+#endif // WIFI_CONFIG_H
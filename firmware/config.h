@@ -0,0 +1,131 @@
+// TouchPass Configuration
+// Board profiles, build options and sensor protocol constants
+
+#ifndef TOUCHPASS_CONFIG_H
+#define TOUCHPASS_CONFIG_H
+
+#include <stdint.h>
+#include "sdkconfig.h"
+
+// ===== Board Profiles =====
+// Pins and capabilities per board. Code reads them through Board, so a new
+// board is one more profile rather than another set of #ifs.
+struct XiaoEsp32S3 {
+    static constexpr const char* chip = "ESP32-S3";
+    static constexpr uint8_t fpTxPin = 5;   // D4 (GPIO5) - Sensor TX
+    static constexpr uint8_t fpRxPin = 6;   // D5 (GPIO6) - Sensor RX
+    static constexpr bool usbOtg = true;    // TinyUSB device: HID keyboard and CDC config port
+    static constexpr int sensorCore = 0;    // With the radio stacks; the sensor task mostly waits on its UART
+    static constexpr int typingCore = 1;
+    static constexpr int commandCore = 1;
+};
+
+struct XiaoEsp32C6 {
+    static constexpr const char* chip = "ESP32-C6";
+    static constexpr uint8_t fpTxPin = 16;  // D6
+    static constexpr uint8_t fpRxPin = 17;  // D7
+    static constexpr bool usbOtg = false;   // USB Serial/JTAG only
+    static constexpr int sensorCore = 0;    // Single core: tasks share it by priority
+    static constexpr int typingCore = 0;
+    static constexpr int commandCore = 0;
+};
+
+#if CONFIG_IDF_TARGET_ESP32S3
+  typedef XiaoEsp32S3 Board;
+  #define BOARD_HAS_USB_OTG 1
+  // Config serial uses UART0 (GPIO43/44) via Serial object when USB CDC On Boot is disabled
+#else
+  typedef XiaoEsp32C6 Board;
+  #define BOARD_HAS_USB_OTG 0
+#endif
+
+#define FP_TX_PIN Board::fpTxPin
+#define FP_RX_PIN Board::fpRxPin
+
+// ===== Keyboard Transport =====
+// Default builds carry BLE and (on USB OTG boards) USB-HID and pick one at
+// runtime. A fixed build compiles in a single transport, which drops the
+// other stack from the image and lets the typing loop call it directly:
+//   --build-property "compiler.cpp.extra_flags=-DTOUCHPASS_TRANSPORT=2"
+#define TOUCHPASS_TRANSPORT_AUTO 0
+#define TOUCHPASS_TRANSPORT_BLE 1
+#define TOUCHPASS_TRANSPORT_USB 2
+
+#ifndef TOUCHPASS_TRANSPORT
+  #define TOUCHPASS_TRANSPORT TOUCHPASS_TRANSPORT_AUTO
+#endif
+
+#define TOUCHPASS_HAS_BLE (TOUCHPASS_TRANSPORT != TOUCHPASS_TRANSPORT_USB)
+#define TOUCHPASS_HAS_USB (TOUCHPASS_TRANSPORT != TOUCHPASS_TRANSPORT_BLE && BOARD_HAS_USB_OTG)
+
+#if TOUCHPASS_TRANSPORT == TOUCHPASS_TRANSPORT_BLE
+  #define TOUCHPASS_TRANSPORT_NAME "BLE"
+#elif TOUCHPASS_TRANSPORT == TOUCHPASS_TRANSPORT_USB
+  #define TOUCHPASS_TRANSPORT_NAME "USB-HID"
+#else
+  #define TOUCHPASS_TRANSPORT_NAME "AUTO"
+#endif
+
+#if TOUCHPASS_TRANSPORT == TOUCHPASS_TRANSPORT_USB && !BOARD_HAS_USB_OTG
+  #error "USB-HID transport needs a board with USB OTG (ESP32-S3)"
+#endif
+
+// ===== Config Channels =====
+// The config protocol is served on USB CDC, and on a BLE UART service
+// whenever BLE is up. A WiFi access point with a TCP config socket can be
+// added; it is off by default, since it shares the radio with BLE:
+//   --build-property "compiler.cpp.extra_flags=-DTOUCHPASS_CONFIG_WIFI=1"
+#ifndef TOUCHPASS_CONFIG_WIFI
+  #define TOUCHPASS_CONFIG_WIFI 0
+#endif
+
+// ===== Device Key =====
+// The key that encrypts stored credentials is kept in NVS sealed under a key
+// the HMAC peripheral derives from an eFuse key block, so a flash dump alone
+// does not reveal it. On first boot the block is burned, permanently and read
+// protected, with a random key. A build that must leave the eFuses alone
+// keeps the device key in plain NVS and needs NVS encryption instead:
+//   --build-property "compiler.cpp.extra_flags=-DTOUCHPASS_EFUSE_KEY=0"
+#ifndef TOUCHPASS_EFUSE_KEY
+  #define TOUCHPASS_EFUSE_KEY 1
+#endif
+#define TOUCHPASS_EFUSE_KEY_SLOT 5  // EFUSE_BLK_KEY5 / HMAC_KEY5
+
+// ===== Fingerprint Sensor Protocol =====
+#define FP_HEADER 0xEF01
+#define FP_DEFAULT_ADDR 0xFFFFFFFF
+#define FP_CMD_PACKET 0x01
+#define FP_DATA_PACKET 0x02
+#define FP_END_PACKET 0x08
+
+#define CMD_GENIMG 0x01
+#define CMD_IMG2TZ 0x02
+#define CMD_SEARCH 0x04
+#define CMD_REGMODEL 0x05
+#define CMD_STORE 0x06
+#define CMD_LOADCHAR 0x07
+#define CMD_UPCHAR 0x08
+#define CMD_DOWNCHAR 0x09
+#define CMD_DELETCHAR 0x0C
+#define CMD_EMPTY 0x0D
+#define CMD_SETSYSPARA 0x0E
+#define CMD_READSYSPARA 0x0F
+#define CMD_TEMPLATENUM 0x1D
+#define CMD_READINDEXTABLE 0x1F
+#define CMD_AURALEDCONFIG 0x35
+#define CMD_CHECKSENSOR 0x36
+#define CMD_HANDSHAKE 0x40
+
+#define FP_SYSPARA_BAUD 4
+#define FP_SYSPARA_PACKET_SIZE 6
+#define FP_DEFAULT_BAUD 57600
+#define FP_BULK_BAUD 115200
+#define FP_TEMPLATE_MAX 2048
+
+#define LED_RED 0x01
+#define LED_GREEN 0x04
+#define LED_FLASHING 0x02
+#define LED_ON 0x03
+#define LED_OFF 0x04
+
+#endif // TOUCHPASS_CONFIG_H
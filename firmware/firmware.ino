@@ -13,66 +13,137 @@
 // Config: USB-C cable, Serial @ 115200 baud
 
 #include "sdkconfig.h"
+#include "config.h"
 #include <HardwareSerial.h>
 #include <Preferences.h>
 #include <ArduinoJson.h>
+#include <esp_random.h>
+#include <esp_partition.h>
+#if TOUCHPASS_EFUSE_KEY
+#include <esp_efuse.h>
+#include <esp_hmac.h>
+#endif
 #include "SerialCommandHandler.h"
-
+#include "CredentialCrypto.h"
+#include "LibraryArchive.h"
+#include "MetadataImage.h"
+#include "BootSnapshot.h"
+#include "Totp.h"
+#include "HidStream.h"
+#include "EventLog.h"
+#include "StateVersions.h"
+#include "Tasks.h"
+#include <sys/time.h>
+
+#if BOARD_HAS_USB_OTG
 #include <USB.h>
+#endif
+#if TOUCHPASS_HAS_USB
 #include <USBHIDKeyboard.h>
+#endif
+#if TOUCHPASS_HAS_BLE
 #include <BleKeyboard.h>
-
-#if CONFIG_IDF_TARGET_ESP32S3
-  #define FP_TX_PIN 5   // D4 - Fingerprint sensor TX (GPIO5)
-  #define FP_RX_PIN 6   // D5 - Fingerprint sensor RX (GPIO6)
-  // Config serial uses UART0 (GPIO43/44) via Serial object when USB CDC On Boot is disabled
-#else
-  #define FP_TX_PIN 16
-  #define FP_RX_PIN 17
+#include <esp_bt.h>
+#include "BleLink.h"
+#include "BleUart.h"
 #endif
-
-#define FP_HEADER 0xEF01
-#define FP_DEFAULT_ADDR 0xFFFFFFFF
-#define FP_CMD_PACKET 0x01
-
-#define CMD_GENIMG 0x01
-#define CMD_IMG2TZ 0x02
-#define CMD_SEARCH 0x04
-#define CMD_REGMODEL 0x05
-#define CMD_STORE 0x06
-#define CMD_DELETCHAR 0x0C
-#define CMD_EMPTY 0x0D
-#define CMD_READSYSPARA 0x0F
-#define CMD_TEMPLATENUM 0x1D
-#define CMD_READINDEXTABLE 0x1F
-#define CMD_AURALEDCONFIG 0x35
-#define CMD_CHECKSENSOR 0x36
-#define CMD_HANDSHAKE 0x40
-
-#define LED_RED 0x01
-#define LED_GREEN 0x04
-#define LED_FLASHING 0x02
-#define LED_ON 0x03
-#define LED_OFF 0x04
+#if TOUCHPASS_CONFIG_WIFI
+#include "WifiConfig.h"
+#endif
+#include "TypingSync.h"
+#include "TransportManager.h"
 
 HardwareSerial fpSerial(1);
 SerialCommandHandler cmdHandler;
 
-// Both keyboard types available
+// Keyboard types compiled into this build (TOUCHPASS_TRANSPORT in config.h)
+#if TOUCHPASS_HAS_USB
 USBHIDKeyboard usbKeyboard;
+#endif
+#if TOUCHPASS_HAS_BLE
 BleKeyboard bleKeyboard("TouchPass", "Anthropic", 100);
-bool usbInitialized = false;
-bool bleInitialized = false;
-bool useUsb = false;  // Default to BLE for ESP32-S3 (USB Serial for config only)
+BleLinkMonitor bleLink;
+BleUartStream bleUart;  // Config channel, added once BLE is up
+#endif
+#if TOUCHPASS_CONFIG_WIFI
+WifiConfigPort wifiConfig;
+#endif
+
+// Extra per-report settle time on top of completion pacing, for hosts that drop keys
+TypingPace usbPace = {0, 100};
+TypingPace blePace = {0, 100};
+uint8_t keyboardLayout = HID_LAYOUT_US;
+uint32_t lastTypeMs = 0;
+uint32_t lastTypeReports = 0;
+uint32_t typeAckTimeouts = 0;
+
+// A touch while the BLE host is reconnecting waits (slot only) until the deadline
+#define TOUCH_QUEUE_MS 10000
+int16_t queuedTouchSlot = -1;
+unsigned long queuedTouchDeadline = 0;
+
+// Optional LED-echo barrier; fallback gaps are the old fixed per-character delays
+bool typingSync = false;
+uint16_t syncChunk = 32;
+HostLeds hostLeds = {0, 0, true};
+SyncStats syncStats = {};
+
+// A suspended USB host is woken by the touch; typing waits this long for it
+#define HOST_WAKE_MS 3000
+uint32_t hostWakes = 0;
+uint32_t hostWakeFailures = 0;
+uint32_t lastWakeMs = 0;
+uint32_t maxWakeMs = 0;
+
+#if TOUCHPASS_HAS_BLE
+BLEKeyboardWrapper bleTransport(bleKeyboard, bleLink, &hostLeds, blePace);
+KeyboardInterface* const bleKb = &bleTransport;
+#else
+KeyboardInterface* const bleKb = nullptr;
+#endif
+#if TOUCHPASS_HAS_USB
+USBKeyboardWrapper usbTransport(usbKeyboard, &hostLeds, usbPace);
+KeyboardInterface* const usbKb = &usbTransport;
+#else
+KeyboardInterface* const usbKb = nullptr;
+#endif
+
+// Default to BLE (USB Serial for config only); switched at runtime by set_keyboard_mode
+TransportManager transports(bleKb, usbKb);
+KeyboardMode keyboardMode = transports.defaultMode();
+
+// Booting in USB mode hands the Bluetooth controller and host memory back to
+// the heap; it cannot be taken back, so BLE then needs a restart. Without BLE
+// in the build the Arduino core releases it at startup.
+bool btReleased = !TOUCHPASS_HAS_BLE;
+uint32_t btReclaimedBytes = 0;
+
+// Set by reboot / set_keyboard_mode; the command task restarts once the reply is out
+bool restartPending = false;
 
 Preferences prefs;
+CredentialCrypto credCrypto;
+bool deviceKeyInEfuse = false;  // Device key sealed under the eFuse HMAC key
+uint32_t lastDecryptUs = 0;
+float clockDriftPpm = 0;
+uint32_t lastTimeSync = 0;
 
 uint32_t fpAddress = FP_DEFAULT_ADDR;
 uint16_t templateCount = 0;
 uint16_t librarySize = 200;
+uint32_t fpBaud = FP_DEFAULT_BAUD;
+uint16_t fpPacketSize = 128;
+uint32_t bulkRestoreBaud = FP_DEFAULT_BAUD;
+uint16_t bulkRestorePacketSize = 128;
+bool bulkPending = false;  // Sensor settings still to put back
+uint8_t libraryIndex[32];  // Occupancy bitmap of index table page 0
 String lastStatus = "Ready";
 bool sensorOk = false;
 
+RTC_NOINIT_ATTR BootSnapshot rtcSnapshot;
+bool warmBoot = false;
+unsigned long bootReadyMs = 0;
+
 enum EnrollState {
     ENROLL_IDLE,
     ENROLL_CAPTURE_1, ENROLL_LIFT_1,
@@ -88,6 +159,7 @@ enum EnrollState {
 EnrollState enrollState = ENROLL_IDLE;
 String pendingFingerName = "";
 String pendingFingerPassword = "";
+String pendingFingerUsername = "";
 bool pendingPressEnter = false;
 int16_t pendingSlot = -1;
 int pendingFingerId = -1;
@@ -110,49 +182,285 @@ int lastDetectedScore = 0;
 uint8_t lastDetectResult = 0xFF;
 bool newDetectionAvailable = false;
 
-uint8_t rxBuffer[256];
+// Pushed to subscribed clients by cmdHandler.pushEvents()
+EventLog events;
+
+// Versions for if_version/since; the finger list is cached per version
+StateVersions versions;
+SnapshotCache<4096> fingerCache;
+
+// Shared between the sensor, typing and command tasks (Tasks.h)
+SemaphoreHandle_t sensorLock;
+SemaphoreHandle_t stateLock;
+SemaphoreHandle_t typingLock;
+QueueHandle_t typingQueue;  // Matched slots to type
+
+TaskInfo sensorTaskInfo = {"sensor", nullptr, Board::sensorCore, TASK_SENSOR_PRIORITY, TASK_SENSOR_STACK};
+TaskInfo typingTaskInfo = {"typing", nullptr, Board::typingCore, TASK_TYPING_PRIORITY, TASK_TYPING_STACK};
+TaskInfo commandTaskInfo = {"command", nullptr, Board::commandCore, TASK_COMMAND_PRIORITY, TASK_COMMAND_STACK};
+
+uint8_t rxBuffer[256 + 16];  // Largest data packet plus framing
+uint8_t templateBuffer[FP_TEMPLATE_MAX];
+
+// Records a template or metadata change for events and versioned listings
+void libraryChanged(int16_t slot, LibraryChange change) {
+    versions.bump(change == LIBRARY_UPDATED ? VERSION_METADATA : VERSION_LIBRARY, slot);
+    events.push(EVENT_LIBRARY, millis(), templateCount, slot, change);
+}
 
 bool isKeyboardConnected() {
-    if (useUsb) {
-        return usbInitialized;
-    } else {
-        return bleKeyboard.isConnected();
-    }
+    return transports.isConnected();
 }
 
 String getKeyboardMode() {
-    return useUsb ? "USB-HID" : "BLE";
+    return TransportManager::modeName(transports.getMode());
+}
+
+// ===== Typing =====
+
+#if TOUCHPASS_HAS_USB
+void usbLedEvent(void* arg, esp_event_base_t base, int32_t id, void* data) {
+    noteHostLeds(hostLeds, ((arduino_usb_hid_keyboard_event_data_t*)data)->leds);
+}
+#endif
+
+// Pace of the transport the next credential would be typed on
+const TypingPace& activePace() {
+    KeyboardInterface* kb = transports.route();
+    KeyboardMode m = kb ? kb->getMode() : transports.getMode();
+    return m == KB_MODE_USB ? usbPace : blePace;
+}
+
+bool waitHostAwake(KeyboardInterface* kb, unsigned long wakeStart) {
+    while (!kb->isReady()) {
+        if (millis() - wakeStart >= HOST_WAKE_MS) return false;
+        delay(1);
+    }
+    return true;
+}
+
+// Counters from one credential, published once stateLock is held again
+struct TypeCounts {
+    uint32_t reports;
+    uint32_t ackTimeouts;
+};
+
+// Instantiated per concrete transport, so the per-report calls are inlined
+template <typename Sink>
+TypeCounts playCredential(Sink& sink, const TypingPace& pace, const HidKey* layout,
+                          const SecureArray<HID_STREAM_MAX>& stream, const SecureArray<8>& code) {
+    BasicHidStreamPlayer<Sink> player(sink, pace.ackTimeoutMs);
+    player.play(stream.bytes(), stream.length(),
+                [](uint16_t ms) { delay(ms); },
+                [&](ReportSink& out) {
+                    HidTypist typist(out, pace, layout);
+                    return typist.type(code.c_str(), code.length());
+                });
+    return {player.reportsSent(), player.ackTimeouts()};
 }
 
+// Typing task. Picks the transport and loads the credential under the state
+// lock, then types holding only typingLock, so commands are answered while a
+// long credential is typed but the transport cannot change mid-credential.
 void typePassword(uint16_t fingerId) {
-    String pwd = getFingerPassword(fingerId);
-    if (pwd.length() == 0 || !isKeyboardConnected()) return;
-
-    if (useUsb) {
-        usbKeyboard.releaseAll();
-        delay(50);
-        for (unsigned int i = 0; i < pwd.length(); i++) {
-            usbKeyboard.print(String(pwd[i]));
-            delay(10);
-        }
-        if (getFingerPressEnter(fingerId)) {
-            delay(50);
-            usbKeyboard.write(KEY_RETURN);
+    TaskLock state(stateLock);
+
+    // In AUTO mode a ready USB host wins, then a sleeping one that can be
+    // woken; otherwise wait for BLE to reconnect
+    KeyboardInterface* kb = transports.route();
+    unsigned long wakeStart = 0;
+    if (!kb) {
+        kb = transports.wake();
+        if (kb) wakeStart = millis();
+    }
+    if (!kb) {
+        if (transports.isUp(KB_MODE_BLE)) {
+            queuedTouchSlot = fingerId;
+            queuedTouchDeadline = millis() + TOUCH_QUEUE_MS;
+            lastStatus = "Waiting for host";
         }
-        usbKeyboard.releaseAll();
-    } else {
-        bleKeyboard.releaseAll();
-        delay(50);
-        for (unsigned int i = 0; i < pwd.length(); i++) {
-            bleKeyboard.print(String(pwd[i]));
-            delay(30);
+        return;
+    }
+    bool usb = kb->getMode() == KB_MODE_USB;
+#if TOUCHPASS_HAS_BLE
+    if (!usb) bleLink.requestFast();
+#endif
+
+    // Rendered reports and the code live only in scrubbed buffers
+    SecureArray<HID_STREAM_MAX> stream;
+    if (!loadFingerStream(fingerId, stream)) return;
+    SecureArray<8> code;
+    if (hidStreamHasTotp(stream.bytes()) && !currentTotpCode(fingerId, code)) return;
+
+    // Playback works on copies, so the credential is typed without stateLock;
+    // typingLock keeps the transport from being switched underneath it
+    TypingPace pace = usb ? usbPace : blePace;
+    const HidKey* layout = hidLayout(keyboardLayout);
+    bool sync = typingSync;
+    SyncConfig syncCfg;
+    syncCfg.chunkReports = syncChunk;
+    syncCfg.echoTimeoutMs = usb ? 50 : 150;
+    syncCfg.fallbackGapMs = pace.gapMs ? 0 : (usb ? 10 : 30);  // The sink already adds gapMs
+    TaskLock typing(typingLock);
+    state.unlock();
+
+    // Decrypting overlaps the host's resume; the buffers are wiped on timeout
+    bool awake = !wakeStart || (waitHostAwake(kb, wakeStart) && kb->isUp());
+    unsigned long wakeMs = millis() - wakeStart;
+
+    unsigned long start = millis();
+    TypeCounts counts = {0, 0};
+    SyncStats sinkStats = {};
+    if (awake) {
+        if (sync) {
+            SyncedSink synced(*kb, hostLeds, sinkStats, syncCfg);
+            counts = playCredential(synced, pace, layout, stream, code);
+            synced.finish();
         }
-        if (getFingerPressEnter(fingerId)) {
-            delay(50);
-            bleKeyboard.write(KEY_RETURN);
+        // Thin runtime switch; a fixed-transport build compiles a single arm
+#if TOUCHPASS_HAS_USB
+        else if (kb == usbKb) counts = playCredential(usbTransport, pace, layout, stream, code);
+#endif
+#if TOUCHPASS_HAS_BLE
+        else if (kb == bleKb) counts = playCredential(bleTransport, pace, layout, stream, code);
+#endif
+    }
+    unsigned long typeMs = millis() - start;
+    typing.unlock();
+
+    state.lock();
+    if (!awake) {
+        hostWakeFailures++;
+        lastStatus = "Host asleep";
+        return;
+    }
+    lastTypeReports = counts.reports;
+    typeAckTimeouts += counts.ackTimeouts;
+    addSyncStats(syncStats, sinkStats);
+    if (wakeStart) {
+        hostWakes++;
+        lastWakeMs = wakeMs;
+        if (lastWakeMs > maxWakeMs) maxWakeMs = lastWakeMs;
+    }
+    lastTypeMs = typeMs;
+}
+
+void processQueuedTouch() {
+    uint16_t slot;
+    {
+        TaskLock state(stateLock);
+        if (queuedTouchSlot < 0) return;
+        // A host that connected but never encrypted the link gets nothing
+        if ((long)(millis() - queuedTouchDeadline) >= 0) {
+            queuedTouchSlot = -1;
+#if TOUCHPASS_HAS_BLE
+            lastStatus = bleLink.isConnected() ? "Host not bonded" : "Host not connected";
+#else
+            lastStatus = "Host not connected";
+#endif
+            return;
         }
-        bleKeyboard.releaseAll();
+        if (!transports.route()) return;
+        slot = queuedTouchSlot;
+        queuedTouchSlot = -1;
     }
+    typePassword(slot);
+}
+
+#if TOUCHPASS_HAS_BLE
+// The bonded host is kept in NVS so directed advertising works right after boot
+void loadBleHost() {
+    uint8_t host[7];
+    prefs.begin("ble", true);
+    bool ok = prefs.getBytes("host", host, sizeof(host)) == sizeof(host);
+    prefs.end();
+    if (ok) bleLink.setHost(host + 1, host[0]);
+}
+
+void saveBleHost() {
+    uint8_t host[7];
+    if (!bleLink.takeHostChange(host + 1, &host[0])) return;
+    prefs.begin("ble", false);
+    prefs.putBytes("host", host, sizeof(host));
+    prefs.end();
+}
+#endif
+
+void loadTypingSettings() {
+    prefs.begin("settings", true);
+    usbPace.gapMs = prefs.getUShort("usbGap", 0);
+    blePace.gapMs = prefs.getUShort("bleGap", 0);
+    keyboardLayout = prefs.getUChar("layout", HID_LAYOUT_US) == HID_LAYOUT_DE ? HID_LAYOUT_DE : HID_LAYOUT_US;
+    typingSync = prefs.getBool("sync", false);
+    syncChunk = prefs.getUShort("syncChunk", 32);
+    prefs.end();
+}
+
+void getTypingJson(JsonWriter& out) {
+    out.beginObject();
+    out.field("layout", hidLayoutName(keyboardLayout));
+    out.field("usbGapMs", usbPace.gapMs);
+    out.field("bleGapMs", blePace.gapMs);
+    out.field("lastMs", lastTypeMs);
+    out.field("lastReports", lastTypeReports);
+    out.field("ackTimeouts", typeAckTimeouts);
+    out.key("wake").beginObject();
+    out.field("count", hostWakes);
+    out.field("failures", hostWakeFailures);
+    out.field("lastMs", lastWakeMs);
+    out.field("maxMs", maxWakeMs);
+    out.endObject();
+    out.key("sync").beginObject();
+    out.field("enabled", typingSync);
+    out.field("chunk", syncChunk);
+    out.field("hostEchoes", (bool)hostLeds.echoes);
+    out.field("barriers", syncStats.barriers);
+    out.field("fallbacks", syncStats.fallbacks);
+    out.field("lastAckUs", syncStats.lastAckUs);
+    out.field("avgAckUs", syncStats.barriers ? (uint32_t)(syncStats.totalAckUs / syncStats.barriers) : 0);
+    out.field("maxAckUs", syncStats.maxAckUs);
+    out.endObject();
+    out.endObject();
+}
+
+// Layout and pacing changes leave stored streams stale; each slot is
+// re-rendered on its next touch.
+// Returns the failure status, or nullptr
+const char* checkTypingSettings(JsonObject params) {
+    if (!params.containsKey("layout")) return nullptr;
+    String layout = params["layout"].as<String>();
+    return layout == "us" || layout == "de" ? nullptr : "Unknown layout";
+}
+
+void setTypingJson(JsonObject params, JsonWriter& out) {
+    if (checkTypingSettings(params)) {
+        out.raw("{\"ok\":false,\"status\":\"Unknown layout\"}");
+        return;
+    }
+    if (params.containsKey("layout")) {
+        keyboardLayout = params["layout"].as<String>() == "de" ? HID_LAYOUT_DE : HID_LAYOUT_US;
+    }
+    prefs.begin("settings", false);
+    prefs.putUChar("layout", keyboardLayout);
+    if (params.containsKey("usbGapMs")) {
+        usbPace.gapMs = constrain(params["usbGapMs"].as<int>(), 0, 100);
+        prefs.putUShort("usbGap", usbPace.gapMs);
+    }
+    if (params.containsKey("sync")) {
+        typingSync = params["sync"].as<bool>();
+        prefs.putBool("sync", typingSync);
+    }
+    if (params.containsKey("syncChunk")) {
+        syncChunk = constrain(params["syncChunk"].as<int>(), 4, 1000);
+        prefs.putUShort("syncChunk", syncChunk);
+    }
+    if (params.containsKey("bleGapMs")) {
+        blePace.gapMs = constrain(params["bleGapMs"].as<int>(), 0, 100);
+        prefs.putUShort("bleGap", blePace.gapMs);
+    }
+    prefs.end();
+    versions.bump(VERSION_SETTINGS);
+    getTypingJson(out);
 }
 
 uint16_t sendCommand(uint8_t cmd, uint8_t* data, uint16_t dataLen) {
@@ -180,6 +488,29 @@ uint16_t sendCommand(uint8_t cmd, uint8_t* data, uint16_t dataLen) {
     return len + 9;
 }
 
+void sendDataPacket(uint8_t pid, const uint8_t* data, uint16_t dataLen) {
+    uint8_t packet[9 + 256 + 2];
+    uint16_t len = dataLen + 2;
+    uint16_t sum = pid + (len >> 8) + (len & 0xFF);
+
+    packet[0] = (FP_HEADER >> 8) & 0xFF;
+    packet[1] = FP_HEADER & 0xFF;
+    packet[2] = (fpAddress >> 24) & 0xFF;
+    packet[3] = (fpAddress >> 16) & 0xFF;
+    packet[4] = (fpAddress >> 8) & 0xFF;
+    packet[5] = fpAddress & 0xFF;
+    packet[6] = pid;
+    packet[7] = (len >> 8) & 0xFF;
+    packet[8] = len & 0xFF;
+    for (uint16_t i = 0; i < dataLen; i++) {
+        packet[9 + i] = data[i];
+        sum += data[i];
+    }
+    packet[9 + dataLen] = (sum >> 8) & 0xFF;
+    packet[10 + dataLen] = sum & 0xFF;
+    fpSerial.write(packet, 11 + dataLen);
+}
+
 int16_t receiveResponse(uint8_t* buffer, uint16_t timeout) {
     unsigned long start = millis();
     uint16_t idx = 0;
@@ -209,6 +540,8 @@ int16_t receiveResponse(uint8_t* buffer, uint16_t timeout) {
             }
 
             if (idx >= sizeof(rxBuffer) - 1) return -1;
+        } else {
+            delay(1);  // Let the other tasks on this core run; the UART buffers meanwhile
         }
     }
     return headerFound ? idx : -1;
@@ -246,11 +579,37 @@ bool readSysParams() {
     int16_t len = receiveResponse(rxBuffer, 500);
     if (len > 0 && getConfirmCode(rxBuffer, len) == 0x00) {
         librarySize = (rxBuffer[14] << 8) | rxBuffer[15];
+        fpPacketSize = 32 << (rxBuffer[23] & 0x03);
         return true;
     }
     return false;
 }
 
+bool setSysParam(uint8_t param, uint8_t value) {
+    uint8_t data[2] = {param, value};
+    sendCommand(CMD_SETSYSPARA, data, 2);
+    int16_t len = receiveResponse(rxBuffer, 1000);
+    return (len > 0 && getConfirmCode(rxBuffer, len) == 0x00);
+}
+
+// The sensor acknowledges at the old rate, then switches
+bool setSensorBaud(uint32_t baud) {
+    if (baud == fpBaud) return true;
+    uint32_t oldBaud = fpBaud;
+    if (!setSysParam(FP_SYSPARA_BAUD, baud / 9600)) return false;
+
+    fpSerial.flush();
+    fpSerial.updateBaudRate(baud);
+    fpBaud = baud;
+    delay(20);
+    if (checkSensorConnection()) return true;
+
+    fpSerial.updateBaudRate(oldBaud);
+    fpBaud = oldBaud;
+    checkSensorConnection();
+    return false;
+}
+
 bool setLED(uint8_t mode, uint8_t speed, uint8_t color, uint8_t count) {
     uint8_t data[4] = {mode, speed, color, count};
     sendCommand(CMD_AURALEDCONFIG, data, 4);
@@ -284,6 +643,58 @@ uint8_t storeTemplate(uint8_t bufferId, uint16_t id) {
     return (len > 0) ? getConfirmCode(rxBuffer, len) : 0xFF;
 }
 
+uint8_t loadTemplate(uint8_t bufferId, uint16_t id) {
+    uint8_t data[3] = {bufferId, (uint8_t)(id >> 8), (uint8_t)(id & 0xFF)};
+    sendCommand(CMD_LOADCHAR, data, 3);
+    int16_t len = receiveResponse(rxBuffer, 1000);
+    return (len > 0) ? getConfirmCode(rxBuffer, len) : 0xFF;
+}
+
+uint8_t uploadTemplate(uint8_t bufferId) {
+    uint8_t data[1] = {bufferId};
+    sendCommand(CMD_UPCHAR, data, 1);
+    int16_t len = receiveResponse(rxBuffer, 1000);
+    return (len > 0) ? getConfirmCode(rxBuffer, len) : 0xFF;
+}
+
+bool downloadTemplate(uint8_t bufferId, const uint8_t* data, size_t dataLen) {
+    uint8_t cmd[1] = {bufferId};
+    sendCommand(CMD_DOWNCHAR, cmd, 1);
+    int16_t len = receiveResponse(rxBuffer, 1000);
+    if (len <= 0 || getConfirmCode(rxBuffer, len) != 0x00) return false;
+
+    for (size_t off = 0; off < dataLen; off += fpPacketSize) {
+        size_t n = min(dataLen - off, (size_t)fpPacketSize);
+        sendDataPacket(off + n >= dataLen ? FP_END_PACKET : FP_DATA_PACKET, data + off, n);
+    }
+    return true;
+}
+
+// Validates one data/end packet in rxBuffer; returns the payload length or -1
+int16_t checkDataPacket(int16_t len) {
+    if (len < 11) return -1;
+    uint16_t pktLen = (rxBuffer[7] << 8) | rxBuffer[8];
+    if (pktLen < 2 || len < 9 + pktLen) return -1;
+
+    uint16_t payloadLen = pktLen - 2;
+    uint16_t sum = rxBuffer[6] + (pktLen >> 8) + (pktLen & 0xFF);
+    for (uint16_t i = 0; i < payloadLen; i++) sum += rxBuffer[9 + i];
+    if (sum != ((rxBuffer[9 + payloadLen] << 8) | rxBuffer[10 + payloadLen])) return -1;
+    return payloadLen;
+}
+
+bool readIndexTable(uint8_t page, uint8_t* bitmap) {
+    uint8_t data[1] = {page};
+    sendCommand(CMD_READINDEXTABLE, data, 1);
+    int16_t len = receiveResponse(rxBuffer, 1000);
+    if (len > 0 && getConfirmCode(rxBuffer, len) == 0x00) {
+        memcpy(bitmap, rxBuffer + 10, 32);
+        if (page == 0) memcpy(libraryIndex, bitmap, sizeof(libraryIndex));
+        return true;
+    }
+    return false;
+}
+
 uint8_t searchFingerprint(uint8_t bufferId, uint16_t startId, uint16_t count, uint16_t* matchId, uint16_t* score) {
     uint8_t data[5] = {bufferId, (uint8_t)(startId >> 8), (uint8_t)(startId & 0xFF),
                        (uint8_t)(count >> 8), (uint8_t)(count & 0xFF)};
@@ -314,17 +725,21 @@ uint8_t emptyLibrary() {
     return (len > 0) ? getConfirmCode(rxBuffer, len) : 0xFF;
 }
 
+// Skips empty slots that already carry metadata (pre-seeded, awaiting enrollment)
 int16_t findEmptySlot() {
     for (int page = 0; page < 1; page++) {
         uint8_t data[1] = {(uint8_t)page};
         sendCommand(CMD_READINDEXTABLE, data, 1);
         int16_t len = receiveResponse(rxBuffer, 1000);
         if (len > 0 && getConfirmCode(rxBuffer, len) == 0x00) {
+            uint8_t bitmap[32];
+            memcpy(bitmap, rxBuffer + 10, sizeof(bitmap));
             for (int i = 0; i < 32; i++) {
-                uint8_t byte = rxBuffer[10 + i];
+                uint8_t byte = bitmap[i];
                 for (int bit = 0; bit < 8; bit++) {
-                    if (!(byte & (1 << bit))) {
-                        return page * 256 + i * 8 + bit;
+                    int id = page * 256 + i * 8 + bit;
+                    if (!(byte & (1 << bit)) && !slotHasMetadata(id)) {
+                        return id;
                     }
                 }
             }
@@ -333,6 +748,12 @@ int16_t findEmptySlot() {
     return -1;
 }
 
+bool isSlotOccupied(uint16_t slot) {
+    uint8_t bitmap[32];
+    if (!readIndexTable(slot / 256, bitmap)) return false;
+    return bitmap[(slot % 256) / 8] & (1 << (slot % 8));
+}
+
 int16_t findSlotForFinger(int fingerId) {
     if (fingerId < 0 || fingerId > 9) return -1;
     prefs.begin("fingers", true);
@@ -349,6 +770,13 @@ int16_t findSlotForFinger(int fingerId) {
     return -1;
 }
 
+bool slotHasMetadata(uint16_t slot) {
+    prefs.begin("fingers", true);
+    bool has = prefs.isKey(("f" + String(slot)).c_str()) || prefs.isKey(("i" + String(slot)).c_str());
+    prefs.end();
+    return has;
+}
+
 void saveFingerName(uint16_t id, String name) {
     prefs.begin("fingers", false);
     prefs.putString(("f" + String(id)).c_str(), name);
@@ -358,6 +786,18 @@ void saveFingerName(uint16_t id, String name) {
     prefs.end();
 }
 
+// For a slot that has just been given a template from elsewhere (import,
+// seed image): whatever the previous occupant stored is dropped first, so the
+// new finger never types someone else's credential.
+void saveFingerMeta(uint16_t id, const char* name, int fingerId, bool pressEnter) {
+    deleteFingerName(id);
+    prefs.begin("fingers", false);
+    if (name[0]) prefs.putString(("f" + String(id)).c_str(), name);
+    if (fingerId >= 0 && fingerId <= 9) prefs.putInt(("i" + String(id)).c_str(), fingerId);
+    prefs.putBool(("e" + String(id)).c_str(), pressEnter);
+    prefs.end();
+}
+
 String getFingerName(uint16_t id) {
     prefs.begin("fingers", true);
     String name = prefs.getString(("f" + String(id)).c_str(), "");
@@ -369,6 +809,11 @@ void deleteFingerName(uint16_t id) {
     prefs.begin("fingers", false);
     prefs.remove(("f" + String(id)).c_str());
     prefs.remove(("p" + String(id)).c_str());
+    prefs.remove(("c" + String(id)).c_str());
+    prefs.remove(("t" + String(id)).c_str());
+    prefs.remove(("o" + String(id)).c_str());
+    prefs.remove(("r" + String(id)).c_str());
+    prefs.remove(("u" + String(id)).c_str());
     prefs.remove(("e" + String(id)).c_str());
     prefs.remove(("i" + String(id)).c_str());
     prefs.end();
@@ -380,129 +825,537 @@ void clearAllFingerNames() {
     prefs.end();
 }
 
-void saveFingerPassword(uint16_t id, String password) {
+// ===== Credential Encryption =====
+// Passwords are stored as AES-GCM blobs under "c<slot>". Legacy plaintext
+// entries ("p<slot>") are re-encrypted on first read and by the boot sweep.
+
+#if TOUCHPASS_EFUSE_KEY
+// Sets up the key that seals the device key: HMAC of a fixed label under the
+// eFuse key, which the HMAC peripheral uses without software ever reading it.
+// An unused key block is burned with a random key the first time.
+bool beginEfuseKey(CredentialCrypto& wrap) {
+    esp_efuse_block_t block = (esp_efuse_block_t)(EFUSE_BLK_KEY0 + TOUCHPASS_EFUSE_KEY_SLOT);
+    if (esp_efuse_get_key_purpose(block) != ESP_EFUSE_KEY_PURPOSE_HMAC_UP) {
+        if (!esp_efuse_key_block_unused(block)) return false;  // Taken for something else
+        uint8_t fuse[CRED_KEY_LEN];
+        esp_fill_random(fuse, sizeof(fuse));
+        esp_err_t err = esp_efuse_write_key(block, ESP_EFUSE_KEY_PURPOSE_HMAC_UP, fuse, sizeof(fuse));
+        mbedtls_platform_zeroize(fuse, sizeof(fuse));
+        if (err != ESP_OK) return false;
+    }
+
+    static const char label[] = "touchpass-device-key";
+    uint8_t key[CRED_KEY_LEN];
+    bool ok = esp_hmac_calculate((hmac_key_id_t)(HMAC_KEY0 + TOUCHPASS_EFUSE_KEY_SLOT),
+                                 label, sizeof(label) - 1, key) == ESP_OK &&
+              wrap.begin(key);
+    mbedtls_platform_zeroize(key, sizeof(key));
+    return ok;
+}
+#endif
+
+// The device key is random. With the eFuse key it is stored sealed ("dkw"),
+// and a plain "dk" from older firmware is sealed and removed on the first
+// boot; without it "dk" stays plain and is only as safe as NVS.
+bool loadDeviceKey() {
+    uint8_t secret[CRED_KEY_LEN];
+    prefs.begin("crypto", false);
+    bool have = prefs.getBytes("dk", secret, sizeof(secret)) == sizeof(secret);
+    bool ok = true;
+#if TOUCHPASS_EFUSE_KEY
+    CredentialCrypto wrap;
+    uint8_t blob[CRED_KEY_LEN + CRED_OVERHEAD];
+    deviceKeyInEfuse = beginEfuseKey(wrap);
+    if (!have && prefs.isKey("dkw")) {
+        // Only this chip's eFuse key opens it; without that the key is lost
+        SecureArray<CRED_KEY_LEN> opened;
+        size_t blobLen = prefs.getBytes("dkw", blob, sizeof(blob));
+        ok = deviceKeyInEfuse && wrap.open(0, blob, blobLen, opened, CRED_KIND_DEVICE_KEY) &&
+             opened.length() == CRED_KEY_LEN;
+        if (ok) memcpy(secret, opened.bytes(), CRED_KEY_LEN);
+        have = ok;
+    } else if (deviceKeyInEfuse) {
+        if (!have) esp_fill_random(secret, sizeof(secret));
+        uint8_t nonce[CRED_NONCE_LEN];
+        esp_fill_random(nonce, sizeof(nonce));
+        size_t blobLen = wrap.seal(0, (const char*)secret, sizeof(secret), nonce, blob, sizeof(blob), CRED_KIND_DEVICE_KEY);
+        if (blobLen > 0 && prefs.putBytes("dkw", blob, blobLen) == blobLen) {
+            prefs.remove("dk");
+            have = true;
+        } else {
+            deviceKeyInEfuse = false;
+        }
+    }
+#endif
+    if (ok && !have) {
+        esp_fill_random(secret, sizeof(secret));
+        prefs.putBytes("dk", secret, sizeof(secret));
+    }
+    prefs.end();
+    ok = ok && credCrypto.begin(secret);
+    mbedtls_platform_zeroize(secret, sizeof(secret));
+    return ok;
+}
+
+#if TOUCHPASS_CONFIG_WIFI
+// The config access point's password, generated on first use
+String loadWifiPassword() {
+    static const char alphabet[] = "abcdefghijkmnpqrstuvwxyz23456789";
+    prefs.begin("wifi", false);
+    String psk = prefs.getString("psk", "");
+    if (psk.length() < 8) {
+        char buf[WIFI_CONFIG_PSK_LEN + 1];
+        for (int i = 0; i < WIFI_CONFIG_PSK_LEN; i++) buf[i] = alphabet[esp_random() % (sizeof(alphabet) - 1)];
+        buf[WIFI_CONFIG_PSK_LEN] = '\0';
+        psk = buf;
+        prefs.putString("psk", psk);
+    }
+    prefs.end();
+    return psk;
+}
+#endif
+
+// Writes the blob for an already-open "fingers" namespace
+bool putPasswordBlob(uint16_t id, const char* password, size_t len) {
+    uint8_t nonce[CRED_NONCE_LEN];
+    uint8_t blob[CRED_MAX_BLOB];
+    esp_fill_random(nonce, sizeof(nonce));
+    size_t blobLen = credCrypto.seal(id, password, len, nonce, blob, sizeof(blob));
+    if (blobLen == 0) return false;
+    bool ok = prefs.putBytes(("c" + String(id)).c_str(), blob, blobLen) == blobLen;
+    if (ok) prefs.remove(("p" + String(id)).c_str());
+    prefs.remove(("r" + String(id)).c_str());
+    return ok;
+}
+
+// False if the password could not be sealed or written
+bool saveFingerPassword(uint16_t id, String password) {
+    bool ok = true;
     prefs.begin("fingers", false);
-    prefs.putString(("p" + String(id)).c_str(), password);
+    if (password.length() == 0) {
+        prefs.remove(("c" + String(id)).c_str());
+        prefs.remove(("p" + String(id)).c_str());
+        prefs.remove(("r" + String(id)).c_str());
+    } else {
+        ok = putPasswordBlob(id, password.c_str(), password.length());
+    }
     prefs.end();
+    return ok;
 }
 
-String getFingerPassword(uint16_t id) {
+bool readFingerPassword(uint16_t id, SecureBuffer& out) {
+    out.wipe();
+    String cKey = "c" + String(id);
+    String pKey = "p" + String(id);
+
     prefs.begin("fingers", true);
-    String pwd = prefs.getString(("p" + String(id)).c_str(), "");
+    if (prefs.isKey(cKey.c_str())) {
+        uint8_t blob[CRED_MAX_BLOB];
+        size_t blobLen = prefs.getBytes(cKey.c_str(), blob, sizeof(blob));
+        prefs.end();
+        unsigned long start = micros();
+        bool ok = credCrypto.open(id, blob, blobLen, out);
+        lastDecryptUs = micros() - start;
+        return ok;
+    }
+    bool legacy = prefs.isKey(pKey.c_str());
+    if (legacy) {
+        size_t n = prefs.getString(pKey.c_str(), out.data(), out.capacity() + 1);
+        out.setLength(n > 0 ? n - 1 : 0);
+    }
     prefs.end();
-    return pwd;
+
+    // Migrate legacy plaintext entry in place
+    if (legacy && out.length() > 0) {
+        prefs.begin("fingers", false);
+        putPasswordBlob(id, out.c_str(), out.length());
+        prefs.end();
+    }
+    return legacy;
 }
 
-void saveFingerPressEnter(uint16_t id, bool pressEnter) {
+bool hasFingerPassword(uint16_t id) {
+    prefs.begin("fingers", true);
+    bool has = prefs.isKey(("c" + String(id)).c_str()) || prefs.isKey(("p" + String(id)).c_str());
+    prefs.end();
+    return has;
+}
+
+// ===== TOTP Credentials =====
+// The decoded secret is sealed under "t<slot>" (kind CRED_KIND_TOTP) and the
+// algorithm/digits/period/mode under "o<slot>".
+
+bool saveFingerTotp(uint16_t id, const char* base32Secret, const TotpConfig& cfg) {
+    uint8_t secret[TOTP_MAX_SECRET];
+    int secretLen = base32Decode(base32Secret, secret, sizeof(secret));
+    if (secretLen <= 0 || !totpConfigValid(cfg)) return false;
+
+    uint8_t nonce[CRED_NONCE_LEN];
+    uint8_t blob[CRED_MAX_BLOB];
+    esp_fill_random(nonce, sizeof(nonce));
+    size_t blobLen = credCrypto.seal(id, (const char*)secret, secretLen, nonce, blob, sizeof(blob), CRED_KIND_TOTP);
+    mbedtls_platform_zeroize(secret, sizeof(secret));
+    if (blobLen == 0) return false;
+
     prefs.begin("fingers", false);
-    prefs.putBool(("e" + String(id)).c_str(), pressEnter);
+    bool ok = prefs.putBytes(("t" + String(id)).c_str(), blob, blobLen) == blobLen &&
+              prefs.putBytes(("o" + String(id)).c_str(), &cfg, sizeof(cfg)) == sizeof(cfg);
+    prefs.remove(("r" + String(id)).c_str());
     prefs.end();
+    return ok;
 }
 
-bool getFingerPressEnter(uint16_t id) {
+void removeFingerTotp(uint16_t id) {
+    prefs.begin("fingers", false);
+    prefs.remove(("t" + String(id)).c_str());
+    prefs.remove(("o" + String(id)).c_str());
+    prefs.remove(("r" + String(id)).c_str());
+    prefs.end();
+}
+
+bool hasFingerTotp(uint16_t id) {
     prefs.begin("fingers", true);
-    bool pe = prefs.getBool(("e" + String(id)).c_str(), false);
+    bool has = prefs.isKey(("t" + String(id)).c_str());
     prefs.end();
-    return pe;
+    return has;
 }
 
-int getFingerIdForSlot(uint16_t slot) {
+bool readTotpConfig(uint16_t id, TotpConfig& cfg) {
     prefs.begin("fingers", true);
-    int fingerId = prefs.getInt(("i" + String(slot)).c_str(), -1);
+    bool ok = prefs.isKey(("t" + String(id)).c_str()) &&
+              prefs.getBytes(("o" + String(id)).c_str(), &cfg, sizeof(cfg)) == sizeof(cfg);
     prefs.end();
-    return fingerId;
+    return ok && totpConfigValid(cfg);
 }
 
-void processFingerDetection() {
-    if (enrollState != ENROLL_IDLE) return;
+bool readFingerTotp(uint16_t id, SecureBuffer& secret, TotpConfig& cfg) {
+    String tKey = "t" + String(id);
+    prefs.begin("fingers", true);
+    if (!prefs.isKey(tKey.c_str())) {
+        prefs.end();
+        return false;
+    }
+    uint8_t blob[CRED_MAX_BLOB];
+    size_t blobLen = prefs.getBytes(tKey.c_str(), blob, sizeof(blob));
+    bool ok = prefs.getBytes(("o" + String(id)).c_str(), &cfg, sizeof(cfg)) == sizeof(cfg);
+    prefs.end();
+    return ok && totpConfigValid(cfg) && credCrypto.open(id, blob, blobLen, secret, CRED_KIND_TOTP);
+}
 
-    static unsigned long lastAttempt = 0;
-    if (millis() - lastAttempt < 500) return;
-    lastAttempt = millis();
+// Computed before typing starts, so nothing half-valid gets typed when the
+// time is unknown or the secret cannot be read.
+bool currentTotpCode(uint16_t id, SecureArray<8>& code) {
+    TotpConfig cfg;
+    SecureBuffer secret;
+    if (!readFingerTotp(id, secret, cfg)) return false;
+    if (!timeValid()) {
+        lastStatus = "Time not set";
+        return false;
+    }
 
-    uint8_t result = captureImage();
-    if (result != 0x00) return;
+    uint32_t value = totpCode((const uint8_t*)secret.c_str(), secret.length(), correctedUnixTime(), cfg);
+    if (value == 0xFFFFFFFF) return false;
+    code.setLength(formatTotp(value, cfg.digits, code.data()));
+    return true;
+}
 
-    result = generateChar(1);
-    if (result != 0x00) {
-        lastDetectResult = result;
-        newDetectionAvailable = true;
-        lastStatus = "Unknown finger";
-        setLED(LED_ON, 0, LED_RED, 0);
-        delay(2000);
-        setLED(LED_OFF, 0, LED_RED, 0);
-        while (captureImage() == 0x00) delay(200);
-        return;
-    }
+// Parses {"secret":"BASE32","algo":"sha1|sha256","digits":6,"period":30,"append":true}
+bool parseTotpParams(JsonObject totp, TotpConfig& cfg) {
+    memset(&cfg, 0, sizeof(cfg));
+    String algo = totp["algo"] | "sha1";
+    cfg.algo = algo == "sha256" ? TOTP_SHA256 : TOTP_SHA1;
+    cfg.digits = totp["digits"] | 6;
+    cfg.period = totp["period"] | 30;
+    cfg.mode = (totp["append"] | true) ? TOTP_APPEND : TOTP_CODE_ONLY;
+    return (algo == "sha1" || algo == "sha256") && totpConfigValid(cfg);
+}
 
-    uint16_t matchId = 0, score = 0;
-    result = searchFingerprint(1, 0, librarySize, &matchId, &score);
+// ===== Rendered Credentials =====
+// The slot's whole key sequence (username, Tab, password, code placeholder,
+// Enter) is rendered to HID reports when it changes and sealed under
+// "r<slot>" (kind CRED_KIND_STREAM). Anything that changes the sequence
+// removes the stream; a missing or stale one is rendered on the next touch.
 
-    if (result == 0x00) {
-        lastDetectedFinger = getFingerName(matchId);
-        lastDetectedId = matchId;
-        lastDetectedScore = score;
-        lastDetectResult = 0x00;
-        newDetectionAvailable = true;
-        lastStatus = lastDetectedFinger + " detected";
-        setLED(LED_ON, 0, LED_GREEN, 0);
+String getFingerUsername(uint16_t id) {
+    prefs.begin("fingers", true);
+    String username = prefs.getString(("u" + String(id)).c_str(), "");
+    prefs.end();
+    return username;
+}
 
-        typePassword(matchId);
+void saveFingerUsername(uint16_t id, String username) {
+    prefs.begin("fingers", false);
+    if (username.length() > 0) prefs.putString(("u" + String(id)).c_str(), username);
+    else prefs.remove(("u" + String(id)).c_str());
+    prefs.remove(("r" + String(id)).c_str());
+    prefs.end();
+}
 
-        delay(1000);
-        setLED(LED_OFF, 0, LED_GREEN, 0);
-        while (captureImage() == 0x00) delay(200);
+// Returns the stream length, 0 if the slot has nothing to type or it does not fit
+size_t renderFingerStream(uint16_t id, SecureArray<HID_STREAM_MAX>& out) {
+    SecureBuffer pwd;
+    readFingerPassword(id, pwd);
+    String username = getFingerUsername(id);
+    TotpConfig cfg;
+    bool totp = readTotpConfig(id, cfg);
+    out.wipe();
+    if (pwd.length() == 0 && username.length() == 0 && !totp) return 0;
+
+    CredentialSpec spec = {username.c_str(), username.length(), pwd.c_str(), pwd.length(),
+                           totp, totp && cfg.mode == TOTP_CODE_ONLY, getFingerPressEnter(id)};
+    out.setLength(renderCredential(spec, keyboardLayout, activePace(), (uint8_t*)out.data(), out.capacity()));
+    return out.length();
+}
 
-    } else {
-        lastDetectedFinger = "";
-        lastDetectedId = -1;
-        lastDetectedScore = 0;
-        lastDetectResult = result;
-        newDetectionAvailable = true;
-        lastStatus = "Unknown finger";
-        setLED(LED_ON, 0, LED_RED, 0);
-        delay(2000);
-        setLED(LED_OFF, 0, LED_RED, 0);
-        while (captureImage() == 0x00) delay(200);
-    }
+bool sealFingerStream(uint16_t id, const SecureArray<HID_STREAM_MAX>& stream) {
+    uint8_t nonce[CRED_NONCE_LEN];
+    uint8_t blob[HID_STREAM_MAX + CRED_OVERHEAD];
+    esp_fill_random(nonce, sizeof(nonce));
+    size_t blobLen = credCrypto.seal(id, stream.c_str(), stream.length(), nonce, blob, sizeof(blob), CRED_KIND_STREAM);
+    if (blobLen == 0) return false;
+    prefs.begin("fingers", false);
+    bool ok = prefs.putBytes(("r" + String(id)).c_str(), blob, blobLen) == blobLen;
+    prefs.end();
+    return ok;
 }
 
-bool enrollCaptureToBuffer(uint8_t bufferNum) {
-    uint8_t result = captureImage();
-    if (result != 0x00) return false;
+// Returns false if the slot has nothing to type or its sequence is too long
+bool storeFingerStream(uint16_t id) {
+    SecureArray<HID_STREAM_MAX> stream;
+    return renderFingerStream(id, stream) > 0 && sealFingerStream(id, stream);
+}
 
-    result = generateChar(bufferNum);
-    if (result != 0x00) {
-        enrollError = "Feature extraction failed";
-        enrollState = ENROLL_DONE;
-        enrollSuccess = false;
-        setLED(LED_ON, 0, LED_RED, 0);
-        return false;
+bool loadFingerStream(uint16_t id, SecureArray<HID_STREAM_MAX>& out) {
+    String rKey = "r" + String(id);
+    uint8_t blob[HID_STREAM_MAX + CRED_OVERHEAD];
+    prefs.begin("fingers", true);
+    size_t blobLen = prefs.isKey(rKey.c_str()) ? prefs.getBytes(rKey.c_str(), blob, sizeof(blob)) : 0;
+    prefs.end();
+
+    unsigned long start = micros();
+    bool ok = blobLen > 0 && credCrypto.open(id, blob, blobLen, out, CRED_KIND_STREAM);
+    lastDecryptUs = micros() - start;
+    if (ok && hidStreamCurrent(out.bytes(), out.length(), keyboardLayout, hidMaxHeld(activePace()))) {
+        return true;
     }
+
+    if (renderFingerStream(id, out) == 0) return false;
+    sealFingerStream(id, out);
     return true;
 }
 
-bool isFingerLifted() {
-    return captureImage() == 0x02;
+// ===== Time Source =====
+// The host sets wall-clock time over serial; the RTC keeps it across software
+// resets. Each sync more than an hour after the previous one refines a drift
+// estimate (persisted with the last sync time) that is applied between syncs.
+
+bool timeValid() {
+    return time(NULL) > 1600000000;
 }
 
-void processEnrollment() {
-    if (enrollState == ENROLL_IDLE) return;
+uint64_t correctedUnixTime() {
+    time_t now = time(NULL);
+    if (lastTimeSync == 0 || now < (time_t)lastTimeSync) return now;
+    double elapsed = now - lastTimeSync;
+    return now - (int64_t)(elapsed * clockDriftPpm / 1e6);
+}
 
-    if (millis() > enrollTimeout) {
-        enrollState = ENROLL_DONE;
-        enrollSuccess = false;
-        enrollError = "Timeout";
-        setLED(LED_ON, 0, LED_RED, 0);
+void loadTimeSettings() {
+    prefs.begin("time", true);
+    lastTimeSync = prefs.getUInt("sync", 0);
+    clockDriftPpm = prefs.getFloat("ppm", 0);
+    prefs.end();
+}
+
+void setTimeJson(JsonObject params, JsonWriter& out) {
+    uint32_t epoch = params["epoch"].as<uint32_t>();
+    if (epoch < 1600000000) {
+        out.raw("{\"ok\":false,\"status\":\"Invalid epoch\"}");
         return;
     }
 
-    uint8_t result;
+    float measuredPpm = 0;
+    if (timeValid() && lastTimeSync > 0 && epoch > lastTimeSync + 3600) {
+        // Positive error = device clock runs fast
+        double error = (double)correctedUnixTime() - (double)epoch;
+        measuredPpm = error / (epoch - lastTimeSync) * 1e6;
+        clockDriftPpm = constrain(clockDriftPpm + measuredPpm, -500.0f, 500.0f);
+    }
 
-    switch (enrollState) {
-        case ENROLL_CAPTURE_1:
-            if (enrollCaptureToBuffer(1)) {
-                enrollState = ENROLL_LIFT_1;
+    struct timeval tv = {(time_t)epoch, 0};
+    settimeofday(&tv, NULL);
+    lastTimeSync = epoch;
+
+    prefs.begin("time", false);
+    prefs.putUInt("sync", lastTimeSync);
+    prefs.putFloat("ppm", clockDriftPpm);
+    prefs.end();
+    versions.bump(VERSION_SETTINGS);
+
+    out.beginObject();
+    out.field("ok", true);
+    out.field("epoch", epoch);
+    out.field("driftPpm", clockDriftPpm);
+    out.field("measuredPpm", measuredPpm);
+    out.endObject();
+}
+
+void totpSelfTestJson(JsonWriter& out) {
+    unsigned long start = micros();
+    int codes = 0;
+    int failures = totpSelfTest(&codes);
+    unsigned long elapsed = micros() - start;
+    out.beginObject();
+    out.field("ok", failures == 0);
+    out.field("vectors", codes);
+    out.field("failures", failures);
+    out.field("usPerCode", (float)elapsed / codes, 1);
+    out.endObject();
+}
+
+void migrateLegacyPasswords() {
+    prefs.begin("crypto", true);
+    uint8_t version = prefs.getUChar("ver", 0);
+    prefs.end();
+    if (version >= CRED_BLOB_VERSION) return;
+
+    for (uint16_t slot = 0; slot < librarySize; slot++) {
+        prefs.begin("fingers", true);
+        bool legacy = prefs.isKey(("p" + String(slot)).c_str());
+        prefs.end();
+        if (legacy) {
+            SecureBuffer pwd;
+            readFingerPassword(slot, pwd);
+        }
+    }
+
+    prefs.begin("crypto", false);
+    prefs.putUChar("ver", CRED_BLOB_VERSION);
+    prefs.end();
+}
+
+void saveFingerPressEnter(uint16_t id, bool pressEnter) {
+    prefs.begin("fingers", false);
+    prefs.putBool(("e" + String(id)).c_str(), pressEnter);
+    prefs.end();
+}
+
+bool getFingerPressEnter(uint16_t id) {
+    prefs.begin("fingers", true);
+    bool pe = prefs.getBool(("e" + String(id)).c_str(), false);
+    prefs.end();
+    return pe;
+}
+
+int getFingerIdForSlot(uint16_t slot) {
+    prefs.begin("fingers", true);
+    int fingerId = prefs.getInt(("i" + String(slot)).c_str(), -1);
+    prefs.end();
+    return fingerId;
+}
+
+// Sensor task. The sensor is held only for each round trip, so sensor
+// commands get in between, and the results are published under the state
+// lock. A match is handed to the typing task, which types while the LED
+// shows the result.
+void processFingerDetection() {
+    if (enrollState != ENROLL_IDLE) return;
+
+    static unsigned long lastAttempt = 0;
+    if (millis() - lastAttempt < 500) return;
+    lastAttempt = millis();
+
+    uint8_t result;
+    bool searched = false;
+    uint16_t matchId = 0, score = 0;
+    {
+        TaskLock sensor(sensorLock);
+        result = captureImage();
+        if (result != 0x00) return;
+#if TOUCHPASS_HAS_BLE
+        withLock(stateLock, [] {
+            if (transports.isUp(KB_MODE_BLE)) bleLink.requestFast();
+        });
+#endif
+
+        result = generateChar(1);
+        if (result == 0x00) {
+            result = searchFingerprint(1, 0, librarySize, &matchId, &score);
+            searched = true;
+        }
+    }
+
+    bool matched = result == 0x00;
+    {
+        TaskLock state(stateLock);
+        if (matched) {
+            lastDetectedFinger = getFingerName(matchId);
+            lastDetectedId = matchId;
+            lastDetectedScore = score;
+            lastStatus = lastDetectedFinger + " detected";
+        } else {
+            if (searched) {
+                lastDetectedFinger = "";
+                lastDetectedId = -1;
+                lastDetectedScore = 0;
+            }
+            lastStatus = "Unknown finger";
+        }
+        lastDetectResult = result;
+        newDetectionAvailable = true;
+        events.push(EVENT_DETECT, millis(), matched ? matchId : -1, matched ? score : 0, result);
+    }
+    if (matched) xQueueSend(typingQueue, &matchId, 0);
+
+    uint8_t color = matched ? LED_GREEN : LED_RED;
+    withLock(sensorLock, [&] { setLED(LED_ON, 0, color, 0); });
+    delay(matched ? 1000 : 2000);
+    withLock(sensorLock, [&] { setLED(LED_OFF, 0, color, 0); });
+
+    // Wait for the finger to lift
+    while (withLock(sensorLock, [] { return captureImage(); }) == 0x00) delay(200);
+}
+
+bool enrollCaptureToBuffer(uint8_t bufferNum) {
+    uint8_t result = captureImage();
+    if (result != 0x00) return false;
+
+    result = generateChar(bufferNum);
+    if (result != 0x00) {
+        enrollError = "Feature extraction failed";
+        enrollState = ENROLL_DONE;
+        enrollSuccess = false;
+        setLED(LED_ON, 0, LED_RED, 0);
+        return false;
+    }
+    return true;
+}
+
+bool isFingerLifted() {
+    return captureImage() == 0x02;
+}
+
+// Sensor task. Holds the sensor for the whole step: enrollment state only
+// changes under the sensor lock, here and in the enroll commands.
+void processEnrollment() {
+    if (enrollState == ENROLL_IDLE) return;
+    TaskLock sensor(sensorLock);
+    if (enrollState == ENROLL_IDLE) return;  // Cancelled meanwhile
+
+    if (millis() > enrollTimeout) {
+        enrollState = ENROLL_DONE;
+        enrollSuccess = false;
+        enrollError = "Timeout";
+        setLED(LED_ON, 0, LED_RED, 0);
+        return;
+    }
+
+    uint8_t result;
+
+    switch (enrollState) {
+        case ENROLL_CAPTURE_1:
+            if (enrollCaptureToBuffer(1)) {
+                enrollState = ENROLL_LIFT_1;
                 setLED(LED_FLASHING, 100, LED_GREEN, 2);
             }
             break;
@@ -596,20 +1449,39 @@ void processEnrollment() {
                 return;
             }
 
-            saveFingerName(pendingSlot, pendingFingerName);
-            if (pendingFingerPassword.length() > 0) {
-                saveFingerPassword(pendingSlot, pendingFingerPassword);
-                saveFingerPressEnter(pendingSlot, pendingPressEnter);
+            {
+                TaskLock state(stateLock);
+                saveFingerName(pendingSlot, pendingFingerName);
+                if (pendingFingerUsername.length() > 0) {
+                    saveFingerUsername(pendingSlot, pendingFingerUsername);
+                }
+                if (pendingFingerPassword.length() > 0 &&
+                    !saveFingerPassword(pendingSlot, pendingFingerPassword)) {
+                    // A finger that types nothing would look enrolled; undo it
+                    deleteFingerName(pendingSlot);
+                    deleteTemplate(pendingSlot, 1);
+                    enrollError = "Could not store password";
+                    enrollState = ENROLL_DONE;
+                    enrollSuccess = false;
+                    pendingFingerPassword = "";
+                    pendingFingerUsername = "";
+                    setLED(LED_ON, 0, LED_RED, 0);
+                    return;
+                }
+                if (pendingFingerPassword.length() > 0) saveFingerPressEnter(pendingSlot, pendingPressEnter);
+                storeFingerStream(pendingSlot);
+                getTemplateCount();
+                libraryChanged(pendingSlot, LIBRARY_ADDED);
+                lastStatus = pendingFingerName + " enrolled";
             }
-            getTemplateCount();
             enrollState = ENROLL_DONE;
             enrollSuccess = true;
             delay(50);
             setLED(LED_ON, 0, LED_GREEN, 0);
             delay(500);
             setLED(LED_OFF, 0, LED_GREEN, 0);
-            lastStatus = pendingFingerName + " enrolled";
             pendingFingerPassword = "";
+            pendingFingerUsername = "";
             break;
 
         default:
@@ -619,75 +1491,168 @@ void processEnrollment() {
 
 // ===== Serial Command Handler Functions =====
 
-String getStatusJson() {
-    getTemplateCount();
-    String json = "{\"sensor\":" + String(sensorOk ? "true" : "false") +
-                  ",\"count\":" + String(templateCount) +
-                  ",\"capacity\":" + String(librarySize) +
-                  ",\"last\":\"" + lastStatus + "\"}";
-    return json;
-}
-
-String getDetectJson() {
-    String json = "{\"detected\":" + String(newDetectionAvailable ? "true" : "false") +
-                  ",\"finger\":\"" + lastDetectedFinger + "\"" +
-                  ",\"id\":" + String(lastDetectedId) +
-                  ",\"score\":" + String(lastDetectedScore) +
-                  ",\"matched\":" + String(lastDetectedId >= 0 ? "true" : "false") +
-                  ",\"lastResult\":\"0x" + String(lastDetectResult, HEX) + "\"}";
+void unchangedJson(uint32_t version, JsonWriter& out) {
+    out.beginObject();
+    out.field("version", version);
+    out.field("unchanged", true);
+    out.endObject();
+}
+
+// if_version covers the count and the versions; sensor and last are not
+// versioned, so they are in every reply
+void getStatusJson(JsonObject params, JsonWriter& out) {
+    out.beginObject();
+    if (params.containsKey("if_version") && params["if_version"].as<uint32_t>() == versions.latest()) {
+        out.field("version", versions.latest());
+        out.field("unchanged", true);
+        out.field("sensor", sensorOk);
+        out.field("last", lastStatus);
+        out.endObject();
+        return;
+    }
+
+    // The count only changes with the library version; a busy sensor leaves
+    // the one read after the last change
+    if (lockSensor(false)) {
+        getTemplateCount();
+        unlockSensor();
+    }
+    out.field("sensor", sensorOk);
+    out.field("count", templateCount);
+    out.field("capacity", librarySize);
+    out.field("last", lastStatus);
+    out.field("version", versions.latest());
+    out.key("versions").beginObject();
+    out.field("library", versions.of(VERSION_LIBRARY));
+    out.field("metadata", versions.of(VERSION_METADATA));
+    out.field("settings", versions.of(VERSION_SETTINGS));
+    out.endObject();
+    out.endObject();
+}
+
+void getDetectJson(JsonWriter& out) {
+    char result[5];
+    snprintf(result, sizeof(result), "0x%x", lastDetectResult);
+    out.beginObject();
+    out.field("detected", newDetectionAvailable);
+    out.field("finger", lastDetectedFinger);
+    out.field("id", lastDetectedId);
+    out.field("score", lastDetectedScore);
+    out.field("matched", lastDetectedId >= 0);
+    out.field("lastResult", result);
+    out.endObject();
     if (newDetectionAvailable) newDetectionAvailable = false;
-    return json;
 }
 
-String getFingersJson() {
-    String json = "{\"fingers\":[";
-    bool first = true;
+void fingerEntryJson(int id, JsonWriter& out) {
+    out.beginObject();
+    out.field("id", id);
+    out.field("name", getFingerName(id));
+    out.field("fingerId", getFingerIdForSlot(id));
+    out.endObject();
+}
 
-    for (int page = 0; page < 1; page++) {
-        uint8_t data[1] = {(uint8_t)page};
-        sendCommand(CMD_READINDEXTABLE, data, 1);
-        int16_t len = receiveResponse(rxBuffer, 1000);
-        if (len > 0 && getConfirmCode(rxBuffer, len) == 0x00) {
-            for (int i = 0; i < 32; i++) {
-                uint8_t byte = rxBuffer[10 + i];
-                for (int bit = 0; bit < 8; bit++) {
-                    if (byte & (1 << bit)) {
-                        int id = page * 256 + i * 8 + bit;
-                        if (id < librarySize) {
-                            if (!first) json += ",";
-                            first = false;
-                            json += "{\"id\":" + String(id) + ",\"name\":\"" + getFingerName(id) + "\",\"fingerId\":" + String(getFingerIdForSlot(id)) + "}";
-                        }
-                    }
-                }
-            }
-        }
+// Full list; returns false if the sensor could not be read
+bool fingerListJson(uint32_t version, JsonWriter& out) {
+    uint8_t bitmap[32];
+    bool ok = readIndexTable(0, bitmap);
+
+    out.beginObject();
+    out.field("version", version);
+    out.key("fingers").beginArray();
+    for (int id = 0; ok && id < VERSION_SLOTS && id < librarySize; id++) {
+        if (bitmap[id / 8] & (1 << (id % 8))) fingerEntryJson(id, out);
     }
+    out.endArray();
+    out.endObject();
+    return ok;
+}
 
-    json += "]}";
-    return json;
+// Only the slots changed after since: current entries, and removed ids
+void fingerDeltaJson(uint32_t since, uint32_t version, JsonWriter& out) {
+    uint8_t bitmap[32];
+    if (!readIndexTable(0, bitmap)) memset(bitmap, 0, sizeof(bitmap));
+
+    out.beginObject();
+    out.field("version", version);
+    out.field("since", since);
+    out.key("fingers").beginArray();
+    for (int id = 0; id < VERSION_SLOTS && id < librarySize; id++) {
+        if (versions.changedSince(id, since) && (bitmap[id / 8] & (1 << (id % 8)))) fingerEntryJson(id, out);
+    }
+    out.endArray();
+    out.key("removed").beginArray();
+    for (int id = 0; id < VERSION_SLOTS && id < librarySize; id++) {
+        if (versions.changedSince(id, since) && !(bitmap[id / 8] & (1 << (id % 8)))) out.value(id);
+    }
+    out.endArray();
+    out.endObject();
 }
 
-String enrollStartJson(JsonObject params) {
-    if (!params.containsKey("name")) {
-        return "{\"ok\":false,\"status\":\"Missing name\"}";
+// if_version: "unchanged" or the full list. since: "unchanged", the changed
+// slots, or the full list if that version is too old or from another boot.
+// The full list is served from fingerCache while its version is current.
+void getFingersJson(JsonObject params, JsonWriter& out) {
+    uint32_t version = versions.fingers();
+    bool delta = params.containsKey("since");
+    uint32_t known = 0;
+    if (delta || params.containsKey("if_version")) {
+        known = params[delta ? "since" : "if_version"].as<uint32_t>();
+        if (known == version) {
+            unchangedJson(version, out);
+            return;
+        }
+    }
+    if (!(delta && versions.canDelta(known)) && fingerCache.matches(version, out.encoding())) {
+        Print& port = out.beginExternal();
+        out.endExternal(fingerCache.replay(port));
+        return;
     }
 
+    // Only a list that is not cached reads the sensor
+    if (!lockSensorForCommand()) {
+        out.raw("{\"ok\":false,\"status\":\"Sensor busy\"}");
+        return;
+    }
+    version = versions.fingers();
+    if (delta && versions.canDelta(known)) {
+        fingerDeltaJson(known, version, out);
+    } else {
+        Print& port = out.beginExternal();
+        JsonWriter list(fingerCache.record(port, version, out.encoding()), out.encoding(), nullptr, 0);
+        bool ok = fingerListJson(version, list);
+        list.flush();
+        fingerCache.finish(ok);
+        out.endExternal(list.bytesWritten());
+    }
+    unlockSensor();
+}
+
+void enrollStartJson(JsonObject params, JsonWriter& out) {
     pendingFingerName = params["name"].as<String>();
     pendingFingerPassword = params.containsKey("password") ? params["password"].as<String>() : "";
+    pendingFingerUsername = params.containsKey("username") ? params["username"].as<String>() : "";
     pendingPressEnter = params.containsKey("pressEnter") && params["pressEnter"].as<bool>();
     pendingFingerId = params.containsKey("finger") ? params["finger"].as<int>() : -1;
 
     int16_t existingSlot = findSlotForFinger(pendingFingerId);
+    pendingSlot = -1;
     if (existingSlot >= 0) {
-        deleteTemplate(existingSlot, 1);
-        deleteFingerName(existingSlot);
+        if (isSlotOccupied(existingSlot)) {
+            deleteTemplate(existingSlot, 1);
+            deleteFingerName(existingSlot);
+            versions.bump(VERSION_LIBRARY, existingSlot);
+        } else {
+            // Pre-seeded metadata waiting for its template; keep seeded password/Enter
+            pendingSlot = existingSlot;
+        }
     }
 
-    pendingSlot = findEmptySlot();
+    if (pendingSlot < 0) pendingSlot = findEmptySlot();
 
     if (pendingSlot < 0 || pendingSlot >= librarySize) {
-        return "{\"ok\":false,\"status\":\"Library full\"}";
+        out.raw("{\"ok\":false,\"status\":\"Library full\"}");
+        return;
     }
 
     enrollState = ENROLL_CAPTURE_1;
@@ -696,19 +1661,18 @@ String enrollStartJson(JsonObject params) {
     enrollTimeout = millis() + 60000;
     lastStatus = "Enrolling " + pendingFingerName;
 
-    return "{\"ok\":true,\"status\":\"Place finger on sensor\"}";
+    out.raw("{\"ok\":true,\"status\":\"Place finger on sensor\"}");
 }
 
-String getEnrollStatusJson() {
-    String json = "{\"state\":" + String(enrollState) + ",\"totalSteps\":6,";
-
+// Progress fields shared by enroll_status and the enroll event
+void enrollProgressJson(EnrollState state, JsonWriter& out) {
     int step = 0;
     bool captured = false;
     bool done = false;
     const char* phase = "center";
     const char* message = "";
 
-    switch (enrollState) {
+    switch (state) {
         case ENROLL_IDLE: step = 0; break;
         case ENROLL_CAPTURE_1: step = 1; message = enrollMessages[0]; break;
         case ENROLL_LIFT_1: step = 1; captured = true; message = enrollMessages[1]; break;
@@ -725,261 +1689,1127 @@ String getEnrollStatusJson() {
         case ENROLL_DONE: step = 6; captured = true; done = true; phase = "edges"; break;
     }
 
-    json += "\"step\":" + String(step) +
-            ",\"captured\":" + String(captured ? "true" : "false") +
-            ",\"phase\":\"" + String(phase) + "\"" +
-            ",\"message\":\"" + String(message) + "\"" +
-            ",\"done\":" + String(done ? "true" : "false");
+    out.field("state", (int)state);
+    out.field("totalSteps", 6);
+    out.field("step", step);
+    out.field("captured", captured);
+    out.field("phase", phase);
+    out.field("message", message);
+    out.field("done", done);
+}
+
+void getEnrollStatusJson(JsonWriter& out) {
+    out.beginObject();
+    enrollProgressJson(enrollState, out);
 
     if (enrollState == ENROLL_DONE) {
-        json += ",\"ok\":" + String(enrollSuccess ? "true" : "false") +
-                ",\"name\":\"" + pendingFingerName + "\"" +
-                ",\"status\":\"" + (enrollSuccess ? String("Enrolled successfully") : enrollError) + "\"";
+        out.field("ok", enrollSuccess);
+        out.field("name", pendingFingerName);
+        out.key("status");
+        if (enrollSuccess) out.value("Enrolled successfully");
+        else out.value(enrollError);
         enrollState = ENROLL_IDLE;
         if (!enrollSuccess) setLED(LED_ON, 0, LED_RED, 0);
         delay(100);
         setLED(LED_OFF, 0, LED_RED, 0);
     }
 
-    json += "}";
-    return json;
+    out.endObject();
 }
 
-String enrollCancelJson() {
+void enrollCancelJson(JsonWriter& out) {
     enrollState = ENROLL_IDLE;
     pendingFingerName = "";
     pendingFingerPassword = "";
     pendingPressEnter = false;
     pendingSlot = -1;
     setLED(LED_OFF, 0, LED_GREEN, 0);
-    return "{\"ok\":true}";
+    out.raw("{\"ok\":true}");
 }
 
-String deleteFingerJson(JsonObject params) {
-    if (!params.containsKey("id")) {
-        return "{\"ok\":false,\"status\":\"Missing ID\"}";
-    }
-
+void deleteFingerJson(JsonObject params, JsonWriter& out) {
     int id = params["id"].as<int>();
     if (id < 0 || id >= librarySize) {
-        return "{\"ok\":false,\"status\":\"Invalid ID\"}";
+        out.raw("{\"ok\":false,\"status\":\"Invalid ID\"}");
+        return;
     }
 
     String name = getFingerName(id);
     uint8_t result = deleteTemplate(id, 1);
     getTemplateCount();
 
+    out.beginObject();
     if (result == 0x00) {
         deleteFingerName(id);
         setLED(LED_ON, 0, LED_GREEN, 0);
         delay(500);
         setLED(LED_OFF, 0, LED_GREEN, 0);
         lastStatus = "Deleted " + name;
-        return "{\"ok\":true,\"status\":\"Deleted " + name + "\",\"count\":" + String(templateCount) + "}";
+        libraryChanged(id, LIBRARY_REMOVED);
+        out.field("ok", true);
+        out.field("status", lastStatus);
     } else {
         lastStatus = "Delete failed";
-        return "{\"ok\":false,\"status\":\"Delete failed\",\"count\":" + String(templateCount) + "}";
+        out.field("ok", false);
+        out.field("status", lastStatus);
     }
+    out.field("count", templateCount);
+    out.endObject();
 }
 
-String emptyLibraryJson() {
+void emptyLibraryJson(JsonWriter& out) {
     uint8_t result = emptyLibrary();
     getTemplateCount();
 
+    out.beginObject();
     if (result == 0x00) {
         clearAllFingerNames();
         setLED(LED_ON, 0, LED_GREEN, 0);
         delay(500);
         setLED(LED_OFF, 0, LED_GREEN, 0);
         lastStatus = "Library cleared";
-        return "{\"ok\":true,\"status\":\"All fingerprints deleted\",\"count\":" + String(templateCount) + "}";
+        libraryChanged(-1, LIBRARY_CLEARED);
+        out.field("ok", true);
+        out.field("status", "All fingerprints deleted");
     } else {
         lastStatus = "Clear failed";
-        return "{\"ok\":false,\"status\":\"Failed to clear library\",\"count\":" + String(templateCount) + "}";
+        out.field("ok", false);
+        out.field("status", "Failed to clear library");
     }
+    out.field("count", templateCount);
+    out.endObject();
 }
 
-String getBLEStatusJson() {
-    String json = "{\"connected\":" + String(isKeyboardConnected() ? "true" : "false") +
-                  ",\"mode\":\"" + getKeyboardMode() + "\"}";
-    return json;
-}
-
-String getFingerJson(JsonObject params) {
-    if (!params.containsKey("id")) {
-        return "{\"ok\":false,\"status\":\"Missing ID\"}";
+void getBLEStatusJson(JsonWriter& out) {
+    out.beginObject();
+    out.field("connected", isKeyboardConnected());
+    out.field("mode", getKeyboardMode());
+#if TOUCHPASS_HAS_BLE
+    if (transports.isUp(KB_MODE_BLE)) {
+        out.key("link").beginObject();
+        out.field("intervalMs", bleLink.intervalMs(), 2);
+        out.field("latency", bleLink.slaveLatency());
+        out.field("supervisionMs", bleLink.supervisionMs());
+        out.field("mtu", bleLink.negotiatedMtu());
+        out.field("fast", bleLink.isFast());
+        out.field("updates", bleLink.paramUpdates());
+        out.field("failures", bleLink.paramFailures());
+        out.field("lastFailure", bleLink.lastFailureCode());
+        out.field("ready", bleLink.isReady());
+        out.field("bondedHost", bleLink.hasHost());
+        out.field("advertising", bleLink.advertising());
+        out.field("reconnects", bleLink.reconnectCount());
+        out.field("reconnectMs", bleLink.lastReconnectMs());
+        out.field("reconnectVia", bleLink.lastReconnectVia());
+        out.field("queuedTouch", queuedTouchSlot);
+        out.endObject();
+        out.key("uart").beginObject();
+        out.field("open", bleUart.isOpen());
+        out.field("inFlight", bleLink.uartInFlight());
+        out.field("dropped", bleUart.droppedBytes());
+        out.endObject();
     }
+#endif
+    out.endObject();
+}
 
+void getFingerJson(JsonObject params, JsonWriter& out) {
     int id = params["id"].as<int>();
     if (id < 0 || id >= librarySize) {
-        return "{\"ok\":false,\"status\":\"Invalid ID\"}";
+        out.raw("{\"ok\":false,\"status\":\"Invalid ID\"}");
+        return;
     }
 
-    String json = "{\"ok\":true,\"id\":" + String(id) +
-                  ",\"name\":\"" + getFingerName(id) + "\"" +
-                  ",\"hasPassword\":" + String(getFingerPassword(id).length() > 0 ? "true" : "false") +
-                  ",\"pressEnter\":" + String(getFingerPressEnter(id) ? "true" : "false") +
-                  ",\"fingerId\":" + String(getFingerIdForSlot(id)) + "}";
-    return json;
+    out.beginObject();
+    out.field("ok", true);
+    out.field("id", id);
+    out.field("name", getFingerName(id));
+    out.field("username", getFingerUsername(id));
+    out.field("hasPassword", hasFingerPassword(id));
+    out.field("pressEnter", getFingerPressEnter(id));
+    out.field("hasTotp", hasFingerTotp(id));
+    out.field("fingerId", getFingerIdForSlot(id));
+    out.endObject();
 }
 
-String updateFingerJson(JsonObject params) {
-    if (!params.containsKey("id")) {
-        return "{\"ok\":false,\"status\":\"Missing ID\"}";
+// Every check update_finger makes, run before it saves anything: the slot's
+// sequence is rendered into stream from the stored fields with the update
+// applied. Returns the failure status, or nullptr.
+const char* checkFingerUpdate(JsonObject params, SecureArray<HID_STREAM_MAX>& stream) {
+    stream.wipe();
+    int id = params["id"].as<int>();
+    if (id < 0 || id >= librarySize) return "Invalid ID";
+
+    String username = params.containsKey("username") ? params["username"].as<String>() : getFingerUsername(id);
+    if (username.length() > 64) return "Username too long";
+
+    SecureBuffer pwd;
+    if (params.containsKey("password")) {
+        String password = params["password"].as<String>();
+        if (password.length() > pwd.capacity()) return "Password too long";
+        memcpy(pwd.data(), password.c_str(), password.length());
+        pwd.setLength(password.length());
+    } else {
+        readFingerPassword(id, pwd);
     }
 
-    int id = params["id"].as<int>();
-    if (id < 0 || id >= librarySize) {
-        return "{\"ok\":false,\"status\":\"Invalid ID\"}";
+    TotpConfig cfg;
+    bool totp = readTotpConfig(id, cfg);
+    if (params.containsKey("totp")) {
+        JsonObject t = params["totp"];
+        const char* secret = t.isNull() ? nullptr : t["secret"].as<const char*>();
+        totp = secret && secret[0];
+        if (totp) {
+            uint8_t decoded[TOTP_MAX_SECRET];
+            int decodedLen = base32Decode(secret, decoded, sizeof(decoded));
+            mbedtls_platform_zeroize(decoded, sizeof(decoded));
+            if (decodedLen <= 0 || !parseTotpParams(t, cfg)) return "Invalid TOTP settings";
+        }
     }
 
+    bool pressEnter = params.containsKey("pressEnter") ? params["pressEnter"].as<bool>() : getFingerPressEnter(id);
+    if (pwd.length() == 0 && username.length() == 0 && !totp) return nullptr;
+
+    CredentialSpec spec = {username.c_str(), username.length(), pwd.c_str(), pwd.length(),
+                           totp, totp && cfg.mode == TOTP_CODE_ONLY, pressEnter};
+    stream.setLength(renderCredential(spec, keyboardLayout, activePace(), (uint8_t*)stream.data(), stream.capacity()));
+    if (stream.length() == 0 && (pwd.length() > 0 || totp)) return "Credential too long for keyboard layout";
+    return nullptr;
+}
+
+void updateFingerJson(JsonObject params, JsonWriter& out) {
+    SecureArray<HID_STREAM_MAX> stream;
+    const char* error = checkFingerUpdate(params, stream);
+    if (error) {
+        out.beginObject();
+        out.field("ok", false);
+        out.field("status", error);
+        out.endObject();
+        return;
+    }
+
+    int id = params["id"].as<int>();
+    if (params.containsKey("username")) saveFingerUsername(id, params["username"].as<String>());
     if (params.containsKey("name")) saveFingerName(id, params["name"].as<String>());
-    if (params.containsKey("password")) saveFingerPassword(id, params["password"].as<String>());
+    const char* error = nullptr;
+    if (params.containsKey("password") && !saveFingerPassword(id, params["password"].as<String>())) {
+        error = "Could not store password";
+    }
     if (params.containsKey("pressEnter")) saveFingerPressEnter(id, params["pressEnter"].as<bool>());
 
-    return "{\"ok\":true,\"status\":\"Updated " + getFingerName(id) + "\"}";
+    // "totp": null (or a missing secret) removes the code
+    if (params.containsKey("totp")) {
+        JsonObject totp = params["totp"];
+        const char* secret = totp.isNull() ? nullptr : totp["secret"].as<const char*>();
+        TotpConfig cfg;
+        if (!secret || !secret[0]) removeFingerTotp(id);
+        else if (!parseTotpParams(totp, cfg) || !saveFingerTotp(id, secret, cfg)) error = "Could not store TOTP secret";
+    }
+
+    // Sealed now so the touch path only replays reports; after a failed
+    // write it is rendered from what was stored instead
+    if (!error && stream.length() > 0) sealFingerStream(id, stream);
+    else if (error) storeFingerStream(id);
+
+    libraryChanged(id, LIBRARY_UPDATED);
+    out.beginObject();
+    out.field("ok", !error);
+    out.field("status", error ? String(error) : "Updated " + getFingerName(id));
+    out.endObject();
 }
 
-String getSystemInfoJson() {
-    String json = "{\"chip\":\"";
-    #if CONFIG_IDF_TARGET_ESP32S3
-        json += "ESP32-S3";
-    #else
-        json += "ESP32-C6";
-    #endif
-    json += "\",\"firmware\":\"TouchPass v1.0\"";
-    json += ",\"freeHeap\":" + String(ESP.getFreeHeap());
-    json += "}";
-    return json;
+#if TOUCHPASS_HAS_BLE
+void releaseBluetooth() {
+    uint32_t before = ESP.getFreeHeap();
+    if (esp_bt_mem_release(ESP_BT_MODE_BTDM) != ESP_OK) return;
+    btReleased = true;
+    btReclaimedBytes = ESP.getFreeHeap() - before;
 }
+#endif
 
-String getKeyboardModeJson() {
-    String json = "{";
+void getSystemInfoJson(JsonWriter& out) {
+    out.beginObject();
+    out.field("chip", Board::chip);
+    out.field("firmware", "TouchPass v1.0");
+    out.field("transport", TOUCHPASS_TRANSPORT_NAME);
+    out.field("freeHeap", ESP.getFreeHeap());
+    out.field("largestFreeBlock", ESP.getMaxAllocHeap());
+    out.field("bluetooth", btReleased ? "released" : transports.isUp(KB_MODE_BLE) ? "on" : "off");
+    out.field("btReclaimed", btReclaimedBytes);
+#if TOUCHPASS_CONFIG_WIFI
+    out.key("wifi").beginObject();
+    out.field("ssid", WIFI_CONFIG_SSID);
+    out.field("password", loadWifiPassword());
+    out.field("clients", wifiConfig.clientCount());
+    out.endObject();
+#endif
+    out.endObject();
+}
+
+void getKeyboardModeJson(JsonWriter& out) {
+    out.beginObject();
 
     // Current active mode
-    json += "\"current\":\"" + getKeyboardMode() + "\"";
+    out.field("current", getKeyboardMode());
 
-    // Available modes based on chip
-    json += ",\"availableModes\":[";
-    #if CONFIG_IDF_TARGET_ESP32S3
-        json += "\"BLE\",\"USB-HID\"";
-    #else
-        json += "\"BLE\"";
-    #endif
-    json += "]";
+    // Available modes based on chip and build
+    out.key("availableModes").beginArray();
+    const KeyboardMode modes[] = {KB_MODE_BLE, KB_MODE_USB, KB_MODE_AUTO};
+    for (KeyboardMode m : modes) {
+        if (transports.supports(m)) out.value(TransportManager::modeName(m));
+    }
+    out.endArray();
 
-    // Saved preference
-    String savedMode = useUsb ? "USB-HID" : "BLE";
-    json += ",\"saved\":\"" + savedMode + "\"";
+    // Saved preference (applied live, so always the current mode)
+    out.field("saved", getKeyboardMode());
 
-    json += "}";
-    return json;
+    // Transport the next credential would be typed on
+    KeyboardInterface* kb = transports.route();
+    out.key("active");
+    if (kb) out.value(kb->getModeName());
+    else out.null();
+    out.field("switchMs", transports.switchUs() / 1000.0, 2);
+
+    out.endObject();
+}
+
+// ===== Warm Restart =====
+// Software resets keep a validated snapshot in RTC_NOINIT memory so setup()
+// can skip the NVS, sensor-probe and USB-wait steps it would otherwise repeat.
+
+void restartWithSnapshot() {
+    uint8_t bitmap[32];
+    if (sensorOk && readIndexTable(0, bitmap)) {
+        rtcSnapshot.keyboardMode = keyboardMode;
+        rtcSnapshot.librarySize = librarySize;
+        rtcSnapshot.templateCount = templateCount;
+        rtcSnapshot.packetSize = fpPacketSize;
+        rtcSnapshot.fpBaud = fpBaud;
+        memcpy(rtcSnapshot.occupancy, bitmap, sizeof(rtcSnapshot.occupancy));
+        sealBootSnapshot(rtcSnapshot);
+    } else {
+        invalidateBootSnapshot(rtcSnapshot);
+    }
+    cmdHandler.flushOutput();
+    ESP.restart();
 }
 
-String setKeyboardModeJson(JsonObject params) {
+// Returns true if setup() may skip the full probe sequence
+bool restoreBootSnapshot() {
+    bool valid = esp_reset_reason() == ESP_RST_SW && validBootSnapshot(rtcSnapshot);
+    if (valid) {
+        keyboardMode = (KeyboardMode)rtcSnapshot.keyboardMode;
+        librarySize = rtcSnapshot.librarySize;
+        templateCount = rtcSnapshot.templateCount;
+        fpPacketSize = rtcSnapshot.packetSize;
+        fpBaud = rtcSnapshot.fpBaud;
+        memcpy(libraryIndex, rtcSnapshot.occupancy, sizeof(libraryIndex));
+    }
+    invalidateBootSnapshot(rtcSnapshot);
+    return valid;
+}
+
+void loadKeyboardMode() {
+    prefs.begin("settings", true);
+    // "useUsb" is the boolean setting from before AUTO mode existed
+    uint8_t legacy = prefs.getBool("useUsb", false) ? KB_MODE_USB : KB_MODE_BLE;
+    uint8_t mode = prefs.getUChar("kbMode", legacy);
+    prefs.end();
+    keyboardMode = mode <= KB_MODE_AUTO && transports.supports((KeyboardMode)mode) ? (KeyboardMode)mode : transports.defaultMode();
+}
+
+// Switches transports live; a queued touch stays queued and is typed on
+// whichever transport becomes ready first.
+void setKeyboardModeJson(JsonObject params, JsonWriter& out) {
     if (params.containsKey("mode")) {
         String mode = params["mode"].as<String>();
-        bool newUseUsb = (mode == "usb");
-        if (newUseUsb != useUsb) {
-            useUsb = newUseUsb;
+        KeyboardMode newMode;
+        if (mode == "usb") newMode = KB_MODE_USB;
+        else if (mode == "ble") newMode = KB_MODE_BLE;
+        else if (mode == "auto") newMode = KB_MODE_AUTO;
+        else {
+            out.raw("{\"ok\":false,\"status\":\"Unknown mode\"}");
+            return;
+        }
+
+        if (!transports.supports(newMode)) {
+            out.raw("{\"ok\":false,\"status\":\"Mode not supported on this build\"}");
+            return;
+        }
+        if (newMode != keyboardMode) {
+            keyboardMode = newMode;
             prefs.begin("settings", false);
-            prefs.putBool("useUsb", useUsb);
+            prefs.putUChar("kbMode", keyboardMode);
+            prefs.remove("useUsb");
             prefs.end();
-            String json = "{\"ok\":true,\"mode\":\"" + getKeyboardMode() + "\",\"restart\":true}";
-            delay(500);
-            ESP.restart();
-            return json;
+            versions.bump(VERSION_SETTINGS);
+#if TOUCHPASS_HAS_BLE
+            if (btReleased && newMode != KB_MODE_USB) {
+                out.beginObject();
+                out.field("ok", true);
+                out.field("mode", TransportManager::modeName(newMode));
+                out.field("restart", true);
+                out.endObject();
+                restartPending = true;
+                return;
+            }
+#endif
+            withLock(typingLock, [&] { transports.setMode(newMode); });
+            out.beginObject();
+            out.field("ok", true);
+            out.field("mode", getKeyboardMode());
+            out.field("switchMs", transports.switchUs() / 1000.0, 2);
+            out.endObject();
+            return;
         }
     }
-    return "{\"ok\":true,\"mode\":\"" + getKeyboardMode() + "\"}";
+    out.beginObject();
+    out.field("ok", true);
+    out.field("mode", getKeyboardMode());
+    out.endObject();
 }
 
-String rebootJson() {
-    delay(500);
-    ESP.restart();
-    return "{\"ok\":true,\"status\":\"Rebooting\"}";
+void rebootJson(JsonWriter& out) {
+    restartPending = true;
+    out.raw("{\"ok\":true,\"status\":\"Rebooting\"}");
 }
 
-String getDiagnosticsJson() {
-    String json = "{";
+void getDiagnosticsJson(JsonWriter& out) {
+    out.beginObject();
 
     // UART1 info
-    json += "\"uart1\":{";
-    json += "\"rxPin\":" + String(FP_RX_PIN);
-    json += ",\"txPin\":" + String(FP_TX_PIN);
-    json += ",\"baud\":57600";
-    json += ",\"available\":" + String(fpSerial.available());
-    json += "}";
+    out.key("uart1").beginObject();
+    out.field("rxPin", FP_RX_PIN);
+    out.field("txPin", FP_TX_PIN);
+    out.field("baud", fpBaud);
+    out.field("packetSize", fpPacketSize);
+    out.field("available", fpSerial.available());
+    out.endObject();
 
     // USB info
-    json += ",\"usb\":{";
-    json += "\"hid\":" + String(usbInitialized ? "true" : "false");
-    json += ",\"serial\":" + String(Serial ? "true" : "false");
-    json += ",\"mode\":\"" + String(useUsb ? "usb" : "ble") + "\"";
-    json += "}";
+    out.key("usb").beginObject();
+    out.field("hid", transports.isUp(KB_MODE_USB));
+    out.field("serial", (bool)Serial);
+    out.field("mode", keyboardMode == KB_MODE_AUTO ? "auto" : keyboardMode == KB_MODE_USB ? "usb" : "ble");
+    out.endObject();
 
     // Sensor info
-    json += ",\"sensor\":{";
-    json += "\"connected\":" + String(sensorOk ? "true" : "false");
-    json += ",\"library\":\"" + lastStatus + "\"";
-    json += "}";
+    out.key("sensor").beginObject();
+    out.field("connected", sensorOk);
+    out.field("library", lastStatus);
+    out.endObject();
+
+    // Time source
+    out.key("time").beginObject();
+    out.field("valid", timeValid());
+    out.field("epoch", (uint32_t)correctedUnixTime());
+    out.field("lastSync", lastTimeSync);
+    out.field("driftPpm", clockDriftPpm);
+    out.endObject();
+
+    // Typing engine
+    out.key("typing");
+    getTypingJson(out);
+
+    // Boot path
+    out.key("boot").beginObject();
+    out.field("warm", warmBoot);
+    out.field("readyMs", bootReadyMs);
+    out.endObject();
+
+    // Credential encryption
+    out.key("crypto").beginObject();
+    out.field("ready", credCrypto.isReady());
+    out.field("keyInEfuse", deviceKeyInEfuse);
+    #if CONFIG_MBEDTLS_HARDWARE_AES
+        out.field("hwAes", true);
+    #else
+        out.field("hwAes", false);
+    #endif
+    out.field("lastDecryptUs", lastDecryptUs);
+    out.endObject();
+
+    // Previous command: response size, time and heap low-water mark
+    out.key("command").beginObject();
+    out.field("name", cmdHandler.lastCommand());
+    out.field("bytes", cmdHandler.lastResponseBytes());
+    out.field("us", cmdHandler.lastUs());
+    out.field("peakHeap", cmdHandler.lastPeakHeapBytes());
+    out.endObject();
 
     // Chip info
-    json += ",\"chip\":{";
-    json += "\"model\":\"" + String(ESP.getChipModel()) + "\"";
-    json += ",\"cores\":" + String(ESP.getChipCores());
-    json += ",\"freeHeap\":" + String(ESP.getFreeHeap());
-    json += "}";
+    out.key("chip").beginObject();
+    out.field("model", ESP.getChipModel());
+    out.field("cores", ESP.getChipCores());
+    out.field("freeHeap", ESP.getFreeHeap());
+    out.endObject();
+
+    // Tasks: placement and the least stack left so far, in bytes
+    out.key("tasks").beginArray();
+    taskJson(sensorTaskInfo, out);
+    taskJson(typingTaskInfo, out);
+    taskJson(commandTaskInfo, out);
+    out.endArray();
+
+    out.endObject();
+}
+
+void commandStatsJson(JsonWriter& out) {
+    cmdHandler.statsJson(out);
+}
+
+// ===== Events =====
+
+void eventJson(const Event& e, JsonWriter& out) {
+    static const char* const libraryChanges[] = {"added", "updated", "removed", "cleared", "imported"};
+    out.beginObject();
+    switch (e.type) {
+        case EVENT_DETECT: {
+            char result[5];
+            snprintf(result, sizeof(result), "0x%x", (uint8_t)e.c);
+            out.field("event", "detect");
+            out.field("seq", e.seq);
+            out.field("ms", e.ms);
+            out.field("id", e.a);
+            out.field("finger", e.a >= 0 ? getFingerName(e.a) : String(""));
+            out.field("score", e.b);
+            out.field("matched", e.a >= 0);
+            out.field("result", result);
+            break;
+        }
+        case EVENT_ENROLL:
+            out.field("event", "enroll");
+            out.field("seq", e.seq);
+            out.field("ms", e.ms);
+            enrollProgressJson((EnrollState)e.a, out);
+            if (e.a == ENROLL_DONE) out.field("ok", e.b != 0);
+            out.field("slot", e.c);
+            break;
+        case EVENT_KEYBOARD:
+            out.field("event", "keyboard");
+            out.field("seq", e.seq);
+            out.field("ms", e.ms);
+            out.field("connected", e.a != 0);
+            out.field("mode", TransportManager::modeName((KeyboardMode)e.b));
+            break;
+        case EVENT_LIBRARY:
+            out.field("event", "library");
+            out.field("seq", e.seq);
+            out.field("ms", e.ms);
+            out.field("change", libraryChanges[e.c]);
+            out.field("slot", e.b);
+            out.field("count", e.a);
+            break;
+    }
+    out.endObject();
+}
+
+void subscribeJson(JsonObject params, JsonWriter& out) {
+    cmdHandler.subscribe(events, params.containsKey("since"), params["since"] | 0UL, out);
+}
+
+void unsubscribeJson(JsonWriter& out) {
+    cmdHandler.unsubscribe();
+    out.raw("{\"ok\":true}");
+}
+
+// ===== Batch =====
 
-    json += "}";
-    return json;
+void batchJson(JsonObject params, JsonWriter& out) {
+    cmdHandler.batch(params, out);
+}
+
+// Dry run of an atomic batch entry: the checks its command makes before it
+// writes anything. Returns the failure status, or nullptr.
+const char* checkMetadataWrite(const char* cmd, JsonObject params) {
+    if (strcmp(cmd, "update_finger") == 0) {
+        SecureArray<HID_STREAM_MAX> stream;
+        return checkFingerUpdate(params, stream);
+    }
+    if (strcmp(cmd, "set_typing") == 0) return checkTypingSettings(params);
+    return "No dry run for this command";
+}
+
+// An atomic batch is stored before it runs and removed when it has finished
+// The journal holds update_finger passwords and TOTP secrets, so it is sealed
+// like any other credential, under a slot number no finger can have.
+#define BATCH_JOURNAL_MAX 2048
+#define BATCH_JOURNAL_SLOT 0xFFFF
+
+bool saveBatchJournal(JsonObject params) {
+    static SecureArray<BATCH_JOURNAL_MAX> json;  // Off the command task stack
+    static uint8_t blob[BATCH_JOURNAL_MAX + CRED_OVERHEAD];
+    json.setLength(serializeJson(params, json.data(), json.capacity() + 1));
+    size_t len = json.length();
+    if (len == 0 || len >= json.capacity()) {
+        json.wipe();
+        return false;
+    }
+
+    uint8_t nonce[CRED_NONCE_LEN];
+    esp_fill_random(nonce, sizeof(nonce));
+    size_t blobLen = credCrypto.seal(BATCH_JOURNAL_SLOT, json.c_str(), len, nonce, blob, sizeof(blob), CRED_KIND_JOURNAL);
+    json.wipe();
+    if (blobLen == 0) return false;
+    prefs.begin("batch", false);
+    bool ok = prefs.putBytes("journal", blob, blobLen) == blobLen;
+    prefs.end();
+    return ok;
+}
+
+void clearBatchJournal() {
+    prefs.begin("batch", false);
+    prefs.remove("journal");
+    prefs.end();
+}
+
+// Finishes an atomic batch cut short by a reset, once the sensor and the
+// settings it is checked against are loaded. Every entry is an idempotent
+// metadata write, so running it again from the start is safe; it goes
+// through the same dry run as the first time, and is dropped afterwards
+// either way so a batch that keeps failing is not retried on every boot.
+void replayBatchJournal() {
+    static uint8_t blob[BATCH_JOURNAL_MAX + CRED_OVERHEAD];  // Off the setup() stack
+    static SecureArray<BATCH_JOURNAL_MAX> json;
+    prefs.begin("batch", true);
+    size_t blobLen = prefs.isKey("journal") ? prefs.getBytes("journal", blob, sizeof(blob)) : 0;
+    prefs.end();
+    if (blobLen == 0) return;
+
+    static StaticJsonDocument<2048> doc;
+    if (credCrypto.open(BATCH_JOURNAL_SLOT, blob, blobLen, json, CRED_KIND_JOURNAL) &&
+        !deserializeJson(doc, json.data())) {  // In place, so the wipe covers it
+        JsonObject params = doc.as<JsonObject>();
+        struct : Print {
+            size_t write(uint8_t) override { return 1; }
+            size_t write(const uint8_t*, size_t len) override { return len; }
+        } discard;
+        JsonWriter out(discard);
+        cmdHandler.batch(params, out);
+    }
+    doc.clear();
+    json.wipe();
+    clearBatchJournal();
+}
+
+// Turns state changes that have no single call site into events
+void noteStateEvents() {
+    static EnrollState reportedEnroll = ENROLL_IDLE;
+    if (enrollState != reportedEnroll) {
+        reportedEnroll = enrollState;
+        if (enrollState != ENROLL_IDLE) {
+            events.push(EVENT_ENROLL, millis(), enrollState, enrollSuccess, pendingSlot);
+        }
+    }
+
+    static bool reportedConnected = false;
+    bool connected = isKeyboardConnected();
+    if (connected != reportedConnected) {
+        reportedConnected = connected;
+        events.push(EVENT_KEYBOARD, millis(), connected, transports.getMode());
+    }
+}
+
+// ===== Seed Image Provisioning =====
+// A TPMI image written by tools/mkseed to the "tpseed" partition (or the
+// unused spiffs partition) is adopted into NVS once, then erased.
+
+const esp_partition_t* findSeedPartition() {
+    const esp_partition_t* part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, "tpseed");
+    if (!part) part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+    return part;
+}
+
+uint16_t adoptSeedImage() {
+    const esp_partition_t* part = findSeedPartition();
+    if (!part) return 0;
+
+    uint8_t head[SEED_HEADER_LEN];
+    uint16_t count;
+    uint32_t payloadLen;
+    if (esp_partition_read(part, 0, head, sizeof(head)) != ESP_OK ||
+        !parseSeedHeader(head, &count, &payloadLen)) {
+        return 0;
+    }
+
+    size_t imageLen = SEED_HEADER_LEN + payloadLen;
+    if (imageLen > part->size) return 0;
+    uint8_t* image = (uint8_t*)malloc(imageLen);
+    if (!image) return 0;
+
+    uint16_t adopted = 0;
+    SeedImageReader reader;
+    if (esp_partition_read(part, 0, image, imageLen) == ESP_OK && reader.begin(image, imageLen)) {
+        SeedEntry e;
+        while (reader.next(&e)) {
+            if (e.slot >= librarySize) continue;
+            char name[SEED_MAX_NAME + 1];
+            memcpy(name, e.name, e.nameLen);
+            name[e.nameLen] = '\0';
+            saveFingerMeta(e.slot, name, e.fingerId, e.flags & SEED_FLAG_PRESS_ENTER);
+            if (e.passwordLen > 0) {
+                prefs.begin("fingers", false);
+                putPasswordBlob(e.slot, e.password, e.passwordLen);
+                prefs.end();
+                storeFingerStream(e.slot);
+            }
+            adopted++;
+        }
+
+        // Adopt once; this also removes the plaintext passwords from flash
+        const size_t sector = 4096;
+        size_t eraseLen = (imageLen + sector - 1) & ~(sector - 1);
+        esp_partition_erase_range(part, 0, min(eraseLen, (size_t)part->size));
+        lastStatus = "Provisioned " + String(adopted) + " fingers";
+    }
+
+    mbedtls_platform_zeroize(image, imageLen);
+    free(image);
+    return adopted;
+}
+
+// ===== Library Backup / Restore =====
+// Both directions run with the sensor at its largest data packet and FP_BULK_BAUD.
+// SetSysPara stores both in the sensor's flash, so each is written only when it
+// differs and is always put back afterwards. The values to go back to are kept
+// in NVS for the length of the transfer; recoverBulkTransfer() applies them at
+// boot if a reset cut a transfer short.
+
+uint8_t packetSizeCode(uint16_t size) {
+    uint8_t code = 0;
+    while (code < 3 && (32 << code) < size) code++;
+    return code;
+}
+
+bool setSensorPacketSize(uint16_t size) {
+    if (size == fpPacketSize) return true;
+    if (!setSysParam(FP_SYSPARA_PACKET_SIZE, packetSizeCode(size))) return false;
+    fpPacketSize = size;
+    return true;
+}
+
+void beginBulkTransfer() {
+    bulkRestoreBaud = fpBaud;
+    bulkRestorePacketSize = fpPacketSize;
+    if (fpBaud == FP_BULK_BAUD && fpPacketSize == 256) return;
+
+    prefs.begin("bulk", false);
+    prefs.putUInt("baud", bulkRestoreBaud);
+    prefs.putUShort("packet", bulkRestorePacketSize);
+    prefs.end();
+    bulkPending = true;
+
+    setSensorPacketSize(256);
+    setSensorBaud(FP_BULK_BAUD);
+}
+
+void endBulkTransfer() {
+    if (!bulkPending) return;
+    setSensorBaud(bulkRestoreBaud);
+    setSensorPacketSize(bulkRestorePacketSize);
+    if (fpBaud != bulkRestoreBaud || fpPacketSize != bulkRestorePacketSize) return;  // Retried at boot
+
+    prefs.begin("bulk", false);
+    prefs.clear();
+    prefs.end();
+    bulkPending = false;
+}
+
+// Called from setup() once the sensor answers, at whichever baud it is on
+void recoverBulkTransfer() {
+    prefs.begin("bulk", true);
+    bulkPending = prefs.isKey("baud");
+    bulkRestoreBaud = prefs.getUInt("baud", FP_DEFAULT_BAUD);
+    bulkRestorePacketSize = prefs.getUShort("packet", fpPacketSize);
+    prefs.end();
+    endBulkTransfer();
+}
+
+// Forwards the data packets that follow an UpChar ack straight to the host.
+// The UART driver keeps filling its RX ring while the TX ring drains to USB.
+bool streamTemplateToHost() {
+    while (true) {
+        int16_t len = receiveResponse(rxBuffer, 1000);
+        int16_t payloadLen = checkDataPacket(len);
+        if (payloadLen < 0) return false;
+
+        uint8_t pid = rxBuffer[6];
+        if (pid == FP_DATA_PACKET) {
+            writeArchiveFrame(cmdHandler.output(), ARCHIVE_FRAME_CHUNK, rxBuffer + 9, payloadLen);
+            cmdHandler.drainOutput();
+        } else if (pid == FP_END_PACKET) {
+            writeArchiveFrame(cmdHandler.output(), ARCHIVE_FRAME_LAST, rxBuffer + 9, payloadLen);
+            return true;
+        } else {
+            return false;
+        }
+    }
+}
+
+// Streams the binary archive first; the JSON response line follows the 'E' frame
+void exportLibraryJson(JsonWriter& out) {
+    uint8_t bitmap[32];
+    if (!readIndexTable(0, bitmap)) {
+        out.raw("{\"ok\":false,\"status\":\"Sensor error\"}");
+        return;
+    }
+
+    uint16_t count = 0;
+    for (int id = 0; id < librarySize && id < 256; id++) {
+        if (bitmap[id / 8] & (1 << (id % 8))) count++;
+    }
+
+    unsigned long start = millis();
+    beginBulkTransfer();
+    writeArchiveHeader(cmdHandler.output(), count, fpPacketSize);
+
+    uint16_t index = 0;
+    uint16_t exported = 0;
+    for (int id = 0; id < librarySize && id < 256; id++) {
+        if (!(bitmap[id / 8] & (1 << (id % 8)))) continue;
+
+        if (loadTemplate(1, id) != 0x00 || uploadTemplate(1) != 0x00) {
+            index++;
+            continue;
+        }
+
+        ArchiveRecord rec;
+        rec.index = index++;
+        rec.slot = id;
+        rec.fingerId = getFingerIdForSlot(id);
+        rec.flags = getFingerPressEnter(id) ? ARCHIVE_FLAG_PRESS_ENTER : 0;
+        prefs.begin("fingers", true);
+        String name = prefs.getString(("f" + String(id)).c_str(), "");
+        prefs.end();
+        strlcpy(rec.name, name.c_str(), sizeof(rec.name));
+        writeArchiveRecord(cmdHandler.output(), rec);
+
+        if (streamTemplateToHost()) exported++;
+    }
+
+    writeArchiveEnd(cmdHandler.output(), exported);
+    endBulkTransfer();
+
+    out.beginObject();
+    out.field("ok", exported == count);
+    out.field("exported", exported);
+    out.field("skipped", count - exported);
+    out.field("ms", millis() - start);
+    out.endObject();
+}
+
+// The archive follows the command line on the same port
+void importLibraryJson(JsonObject params, JsonWriter& out) {
+    static uint8_t frame[ARCHIVE_MAX_PAYLOAD];
+    uint8_t type = 0;
+    uint16_t total = 0, packetSize = 0;
+
+    cmdHandler.port().setTimeout(2000);
+    int len = readArchiveFrame(cmdHandler.input(), &type, frame, sizeof(frame));
+    if (len < 0 || type != ARCHIVE_FRAME_HEADER || !parseArchiveHeader(frame, len, &total, &packetSize)) {
+        cmdHandler.port().setTimeout(1000);
+        out.raw("{\"ok\":false,\"status\":\"Bad archive header\"}");
+        return;
+    }
+
+    // Reported even if the sensor rejected it: a failed Empty may still have
+    // removed templates
+    if (params["clear"] | false) {
+        if (emptyLibrary() == 0x00) clearAllFingerNames();
+        getTemplateCount();
+        libraryChanged(-1, LIBRARY_CLEARED);
+    }
+
+    unsigned long start = millis();
+    beginBulkTransfer();
+
+    ArchiveRecord rec;
+    bool haveRecord = false;
+    size_t tplLen = 0;
+    uint16_t done = 0, imported = 0;
+    bool complete = false;
+
+    while ((len = readArchiveFrame(cmdHandler.input(), &type, frame, sizeof(frame))) >= 0) {
+        if (type == ARCHIVE_FRAME_RECORD) {
+            haveRecord = parseArchiveRecord(frame, len, &rec) && rec.slot < librarySize;
+            tplLen = 0;
+        } else if (type == ARCHIVE_FRAME_CHUNK || type == ARCHIVE_FRAME_LAST) {
+            if (!haveRecord) continue;
+            if (tplLen + len > sizeof(templateBuffer)) {
+                haveRecord = false;
+                continue;
+            }
+            memcpy(templateBuffer + tplLen, frame, len);
+            tplLen += len;
+            if (type != ARCHIVE_FRAME_LAST) continue;
+
+            if (downloadTemplate(1, templateBuffer, tplLen) && storeTemplate(1, rec.slot) == 0x00) {
+                saveFingerMeta(rec.slot, rec.name, rec.fingerId, rec.flags & ARCHIVE_FLAG_PRESS_ENTER);
+                imported++;
+            }
+            haveRecord = false;
+            done++;
+            cmdHandler.output().printf("{\"event\":\"import_progress\",\"done\":%u,\"total\":%u}\n", done, total);
+            cmdHandler.drainOutput();
+        } else if (type == ARCHIVE_FRAME_END) {
+            complete = true;
+            break;
+        }
+    }
+
+    endBulkTransfer();
+    cmdHandler.port().setTimeout(1000);
+    getTemplateCount();
+    lastStatus = "Imported " + String(imported) + " fingers";
+    if (imported > 0) libraryChanged(-1, LIBRARY_IMPORTED);
+
+    out.beginObject();
+    out.field("ok", complete && imported == done);
+    out.field("imported", imported);
+    out.field("failed", done - imported);
+    out.field("complete", complete);
+    out.field("count", templateCount);
+    out.field("ms", millis() - start);
+    out.endObject();
+}
+
+void cryptoBenchJson(JsonWriter& out) {
+    // Seal/open a typical 32-character credential to show per-touch overhead
+    const int iterations = 64;
+    char plain[32];
+    memset(plain, 'x', sizeof(plain));
+    uint8_t nonce[CRED_NONCE_LEN];
+    uint8_t blob[CRED_MAX_BLOB];
+    size_t blobLen = 0;
+    SecureBuffer opened;
+
+    esp_fill_random(nonce, sizeof(nonce));
+    unsigned long start = micros();
+    for (int i = 0; i < iterations; i++) {
+        blobLen = credCrypto.seal(0, plain, sizeof(plain), nonce, blob, sizeof(blob));
+    }
+    unsigned long sealUs = micros() - start;
+
+    bool ok = blobLen > 0;
+    start = micros();
+    for (int i = 0; i < iterations && ok; i++) {
+        ok = credCrypto.open(0, blob, blobLen, opened);
+    }
+    unsigned long openUs = micros() - start;
+
+    out.beginObject();
+    out.field("ok", ok);
+    out.field("bytes", sizeof(plain));
+    out.field("iterations", iterations);
+    out.field("sealUs", (float)sealUs / iterations, 1);
+    out.field("openUs", (float)openUs / iterations, 1);
+    out.endObject();
 }
 
 void setup() {
+    sensorLock = xSemaphoreCreateRecursiveMutex();
+    stateLock = xSemaphoreCreateRecursiveMutex();
+    typingLock = xSemaphoreCreateRecursiveMutex();
+    typingQueue = xQueueCreate(TYPING_QUEUE_DEPTH, sizeof(uint16_t));
+
+    warmBoot = restoreBootSnapshot();
+    versions.begin(esp_random());
+
     // Load keyboard mode preference (default to BLE for ESP32-S3)
-    prefs.begin("settings", true);
-    useUsb = prefs.getBool("useUsb", false);
-    prefs.end();
+    if (!warmBoot) loadKeyboardMode();
+
+    loadDeviceKey();
+    loadTimeSettings();
+    loadTypingSettings();
 
     // Initialize USB subsystem (required for both USB HID and Serial CDC)
+#if BOARD_HAS_USB_OTG
     USB.begin();
     delay(100);
+#endif
 
     // Initialize keyboard based on preference
-    if (useUsb) {
-        usbKeyboard.begin();
-        delay(500);
-        usbInitialized = true;
-    } else {
-        bleKeyboard.begin();
-        bleInitialized = true;
-    }
+    if (!transports.supports(keyboardMode)) keyboardMode = transports.defaultMode();
+#if TOUCHPASS_HAS_USB
+    usbKeyboard.onEvent(ARDUINO_USB_HID_KEYBOARD_LED_EVENT, usbLedEvent);
+#endif
+#if TOUCHPASS_HAS_BLE
+    loadBleHost();
+    if (keyboardMode == KB_MODE_USB) releaseBluetooth();
+#endif
+    transports.setMode(keyboardMode);
+    if (keyboardMode != KB_MODE_BLE) delay(500);
 
     // Initialize USB Serial for configuration (native USB CDC)
     Serial.begin(115200);
-    delay(100);
-    while (!Serial && millis() < 3000) delay(10);
+    if (!warmBoot) {
+        delay(100);
+        while (!Serial && millis() < 3000) delay(10);
+    }
 
-    cmdHandler.begin(&Serial);
+    cmdHandler.attach("usb", &Serial);
+#if TOUCHPASS_CONFIG_WIFI
+    if (wifiConfig.begin(loadWifiPassword().c_str())) cmdHandler.attach("wifi", &wifiConfig);
+#endif
 
-    fpSerial.begin(57600, SERIAL_8N1, FP_RX_PIN, FP_TX_PIN);
-    delay(500);
+    // Room for several full data packets during template transfers
+    fpSerial.setRxBufferSize(1024);
+    fpSerial.begin(fpBaud, SERIAL_8N1, FP_RX_PIN, FP_TX_PIN);
+    delay(warmBoot ? 10 : 500);  // The sensor stays powered across a software reset
 
     // Clear any garbage in buffer
     while (fpSerial.available()) {
         fpSerial.read();
     }
 
-    if (checkSensorConnection()) {
+    // One handshake confirms the snapshot's baud; anything else means full init
+    if (warmBoot) {
+        if (checkSensorConnection()) {
+            replayBatchJournal();
+            bootReadyMs = millis();
+            return;
+        }
+        warmBoot = false;
+        fpBaud = FP_DEFAULT_BAUD;
+        fpSerial.updateBaudRate(fpBaud);
+    }
+
+    // A bulk transfer interrupted by a reset can leave the sensor at FP_BULK_BAUD
+    if (!checkSensorConnection()) {
+        fpSerial.updateBaudRate(FP_BULK_BAUD);
+        fpBaud = FP_BULK_BAUD;
+        if (!checkSensorConnection()) {
+            fpSerial.updateBaudRate(FP_DEFAULT_BAUD);
+            fpBaud = FP_DEFAULT_BAUD;
+        }
+    }
+
+    if (sensorOk) {
         readSysParams();
+        recoverBulkTransfer();
         getTemplateCount();
     } else {
         setLED(LED_ON, 0, LED_RED, 0);
     }
+
+    adoptSeedImage();
+    migrateLegacyPasswords();
+    replayBatchJournal();
+    bootReadyMs = millis();
+}
+
+// ===== Tasks =====
+
+bool lockSensor(bool wait) {
+    return xSemaphoreTakeRecursive(sensorLock, wait ? pdMS_TO_TICKS(SENSOR_WAIT_MS) : 0) == pdTRUE;
+}
+
+void unlockSensor() {
+    xSemaphoreGiveRecursive(sensorLock);
+}
+
+// For commands not flagged COMMAND_SENSOR that read the sensor on one path.
+// They already hold stateLock, so a busy sensor is waited for with it let
+// go, keeping the sensor-before-state order.
+bool lockSensorForCommand() {
+    if (lockSensor(false)) return true;
+    unlockState();
+    bool ok = lockSensor(true);
+    lockState();
+    return ok;
+}
+
+void lockState() {
+    xSemaphoreTakeRecursive(stateLock, portMAX_DELAY);
+}
+
+void unlockState() {
+    xSemaphoreGiveRecursive(stateLock);
+}
+
+// For a reply waiting on a host that reads slowly (TxRing stall): stateLock
+// is let go however deeply the command task holds it, so matches and typing
+// go ahead meanwhile. A reply may see state change part-way, as with
+// lockSensorForCommand(). sensorLock stays held, keeping the lock order.
+int releaseState() {
+    int held = 0;
+    while (xSemaphoreGetMutexHolder(stateLock) == xTaskGetCurrentTaskHandle()) {
+        xSemaphoreGiveRecursive(stateLock);
+        held++;
+    }
+    return held;
+}
+
+void retakeState(int held) {
+    while (held-- > 0) lockState();
+}
+
+void sensorTask(void*) {
+    for (;;) {
+        processEnrollment();
+        processFingerDetection();
+        delay(SENSOR_POLL_MS);
+    }
+}
+
+void typingTask(void*) {
+    for (;;) {
+        uint16_t slot;
+        if (xQueueReceive(typingQueue, &slot, pdMS_TO_TICKS(TYPING_POLL_MS)) == pdTRUE) {
+            typePassword(slot);
+        } else {
+            processQueuedTouch();
+        }
+    }
+}
+
+void commandTask(void*) {
+    for (;;) {
+        cmdHandler.loop();
+        if (restartPending) {
+            delay(100);
+            // Not in the middle of a sensor transfer or a credential
+            TaskLock sensor(sensorLock);
+            TaskLock state(stateLock);
+            TaskLock typing(typingLock);
+            restartWithSnapshot();
+        }
+#if TOUCHPASS_HAS_BLE
+        // The UART service joins the GATT server the first time BLE comes up
+        if (!bleUart.isStarted() && transports.isUp(KB_MODE_BLE) && bleUart.begin(bleLink)) {
+            cmdHandler.attach("ble", &bleUart);
+        }
+#endif
+#if TOUCHPASS_CONFIG_WIFI
+        wifiConfig.poll();
+#endif
+        {
+            TaskLock state(stateLock);
+#if TOUCHPASS_HAS_BLE
+            // Keeps polling once BLE has been up, so a disabled link stays quiet
+            bleLink.poll();
+            saveBleHost();
+#endif
+            noteStateEvents();
+            cmdHandler.pushEvents(events);
+        }
+        delay(1);
+    }
+}
+
+void taskJson(const TaskInfo& t, JsonWriter& out) {
+    out.beginObject();
+    out.field("name", t.name);
+    out.field("core", t.core);
+    out.field("priority", (uint32_t)t.priority);
+    out.field("stackFree", t.handle ? (uint32_t)uxTaskGetStackHighWaterMark(t.handle) : 0);
+    out.endObject();
 }
 
+// setup() has finished; the work moves to the tasks and the Arduino loop task ends
 void loop() {
-    cmdHandler.loop();
-    processEnrollment();
-    processFingerDetection();
+    startTask(sensorTaskInfo, sensorTask);
+    startTask(typingTaskInfo, typingTask);
+    startTask(commandTaskInfo, commandTask);
+    vTaskDelete(NULL);
 }
@@ -0,0 +1,61 @@
+// Just enough of the Arduino core for the firmware's portable headers to
+// build on a host (hosttest.cpp).
+
+#ifndef HOSTTEST_ARDUINO_H
+#define HOSTTEST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+
+inline unsigned long micros() {
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+inline unsigned long millis() { return micros() / 1000; }
+inline void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+class String {
+private:
+    std::string s;
+
+public:
+    String(const char* c = "") : s(c) {}
+    const char* c_str() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+};
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t b) = 0;
+    virtual size_t write(const uint8_t* data, size_t len) {
+        for (size_t i = 0; i < len; i++) write(data[i]);
+        return len;
+    }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+};
+
+class Stream : public Print {
+protected:
+    unsigned long _timeout = 1000;
+
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual size_t readBytes(char* buffer, size_t length) {
+        size_t n = 0;
+        while (n < length && available() > 0) buffer[n++] = (char)read();
+        return n;
+    }
+    size_t readBytes(uint8_t* buffer, size_t length) { return readBytes((char*)buffer, length); }
+    void setTimeout(unsigned long ms) { _timeout = ms; }
+};
+
+#endif // HOSTTEST_ARDUINO_H
@@ -0,0 +1,293 @@
+// hosttest - checks the firmware's portable headers on a host
+//
+// Build:  g++ -std=c++17 -O2 -I. -I../../firmware -I<ArduinoJson>/src hosttest.cpp -lmbedcrypto -o hosttest
+// Usage:  hosttest
+//
+// Covers Totp.h (RFC 6238 vectors, base32, formatting), HidTypist.h (rollover
+// grouping, layouts, dead keys), LineAssembler.h (trimming, binary frames,
+// over-long lines, payload after a line) and JsonWriter.h (escaping,
+// separators, buffer flushes, CBOR) and CredentialCrypto.h (round trip,
+// tampered blobs, blobs moved to another slot or kind). Arduino.h in this directory stands in
+// for the Arduino core; ArduinoJson is the library the sketch builds with,
+// and software mbedtls stands in for the hardware-backed one.
+// Prints each failed check and exits non-zero if there was one.
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "Totp.h"
+#include "HidTypist.h"
+#include "LineAssembler.h"
+#include "JsonWriter.h"
+#include "CredentialCrypto.h"
+
+static int checks = 0;
+static int failures = 0;
+
+#define CHECK(cond)                                                   \
+    do {                                                              \
+        checks++;                                                     \
+        if (!(cond)) {                                                \
+            failures++;                                               \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+        }                                                             \
+    } while (0)
+
+// ===== Totp.h =====
+
+static void testTotp() {
+    int codes = 0;
+    CHECK(totpSelfTest(&codes) == 0);
+    CHECK(codes == 12);
+
+    uint8_t secret[TOTP_MAX_SECRET];
+    int n = base32Decode("GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ", secret, sizeof(secret));
+    CHECK(n == 20 && memcmp(secret, "12345678901234567890", 20) == 0);
+    CHECK(base32Decode("gezd gnbv-gy3t qojq", secret, sizeof(secret)) == 10);
+    CHECK(base32Decode("GEZ1", secret, sizeof(secret)) <= 0);
+
+    char code[9];
+    CHECK(formatTotp(7081804, 8, code) == 8 && strcmp(code, "07081804") == 0);
+    CHECK(formatTotp(1234, 6, code) == 6 && strcmp(code, "001234") == 0);
+
+    TotpConfig cfg = {TOTP_SHA1, 6, 30, TOTP_APPEND, {0, 0, 0}};
+    CHECK(totpConfigValid(cfg));
+    cfg.digits = 9;
+    CHECK(!totpConfigValid(cfg));
+    cfg.digits = 6;
+    cfg.period = 0;
+    CHECK(!totpConfigValid(cfg));
+}
+
+// ===== HidTypist.h =====
+
+struct RecordingSink : ReportSink {
+    std::vector<HidReport> reports;
+
+    bool sendReport(const HidReport& report) override {
+        reports.push_back(report);
+        return true;
+    }
+    bool waitSent(uint32_t) override { return true; }
+
+    bool is(size_t i, uint8_t modifiers, std::vector<uint8_t> keys) const {
+        if (i >= reports.size() || reports[i].modifiers != modifiers) return false;
+        for (size_t k = 0; k < HID_ROLLOVER_KEYS; k++) {
+            if (reports[i].keys[k] != (k < keys.size() ? keys[k] : 0)) return false;
+        }
+        return true;
+    }
+};
+
+static void testHidTypist() {
+    TypingPace pace = {0, 100};
+
+    // Distinct keys with one modifier state share a rollover report
+    RecordingSink abc;
+    HidTypist typist(abc, pace);
+    CHECK(typist.type("abc", 3));
+    CHECK(abc.reports.size() == 4);
+    CHECK(abc.is(0, 0, {0x04}));
+    CHECK(abc.is(1, 0, {0x04, 0x05}));
+    CHECK(abc.is(2, 0, {0x04, 0x05, 0x06}));
+    CHECK(abc.is(3, 0, {}));
+
+    // A modifier change or a repeated key starts a new group
+    RecordingSink mixed;
+    HidTypist(mixed, pace).type("aAa", 3);
+    CHECK(mixed.reports.size() == 6);
+    CHECK(mixed.is(2, HID_MOD_LEFT_SHIFT, {0x04}));
+
+    // Slow pacing keeps fewer keys held
+    TypingPace slow = {50, 100};
+    CHECK(hidMaxHeld(slow) == 3);
+    CHECK(hidMaxHeld(pace) == HID_ROLLOVER_KEYS);
+
+    // Layouts: y and z swap on QWERTZ; characters outside the layout are skipped
+    RecordingSink de;
+    HidTypist(de, pace, hidLayout(HID_LAYOUT_DE)).type("z\x01", 2);
+    CHECK(de.reports.size() == 2);
+    CHECK(de.is(0, 0, {0x1c}));
+
+    // A dead key is tapped on its own, followed by Space
+    RecordingSink caret;
+    HidTypist(caret, pace, hidLayout(HID_LAYOUT_DE)).type("a^", 2);
+    CHECK(caret.reports.size() == 6);
+    CHECK(caret.is(2, 0, {0x35}));
+    CHECK(caret.is(4, 0, {HID_KEY_SPACE}));
+}
+
+// ===== LineAssembler.h =====
+
+struct StringStream : Stream {
+    std::string data;
+    size_t pos = 0;
+
+    void feed(const std::string& s) { data += s; }
+    int available() override { return (int)(data.size() - pos); }
+    int read() override { return pos < data.size() ? (uint8_t)data[pos++] : -1; }
+    int peek() override { return pos < data.size() ? (uint8_t)data[pos] : -1; }
+    size_t write(uint8_t) override { return 1; }
+};
+
+static std::string nextLine(LineAssembler<64>& lines, bool* binary = nullptr) {
+    size_t len;
+    lines.fill();
+    char* line = lines.next(&len, binary);
+    return line ? std::string(line, len) : std::string("<none>");
+}
+
+static void testLineAssembler() {
+    StringStream in;
+    LineAssembler<64> lines;
+    lines.begin(&in);
+
+    in.feed("  {\"cmd\":\"get_status\"}\r\n{\"cmd\":");
+    CHECK(nextLine(lines) == "{\"cmd\":\"get_status\"}");
+    CHECK(nextLine(lines) == "<none>");
+    in.feed("\"x\"}\n");
+    CHECK(nextLine(lines) == "{\"cmd\":\"x\"}");
+
+    // A frame runs between zero bytes and is not trimmed
+    bool binary = false;
+    in.feed(std::string("\0 ab\0", 5));
+    CHECK(nextLine(lines, &binary) == " ab");
+    CHECK(binary);
+
+    // An over-long line is dropped up to its newline
+    in.feed(std::string(100, 'x') + "\nok\n");
+    CHECK(nextLine(lines) == "<none>");
+    CHECK(lines.takeOverflow());
+    CHECK(nextLine(lines) == "ok");
+
+    // Bytes after a line are kept for readBytes()
+    in.feed("import\n\x01\x02\x03");
+    CHECK(nextLine(lines) == "import");
+    uint8_t payload[3] = {0, 0, 0};
+    CHECK(lines.readBytes(payload, 3) == 3);
+    CHECK(payload[0] == 1 && payload[2] == 3);
+}
+
+// ===== JsonWriter.h =====
+
+struct StringPrint : Print {
+    std::string s;
+
+    size_t write(uint8_t b) override {
+        s += (char)b;
+        return 1;
+    }
+    size_t write(const uint8_t* data, size_t len) override {
+        s.append((const char*)data, len);
+        return len;
+    }
+};
+
+static void testJsonWriter() {
+    StringPrint text;
+    {
+        JsonWriter out(text);
+        out.beginObject();
+        out.field("ok", true);
+        out.field("name", "a\"b\\c\n\x01");
+        out.key("ids").beginArray().value(1).value(-2).endArray();
+        out.field("score", 1.5, 1);
+        out.endObject();
+    }
+    CHECK(text.s == "{\"ok\":true,\"name\":\"a\\\"b\\\\c\\n\\u0001\",\"ids\":[1,-2],\"score\":1.5}");
+
+    // Output longer than the buffer arrives whole
+    StringPrint big;
+    {
+        JsonWriter out(big, "{\"id\":1,\"data\":");
+        out.beginArray();
+        for (int i = 0; i < 100; i++) out.value(i);
+        out.endArray();
+        CHECK(out.bytesWritten() > 128);
+    }
+    CHECK(big.s.rfind("{\"id\":1,\"data\":[0,1,2,", 0) == 0);
+    CHECK(big.s.size() > 2 && big.s.compare(big.s.size() - 4, 4, ",99]") == 0);
+
+    // CBOR: indefinite-length map, short text keys, simple values
+    StringPrint cbor;
+    {
+        JsonWriter out(cbor, JSON_CBOR, nullptr, 0);
+        out.beginObject();
+        out.field("ok", false);
+        out.field("n", 24);
+        out.endObject();
+    }
+    const uint8_t expected[] = {CBOR_MAP_START, 0x62, 'o', 'k', CBOR_FALSE, 0x61, 'n', 0x18, 24, CBOR_BREAK};
+    CHECK(cbor.s.size() == sizeof(expected) && memcmp(cbor.s.data(), expected, sizeof(expected)) == 0);
+}
+
+// ===== CredentialCrypto.h =====
+
+static void testCredentialCrypto() {
+    uint8_t secret[CRED_KEY_LEN];
+    for (size_t i = 0; i < sizeof(secret); i++) secret[i] = i;
+    const uint8_t nonce[CRED_NONCE_LEN] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12};
+    const char* pwd = "correct horse battery staple";
+    size_t len = strlen(pwd);
+    uint8_t blob[CRED_MAX_BLOB];
+    SecureBuffer out;
+
+    // Not usable before a key is set
+    CredentialCrypto crypto;
+    CHECK(!crypto.isReady());
+    CHECK(crypto.seal(3, pwd, len, nonce, blob, sizeof(blob)) == 0);
+    CHECK(crypto.begin(secret));
+
+    size_t blobLen = crypto.seal(3, pwd, len, nonce, blob, sizeof(blob));
+    CHECK(blobLen == len + CRED_OVERHEAD);
+    CHECK(blob[0] == CRED_BLOB_VERSION && memcmp(blob + 1, nonce, CRED_NONCE_LEN) == 0);
+    CHECK(memmem(blob, blobLen, pwd, len) == nullptr);
+    CHECK(crypto.open(3, blob, blobLen, out));
+    CHECK(out.length() == len && strcmp(out.c_str(), pwd) == 0);
+
+    // The same secret gives the same key
+    CredentialCrypto again;
+    again.begin(secret);
+    CHECK(again.open(3, blob, blobLen, out) && out.length() == len);
+
+    // Slot and kind are authenticated, and a failed open leaves nothing behind
+    CHECK(!crypto.open(4, blob, blobLen, out));
+    CHECK(out.length() == 0 && out[0] == '\0');
+    CHECK(!crypto.open(3, blob, blobLen, out, CRED_KIND_TOTP));
+    size_t streamLen = crypto.seal(3, pwd, len, nonce, blob, sizeof(blob), CRED_KIND_STREAM);
+    CHECK(!crypto.open(3, blob, streamLen, out));
+    CHECK(crypto.open(3, blob, streamLen, out, CRED_KIND_STREAM));
+
+    // Any changed byte, a cut tag, another version or another key is rejected
+    crypto.seal(3, pwd, len, nonce, blob, sizeof(blob));
+    bool allRejected = true;
+    for (size_t i = 0; i < blobLen; i++) {
+        blob[i] ^= 0x01;
+        if (crypto.open(3, blob, blobLen, out)) allRejected = false;
+        blob[i] ^= 0x01;
+    }
+    CHECK(allRejected);
+    CHECK(!crypto.open(3, blob, blobLen - 1, out));
+    CHECK(!crypto.open(3, blob, CRED_OVERHEAD - 1, out));
+    secret[0] ^= 0x80;
+    CredentialCrypto other;
+    other.begin(secret);
+    CHECK(!other.open(3, blob, blobLen, out));
+
+    // Size limits: the output must fit, and so must the plaintext
+    CHECK(crypto.seal(3, pwd, len, nonce, blob, len + CRED_OVERHEAD - 1) == 0);
+    SecureArray<8> tiny;
+    CHECK(!crypto.open(3, blob, blobLen, tiny));
+    CHECK(crypto.seal(3, pwd, CRED_MAX_SEALED + 1, nonce, blob, sizeof(blob)) == 0);
+}
+
+int main() {
+    testTotp();
+    testHidTypist();
+    testLineAssembler();
+    testJsonWriter();
+    testCredentialCrypto();
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
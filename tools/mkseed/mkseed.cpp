@@ -0,0 +1,233 @@
+// mkseed - build a TouchPass seed image from a CSV manifest
+//
+// Build:  g++ -std=c++17 -O2 -I../../firmware mkseed.cpp -o mkseed
+// Usage:  mkseed manifest.csv -o seed.bin [--verify]
+//
+// The manifest needs a header row. Recognised columns (any order):
+//   slot        sensor slot (default: next free slot, starting at 0)
+//   name        display name (required)
+//   fingerId    0-9 hand mapping, or empty
+//   pressEnter  true/false/1/0/yes/no (default false)
+//   password    optional; encrypted with the device key when adopted
+//
+// --verify re-reads the written image with the firmware's own parser
+// (MetadataImage.h) and compares every entry against the manifest.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "MetadataImage.h"
+
+struct ManifestRow {
+    int slot;
+    std::string name;
+    int fingerId;
+    bool pressEnter;
+    std::string password;
+};
+
+static std::vector<std::string> splitCsvLine(const std::string& line) {
+    std::vector<std::string> fields;
+    std::string field;
+    bool quoted = false;
+
+    for (size_t i = 0; i < line.size(); i++) {
+        char c = line[i];
+        if (quoted) {
+            if (c == '"' && i + 1 < line.size() && line[i + 1] == '"') {
+                field += '"';
+                i++;
+            } else if (c == '"') {
+                quoted = false;
+            } else {
+                field += c;
+            }
+        } else if (c == '"') {
+            quoted = true;
+        } else if (c == ',') {
+            fields.push_back(field);
+            field.clear();
+        } else if (c != '\r') {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return fields;
+}
+
+static std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t");
+    size_t e = s.find_last_not_of(" \t");
+    return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+static bool parseBool(const std::string& s) {
+    return s == "1" || s == "true" || s == "TRUE" || s == "yes" || s == "y";
+}
+
+static bool readManifest(const char* path, std::vector<ManifestRow>* rows) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "mkseed: cannot open %s\n", path);
+        return false;
+    }
+
+    std::string line;
+    if (!std::getline(in, line)) {
+        fprintf(stderr, "mkseed: %s is empty\n", path);
+        return false;
+    }
+
+    int colSlot = -1, colName = -1, colFinger = -1, colEnter = -1, colPassword = -1;
+    std::vector<std::string> header = splitCsvLine(line);
+    for (size_t i = 0; i < header.size(); i++) {
+        std::string h = trim(header[i]);
+        if (h == "slot") colSlot = i;
+        else if (h == "name") colName = i;
+        else if (h == "fingerId") colFinger = i;
+        else if (h == "pressEnter") colEnter = i;
+        else if (h == "password") colPassword = i;
+    }
+    if (colName < 0) {
+        fprintf(stderr, "mkseed: manifest needs a 'name' column\n");
+        return false;
+    }
+
+    int nextSlot = 0;
+    int lineNo = 1;
+    while (std::getline(in, line)) {
+        lineNo++;
+        if (trim(line).empty()) continue;
+        std::vector<std::string> f = splitCsvLine(line);
+        auto col = [&](int c) { return c >= 0 && c < (int)f.size() ? f[c] : std::string(); };
+
+        ManifestRow row;
+        std::string slot = trim(col(colSlot));
+        row.slot = slot.empty() ? nextSlot : atoi(slot.c_str());
+        row.name = trim(col(colName));
+        std::string finger = trim(col(colFinger));
+        row.fingerId = finger.empty() ? -1 : atoi(finger.c_str());
+        row.pressEnter = parseBool(trim(col(colEnter)));
+        row.password = col(colPassword);
+
+        if (row.slot < 0 || row.slot > 0xFFFF) {
+            fprintf(stderr, "mkseed: line %d: bad slot\n", lineNo);
+            return false;
+        }
+        if (row.name.empty() || row.name.size() > SEED_MAX_NAME) {
+            fprintf(stderr, "mkseed: line %d: name must be 1-%d characters\n", lineNo, SEED_MAX_NAME);
+            return false;
+        }
+        if (row.fingerId < -1 || row.fingerId > 9) {
+            fprintf(stderr, "mkseed: line %d: fingerId must be 0-9\n", lineNo);
+            return false;
+        }
+        if (row.password.size() > SEED_MAX_PASSWORD) {
+            fprintf(stderr, "mkseed: line %d: password longer than %d\n", lineNo, SEED_MAX_PASSWORD);
+            return false;
+        }
+        for (const ManifestRow& r : *rows) {
+            if (r.slot == row.slot) {
+                fprintf(stderr, "mkseed: line %d: slot %d used twice\n", lineNo, row.slot);
+                return false;
+            }
+            if (row.fingerId >= 0 && r.fingerId == row.fingerId) {
+                fprintf(stderr, "mkseed: line %d: fingerId %d used twice\n", lineNo, row.fingerId);
+                return false;
+            }
+        }
+
+        rows->push_back(row);
+        nextSlot = row.slot + 1;
+    }
+    return true;
+}
+
+static bool verifyImage(const std::vector<uint8_t>& image, const std::vector<ManifestRow>& rows) {
+    SeedImageReader reader;
+    if (!reader.begin(image.data(), image.size())) {
+        fprintf(stderr, "mkseed: verify: header or CRC rejected\n");
+        return false;
+    }
+
+    SeedEntry e;
+    size_t n = 0;
+    while (reader.next(&e)) {
+        if (n >= rows.size()) break;
+        const ManifestRow& r = rows[n];
+        bool same = e.slot == r.slot && e.fingerId == r.fingerId &&
+                    ((e.flags & SEED_FLAG_PRESS_ENTER) != 0) == r.pressEnter &&
+                    std::string(e.name, e.nameLen) == r.name &&
+                    std::string(e.password, e.passwordLen) == r.password;
+        if (!same) {
+            fprintf(stderr, "mkseed: verify: entry %zu (slot %d) differs\n", n, r.slot);
+            return false;
+        }
+        n++;
+    }
+    if (n != rows.size()) {
+        fprintf(stderr, "mkseed: verify: read %zu of %zu entries\n", n, rows.size());
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* manifest = nullptr;
+    const char* output = nullptr;
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) output = argv[++i];
+        else if (strcmp(argv[i], "--verify") == 0) verify = true;
+        else if (!manifest) manifest = argv[i];
+        else manifest = nullptr, i = argc;
+    }
+    if (!manifest || !output) {
+        fprintf(stderr, "usage: mkseed manifest.csv -o seed.bin [--verify]\n");
+        return 2;
+    }
+
+    std::vector<ManifestRow> rows;
+    if (!readManifest(manifest, &rows)) return 1;
+    if (rows.size() > 0xFFFF) {
+        fprintf(stderr, "mkseed: too many entries\n");
+        return 1;
+    }
+
+    std::vector<SeedEntry> entries;
+    for (const ManifestRow& r : rows) {
+        SeedEntry e;
+        e.slot = r.slot;
+        e.fingerId = r.fingerId;
+        e.flags = r.pressEnter ? SEED_FLAG_PRESS_ENTER : 0;
+        e.name = r.name.c_str();
+        e.nameLen = r.name.size();
+        e.password = r.password.c_str();
+        e.passwordLen = r.password.size();
+        entries.push_back(e);
+    }
+
+    std::vector<uint8_t> image(SEED_HEADER_LEN + SEED_MAX_PAYLOAD);
+    size_t len = writeSeedImage(entries.data(), entries.size(), image.data(), image.size());
+    if (len == 0) {
+        fprintf(stderr, "mkseed: image exceeds %d bytes\n", SEED_MAX_PAYLOAD);
+        return 1;
+    }
+    image.resize(len);
+
+    if (verify && !verifyImage(image, rows)) return 1;
+
+    std::ofstream out(output, std::ios::binary);
+    if (!out.write((const char*)image.data(), image.size())) {
+        fprintf(stderr, "mkseed: cannot write %s\n", output);
+        return 1;
+    }
+    printf("%s: %zu entries, %zu bytes%s\n", output, rows.size(), len, verify ? ", verified" : "");
+    return 0;
+}
@@ -0,0 +1,176 @@
+// protobench - compare the JSON-line and binary (COBS + CBOR) config protocols
+//
+// Build:  g++ -std=c++17 -O2 -I../../firmware protobench.cpp -o protobench
+// Usage:  protobench /dev/ttyACM0 [--count 500] [--cmd get_status]
+//
+// Sends the same parameterless command --count times in each protocol, one
+// at a time (each waits for its reply), and prints commands/sec and the
+// bytes sent and received per command. Uses the firmware's own framing code
+// (BinaryFrame.h). POSIX only.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include "BinaryFrame.h"
+
+struct Totals {
+    size_t sent = 0;
+    size_t received = 0;
+};
+
+// Host-side sink for FrameEncoder
+struct ByteBuffer {
+    std::vector<uint8_t> data;
+    void write(uint8_t b) { data.push_back(b); }
+    void write(const uint8_t* p, size_t n) { data.insert(data.end(), p, p + n); }
+};
+
+static int openPort(const char* path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) return -1;
+    termios tio;
+    if (tcgetattr(fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);  // Ignored by USB CDC, kept for UART bridges
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+    tcflush(fd, TCIOFLUSH);
+    return fd;
+}
+
+static bool writeAll(int fd, const uint8_t* data, size_t len, Totals& t) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+        t.sent += n;
+    }
+    return true;
+}
+
+static int readByte(int fd, Totals& t) {
+    pollfd p = {fd, POLLIN, 0};
+    if (poll(&p, 1, 2000) <= 0) return -1;
+    uint8_t b;
+    if (read(fd, &b, 1) != 1) return -1;
+    t.received++;
+    return b;
+}
+
+static bool jsonRound(int fd, const char* cmd, int id, Totals& t) {
+    char line[128];
+    int n = snprintf(line, sizeof(line), "{\"cmd\":\"%s\",\"id\":%d}\n", cmd, id);
+    if (!writeAll(fd, (const uint8_t*)line, n, t)) return false;
+
+    std::string reply;
+    int b;
+    while ((b = readByte(fd, t)) >= 0) {
+        if (b != '\n') {
+            reply += (char)b;
+            continue;
+        }
+        // Skip stray event lines until our reply
+        if (reply.find("\"id\":" + std::to_string(id) + "}") != std::string::npos) {
+            return reply.find("\"status\":\"ok\"") != std::string::npos;
+        }
+        reply.clear();
+    }
+    return false;
+}
+
+static bool binaryRound(int fd, const char* cmd, int id, Totals& t) {
+    uint8_t packet[128];
+    size_t len = 0;
+    size_t cmdLen = strlen(cmd);
+    if (cmdLen > 100) return false;
+    putLe16(packet, id);
+    len = 2;
+    len += cborHead(CBOR_MAP, 1, packet + len);
+    len += cborHead(CBOR_TEXT, 3, packet + len);
+    memcpy(packet + len, "cmd", 3);
+    len += 3;
+    len += cborHead(CBOR_TEXT, cmdLen, packet + len);
+    memcpy(packet + len, cmd, cmdLen);
+    len += cmdLen;
+
+    ByteBuffer frame;
+    FrameEncoder<ByteBuffer> encoder(frame);
+    encoder.write(packet, len);
+    encoder.finish();
+    if (!writeAll(fd, frame.data.data(), frame.data.size(), t)) return false;
+
+    // Wait for a frame start, then collect up to the closing delimiter
+    std::vector<uint8_t> body;
+    bool inFrame = false;
+    int b;
+    while ((b = readByte(fd, t)) >= 0) {
+        if (b != FRAME_DELIMITER) {
+            if (inFrame) body.push_back(b);
+            continue;
+        }
+        if (!inFrame || body.empty()) {
+            inFrame = true;
+            continue;
+        }
+        int payload = framePayload(body.data(), cobsDecode(body.data(), body.size()));
+        if (payload >= 3 && getLe16(body.data()) == id) {
+            return body[2] == FRAME_STATUS_OK;
+        }
+        body.clear();
+        inFrame = false;
+    }
+    return false;
+}
+
+typedef bool (*RoundFn)(int, const char*, int, Totals&);
+
+static bool run(const char* name, RoundFn round, int fd, const char* cmd, int count) {
+    Totals t;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++) {
+        if (!round(fd, cmd, i & 0x7FFF, t)) {
+            fprintf(stderr, "protobench: %s: no valid reply to request %d\n", name, i);
+            return false;
+        }
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%-7s %8.1f cmd/s  %6.1f B/cmd out  %7.1f B/cmd in\n",
+           name, count / secs, (double)t.sent / count, (double)t.received / count);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* port = nullptr;
+    const char* cmd = "get_status";
+    int count = 500;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--count") == 0 && i + 1 < argc) count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cmd") == 0 && i + 1 < argc) cmd = argv[++i];
+        else if (!port) port = argv[i];
+        else port = nullptr, i = argc;
+    }
+    if (!port || count <= 0) {
+        fprintf(stderr, "usage: protobench /dev/ttyACM0 [--count 500] [--cmd get_status]\n");
+        return 1;
+    }
+
+    int fd = openPort(port);
+    if (fd < 0) {
+        fprintf(stderr, "protobench: cannot open %s\n", port);
+        return 1;
+    }
+
+    printf("%d x %s\n", count, cmd);
+    bool ok = run("json", jsonRound, fd, cmd, count) && run("binary", binaryRound, fd, cmd, count);
+    close(fd);
+    return ok ? 0 : 1;
+}